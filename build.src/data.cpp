@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <array>
 #include <iomanip>
 #include <iostream>
@@ -117,9 +118,22 @@ void DataMap::write(std::ostream &out, const SymbolTable &symbols) {
     writeByte(out, idMap);
     writeWord(out, mapData.size());
 
+    // entries are written sorted by key so the runtime can binary search
+    // them (see hflSortedMaps)
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > entries;
     for (auto iter : mapData) {
-        writeValue(out, origin, iter.first);
-        writeValue(out, origin, iter.second);
+        entries.push_back(std::make_pair(processValue(origin, iter.first, ""),
+                                         processValue(origin, iter.second, "")));
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+            [](const std::pair<std::uint32_t, std::uint32_t> &a,
+               const std::pair<std::uint32_t, std::uint32_t> &b) {
+        return a.first < b.first;
+    });
+
+    for (auto &entry : entries) {
+        writeWord(out, entry.first);
+        writeWord(out, entry.second);
     }
 }
 
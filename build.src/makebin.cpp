@@ -1,9 +1,11 @@
+#include <algorithm>
 #include <ctime>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <set>
 
 #include "build.h"
 #include "symboltable.h"
@@ -93,6 +95,117 @@ void writeLabelValue(std::ostream &out, const std::string &labelName) {
     out.write((const char *)&v, sizeof(std::uint32_t));
 }
 
+// fetch-global and store-global take a two byte slot number; all other
+// operands are four bytes
+static unsigned operandSize(int code) {
+    if (code == opFetchGlobal || code == opStoreGlobal) {
+        return 2;
+    }
+    return 4;
+}
+
+static unsigned statementSize(const Statement &stmt) {
+    const Command *cmd = getCommand(stmt.parts.front().text);
+    return 1 + (stmt.parts.size() - 1) * (cmd ? operandSize(cmd->code) : 4);
+}
+
+
+/* ************************************************************************* *
+ * GLOBAL VARIABLES                                                          *
+ * ************************************************************************* */
+
+const unsigned maxGlobals = 65536;
+
+// Resolves a storage key if it is a number or a symbol that has already been
+// positioned; node addresses and labels aren't known at this point. Temps
+// never count as global variables.
+static bool resolveGlobalKey(const Value &value, std::uint32_t &key) {
+    if (value.type == Value::Integer) {
+        key = value.value;
+    } else if (value.type == Value::Identifier || value.type == Value::Global) {
+        auto label = labels.find(value.text);
+        if (label == labels.end()) {
+            return false;
+        }
+        key = label->second;
+    } else {
+        return false;
+    }
+    return key <= storageFirstTemp - storageTempCount;
+}
+
+static bool isPush(const Statement &stmt) {
+    return stmt.parts.size() == 2 && stmt.parts[0].type == Value::Identifier
+        && stmt.parts[0].text == "push";
+}
+
+static bool isCommand(const Statement &stmt, const std::string &name) {
+    return stmt.parts.size() == 1 && stmt.parts[0].type == Value::Identifier
+        && stmt.parts[0].text == name;
+}
+
+static std::shared_ptr<Statement> makeGlobalStatement(const Origin &origin, const std::string &command, unsigned slot) {
+    std::shared_ptr<Statement> stmt(new Statement);
+    stmt->origin = origin;
+    stmt->commandInfo = getCommand(command);
+    stmt->parts.push_back(Value(command));
+    stmt->parts.push_back(Value(static_cast<int>(slot)));
+    return stmt;
+}
+
+// Finds every "push KEY fetch" and "push KEY push VALUE store" sequence whose
+// key is known before the nodes are positioned, gives each distinct key a
+// slot (in ascending key order) and rewrites the sequences to use
+// fetch-global and store-global. Returns the keys in slot order.
+static std::vector<std::uint32_t> allocateGlobals(GameData &gameData) {
+    std::set<std::uint32_t> keySet;
+    for (auto &node : gameData.nodes) {
+        const auto &statements = node->block->statements;
+        for (unsigned i = 0; i + 1 < statements.size(); ++i) {
+            std::uint32_t key;
+            if (!isPush(*statements[i]) || !resolveGlobalKey(statements[i]->parts[1], key)) {
+                continue;
+            }
+            if (isCommand(*statements[i + 1], "fetch")
+                    || (i + 2 < statements.size() && isPush(*statements[i + 1])
+                        && isCommand(*statements[i + 2], "store"))) {
+                if (keySet.size() < maxGlobals || keySet.count(key)) {
+                    keySet.insert(key);
+                }
+            }
+        }
+    }
+    std::vector<std::uint32_t> keys(keySet.begin(), keySet.end());
+
+    for (auto &node : gameData.nodes) {
+        const auto &statements = node->block->statements;
+        std::vector<std::shared_ptr<Statement> > rewritten;
+        for (unsigned i = 0; i < statements.size(); ++i) {
+            std::uint32_t key;
+            if (isPush(*statements[i]) && resolveGlobalKey(statements[i]->parts[1], key)
+                    && keySet.count(key)) {
+                const unsigned slot = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+                if (i + 1 < statements.size() && isCommand(*statements[i + 1], "fetch")) {
+                    rewritten.push_back(makeGlobalStatement(statements[i]->origin, "fetch-global", slot));
+                    ++i;
+                    continue;
+                }
+                if (i + 2 < statements.size() && isPush(*statements[i + 1])
+                        && isCommand(*statements[i + 2], "store")) {
+                    rewritten.push_back(statements[i + 1]);
+                    rewritten.push_back(makeGlobalStatement(statements[i + 2]->origin, "store-global", slot));
+                    i += 2;
+                    continue;
+                }
+            }
+            rewritten.push_back(statements[i]);
+        }
+        node->block->statements.swap(rewritten);
+    }
+    return keys;
+}
+
+
 template<class T>
 static void doPositioning(std::map<std::string, unsigned> &labels, std::uint32_t &position, std::vector<std::shared_ptr<T> > data) {
     for (std::shared_ptr<T> &c : data) {
@@ -170,6 +283,11 @@ void make_bin(GameData &gameData, const std::string &outputFile, const SymbolTab
     // position remaining game data
     doPositioning(labels, pos, gameData.dataItems);
 
+    // assign global variable slots and reserve space for the globals table
+    const std::vector<std::uint32_t> globalKeys = allocateGlobals(gameData);
+    labels.insert(std::make_pair("__globals", pos));
+    pos += 5 + globalKeys.size() * 4;
+
     for (auto &node : gameData.nodes) {
         const std::string &nodeName = node->name;
         labels.insert(std::make_pair(nodeName, pos));
@@ -194,7 +312,7 @@ void make_bin(GameData &gameData, const std::string &outputFile, const SymbolTab
                     throw BuildError(node->origin, errorMessage.str());
                 }
             } else {
-                size = 1 + (stmt->parts.size() - 1) * 4;
+                size = statementSize(*stmt);
             }
             pos += size;
         }
@@ -223,6 +341,13 @@ void make_bin(GameData &gameData, const std::string &outputFile, const SymbolTab
         dataItem->write(out, symbols);
     }
 
+    // write globals table
+    writeByte(out, idGlobals);
+    writeWord(out, globalKeys.size());
+    for (std::uint32_t key : globalKeys) {
+        writeWord(out, key);
+    }
+
     idByte = idNode;
     for (auto &node : gameData.nodes) {
         const std::string &nodeName = node->name;
@@ -240,7 +365,11 @@ void make_bin(GameData &gameData, const std::string &outputFile, const SymbolTab
             ++cur;
             while (cur != stmt->parts.end()) {
                 uint32_t v = processValue(stmt->origin, *cur, nodeName);
-                out.write((const char *)&v, 4);
+                if (operandSize(cmd->code) == 2) {
+                    writeShort(out, v);
+                } else {
+                    writeWord(out, v);
+                }
                 ++cur;
             }
         }
@@ -264,7 +393,12 @@ void make_bin(GameData &gameData, const std::string &outputFile, const SymbolTab
     v += (aTime->tm_mday);
     writeWord(out, v);
 
-    std::cerr << "Created " << outputFile << ".\n";
+    out.seekp(headerFlags);
+    writeWord(out, hflSortedMaps);
+    out.seekp(headerGlobals);
+    writeLabelValue(out, "__globals");
+
+    std::cerr << "Created " << outputFile << " (" << globalKeys.size() << " global variables).\n";
 
     std::ofstream labelFile("dbg_labels.txt");
     labelFile << "LABELS (" << labels.size() << "):\n" << std::hex << std::setfill('0');
@@ -38,6 +38,8 @@ Command commands[] = {
     { "jump-gte",        opJumpGte,         0 },
     { "store",           opStore,           0 },
     { "fetch",           opFetch,           0 },
+    { "fetch-global",    opFetchGlobal,     1 },
+    { "store-global",    opStoreGlobal,     1 },
     { "add-items",       opAddItems,        0 },
     { "remove-items",    opRemoveItems,     0 },
     { "item-qty",        opItemQty,         0 },
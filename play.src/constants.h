@@ -13,14 +13,20 @@ const int headerDamageTypes = 0x1C;
 const int headerWeaponSlot  = 0x20;
 const int headerBuildNumber = 0x24;
 const int headerChecksum    = 0x28;
+const int headerFlags       = 0x2C;
+const int headerGlobals     = 0x30;
 const int headerSize        = 64;
 
+// GameFile Header Flags
+const int hflSortedMaps     = 0x01; // map entries are sorted by key
+
 // Data Type IDs
 const int idString          = 0xFF;
 const int idNode            = 0xFE;
 const int idList            = 0xF9;
 const int idMap             = 0xF8;
 const int idObject          = 0xF6;
+const int idGlobals         = 0xF5;
 
 // Property Type IDs
 const int pidInteger        = 0x7F;
@@ -148,7 +154,9 @@ enum Opcodes {
     opItemQty         = 0x1E,
     opListSize        = 0x1F,
     opListGet         = 0x20,
-/*  unused              0x21 - 0x24 */
+    opFetchGlobal     = 0x21,
+    opStoreGlobal     = 0x22,
+/*  unused              0x23 - 0x24 */
     opResetCharacter  = 0x25,
     opGetSex          = 0x26,
     opSetSex          = 0x27,
@@ -1,4 +1,5 @@
 #include <cctype>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <ncurses.h>
@@ -7,28 +8,17 @@
 #include <vector>
 
 #include "play.h"
+#include "../profiler.h"
 
-const int maxOutputBuffer = 4096;
 char gamefile[64] = "game.bin";
 
-std::string outputBuffer;
 std::ofstream *transcript = nullptr;
 
 void addToOutput(const std::string &text) {
     if (transcript) {
         *transcript << text;
     }
-    if (outputBuffer[outputBuffer.size()-1] != '\n') {
-        outputBuffer += '\n';
-    }
-    outputBuffer += text;
-    if (outputBuffer.size() > maxOutputBuffer) {
-        outputBuffer.erase(0, outputBuffer.size() - maxOutputBuffer);
-    }
-}
-
-const std::string& getOutput() {
-    return outputBuffer;
+    addToHistory(text);
 }
 
 void drawStatus(Game &game) {
@@ -45,11 +35,15 @@ void drawStatus(Game &game) {
 }
 
 static void drawCombatTracker(Game &game) {
+    // reused for every name so redrawing allocates nothing once it has grown
+    static std::string name;
+
     unsigned maxNameLength = 0;
     for (const auto &whoIdent : game.combatants) {
-        auto length = game.getNameOf(whoIdent).size();
-        if (length > maxNameLength) {
-            maxNameLength = length;
+        name.clear();
+        game.appendNameOf(name, whoIdent);
+        if (name.size() > maxNameLength) {
+            maxNameLength = name.size();
         }
     }
     unsigned skillsToShow = 0;
@@ -105,7 +99,12 @@ static void drawCombatTracker(Game &game) {
         if (whoCounter == game.currentCombatant) {
             mvaddch(top+whoCounter+1, left+2, '*');
         }
-        mvprintw(top+whoCounter+1, left+4, "%s", toUpperFirst(game.getNameOf(whoIdent)).c_str());
+        name.clear();
+        game.appendNameOf(name, whoIdent);
+        if (!name.empty()) {
+            name[0] = toupper(name[0]);
+        }
+        mvprintw(top+whoCounter+1, left+4, "%s", name.c_str());
 
         unsigned shownSkills = 0;
         for (int sklCounter = 0; true; ++sklCounter) {
@@ -127,15 +126,73 @@ static void drawCombatTracker(Game &game) {
     }
 }
 
+// Writes the profile gathered so far to profile.txt and profile.csv.
+static void dumpProfile(const Profiler &profiler) {
+    if (profiler.dump("profile")) {
+        addToOutput("\n[Profile written to profile.txt and profile.csv.]");
+    } else {
+        showMessageBox("Could not write profile.");
+    }
+}
+
+// Asks for a save file name; returns an empty string if it isn't usable.
+static std::string getSaveFilename(const std::string &prompt) {
+    std::string filename = getString(prompt, 32, "game.sav");
+    if (filename.find_first_of("/\\:") != std::string::npos) {
+        std::stringstream ss;
+        ss << "\"" << filename << "\" is not a valid filename.";
+        showMessageBox(ss.str());
+        return "";
+    }
+    return filename;
+}
+
+static void saveGame(const Game &game) {
+    const std::string filename = getSaveFilename("Save to file:");
+    if (filename.empty()) return;
+    std::ofstream out(filename, std::ios::binary);
+    try {
+        game.saveState(out);
+        addToOutput("\n[Game saved.]");
+    } catch (PlayError &e) {
+        showMessageBox(e.what());
+    }
+}
+
+static void restoreGame(Game &game) {
+    const std::string filename = getSaveFilename("Restore from file:");
+    if (filename.empty()) return;
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) {
+        showMessageBox("Could not open " + filename + ".");
+        return;
+    }
+    try {
+        game.restoreState(in);
+        addToOutput("\n[Game restored.]");
+        addToOutput(game.getOutput());
+    } catch (PlayError &e) {
+        showMessageBox(e.what());
+    }
+}
+
 void gameloop() {
     Game game;
+    Profiler profiler;
 
+    // setting GTRPGE_SEED makes the game replay the same way every time
+    if (const char *seed = getenv("GTRPGE_SEED")) {
+        game.setRandomSeed(strtoull(seed, nullptr, 0));
+    }
     game.loadDataFromFile(gamefile);
+    game.setUndoLimit(100, 256 * 1024);
     addToOutput(game.getOutput());
 
     while (true) {
+        // erase rather than clear so refresh only sends the parts of the
+        // screen that changed instead of repainting the whole terminal
         bkgdset(A_NORMAL | COLOR_PAIR(colorMain));
-        clear();
+        erase();
         drawStatus(game);
         drawOutput(game);
         drawOptions(game);
@@ -164,17 +221,41 @@ void gameloop() {
                     addToOutput("\n[Transcript on.]");
                 }
             }
+        } else if (key == 'P') {
+            if (game.getProfiler()) {
+                game.setProfiler(nullptr);
+                dumpProfile(profiler);
+            } else {
+                profiler.reset();
+                profiler.loadLabels("dbg_labels.txt");
+                game.setProfiler(&profiler);
+                addToOutput("\n[Profiling on.]");
+            }
         } else if (key == ' ') {
             if (game.options.size() == 1) {
                 game.doOption(0);
                 addToOutput(game.getOutput());
             }
+        } else if (key == 'S' && game.actionAllowed()) {
+            saveGame(game);
+        } else if (key == 'R') {
+            restoreGame(game);
+        } else if (key == 'U') {
+            if (game.undo()) {
+                addToOutput("\n[Undone.]");
+                addToOutput(game.getOutput());
+            } else {
+                showMessageBox("Nothing to undo.");
+            }
         } else if (key == 'I' && game.actionAllowed()) {
             doInventory(game);
         } else if (key == 'C' && game.actionAllowed()) {
             doCharacter(game);
         } else if (key == 'Q') {
             if (getYesNo("Are you sure you want to quit?", false)) {
+                if (game.getProfiler()) {
+                    profiler.dump("profile");
+                }
                 return;
             }
         }
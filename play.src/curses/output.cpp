@@ -1,5 +1,8 @@
+#include <cctype>
+#include <deque>
 #include <ncurses.h>
-#include <sstream>
+#include <string>
+#include <vector>
 
 #include "play.h"
 
@@ -14,18 +17,25 @@ void drawOptions(Game &game) {
         clrtoeol();
     }
 
+    // reused for every option so redrawing allocates nothing once it has grown
+    static std::string line;
+
     int num = 1, counter = 0;
     for (auto &option : game.options) {
-        std::stringstream ss;
-        ss << (num++) << ") ";
+        line = std::to_string(num++);
+        line += ") ";
         if (option.name == optionNameContinue) {
-            ss << "Continue";
+            line += "Continue";
         } else if (option.name == optionNameCancel) {
-            ss << "Cancel";
+            line += "Cancel";
         } else if (option.name == optionDoNothing) {
-            ss << "Do nothing";
+            line += "Do nothing";
         } else {
-            ss << toUpperFirst(game.getNameOf(option.name));
+            const size_t nameStart = line.size();
+            game.appendNameOf(line, option.name);
+            if (line.size() > nameStart) {
+                line[nameStart] = toupper(line[nameStart]);
+            }
         }
         int x, y = 0;
         if (counter < 5) {
@@ -36,7 +46,46 @@ void drawOptions(Game &game) {
             y = maxY - 5 + (counter - 5);
         }
         ++counter;
-        mvprintw(y, x, ss.str().c_str());
+        mvprintw(y, x, "%s", line.c_str());
+    }
+}
+
+// The output history as paragraphs (the non-blank lines of everything added),
+// each holding its lines as last wrapped. A paragraph is only wrapped when it
+// is first drawn or the terminal width has changed since, so drawing costs
+// the same however much history there is.
+struct Paragraph {
+    explicit Paragraph(const std::string &text)
+    : text(text), wrapWidth(0)
+    { }
+
+    std::string text;
+    unsigned wrapWidth;     // 0 if not wrapped yet
+    std::vector<std::string> lines;
+};
+
+static const size_t maxHistory = 4096;
+static std::deque<Paragraph> history;
+static size_t historySize = 0;  // counting a newline after each paragraph
+
+void addToHistory(const std::string &text) {
+    for (const std::string &line : explodeString(text)) {
+        if (!line.empty()) {
+            history.push_back(Paragraph(line));
+            historySize += line.size() + 1;
+        }
+    }
+
+    while (historySize > maxHistory) {
+        if (history.size() > 1) {
+            historySize -= history.front().text.size() + 1;
+            history.pop_front();
+        } else {
+            Paragraph &only = history.front();
+            only.text.erase(0, historySize - maxHistory);
+            only.wrapWidth = 0;
+            historySize = maxHistory;
+        }
     }
 }
 
@@ -44,19 +93,18 @@ void drawOutput(Game &game) {
     int maxX = 0, maxY = 0;
     getmaxyx(stdscr, maxY, maxX);
     bkgdset(A_NORMAL | COLOR_PAIR(colorMain));
-    auto lines = explodeString(getOutput());
 
     const int maxLines = maxY-6;
     int lineCount = 0;
 
-    while (!lines.empty() && lines.back().empty()) {
-        lines.pop_back();
-    }
-
-    for (int i = lines.size() - 1; i >= 0 && lineCount < maxLines; --i) {
-        auto paragraph = wrapString(lines[i], maxX);
-        for (int j = paragraph.size() - 1; j >= 0 && lineCount < maxLines; --j) {
-            mvprintw(maxLines-lineCount, 0, paragraph[j].c_str());
+    for (auto paragraph = history.rbegin(); paragraph != history.rend() && lineCount < maxLines; ++paragraph) {
+        if (paragraph->wrapWidth != static_cast<unsigned>(maxX)) {
+            paragraph->lines = wrapString(paragraph->text, maxX);
+            paragraph->wrapWidth = maxX;
+        }
+        const auto &lines = paragraph->lines;
+        for (int j = lines.size() - 1; j >= 0 && lineCount < maxLines; --j) {
+            mvprintw(maxLines-lineCount, 0, "%s", lines[j].c_str());
             ++lineCount;
         }
         ++lineCount;
@@ -5,9 +5,9 @@
 #include "../play.h"
 
 void addToOutput(const std::string &text);
-const std::string& getOutput();
 void drawStatus(Game &game);
 
+void addToHistory(const std::string &text);
 void drawOutput(Game &game);
 void drawOptions(Game &game);
 
@@ -1,10 +1,12 @@
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <cstring>
 #include <cstdlib>
 #include <ctime>
 #include <iomanip>
 #include <fstream>
+#include <random>
 #include <sstream>
 
 #include "play.h"
@@ -13,7 +15,7 @@
 int Game::roll(int dice, int sides) {
     int result = 0;
     for (int i = 0; i < dice; ++i) {
-        result += 1 + rand() % sides;
+        result += 1 + rng.below(sides);
     }
     return result;
 }
@@ -24,62 +26,51 @@ int Game::roll(int dice, int sides) {
  * ************************************************************************* */
 
 void Game::loadDataFromFile(const std::string &filename) {
-    std::ifstream inf(filename, std::ios::binary | std::ios::in | std::ios::ate);
-    if (!inf) {
-        throw PlayError("Could not read game data from "+filename+".");
-    }
-    std::streamsize size = inf.tellg();
-    inf.seekg(0);
-
-    data = new std::uint8_t[size];
-    if (!inf.read((char*)data, size)) {
-        throw PlayError("Could not read game data.");
-    }
-
-    dataSize = size;
+    startWithImage(GameImage::loadFromFile(filename));
+}
 
+// Starts a new session on an already loaded image; the image may be shared
+// with any number of other sessions.
+void Game::startWithImage(std::shared_ptr<const GameImage> image) {
+    useImage(std::move(image));
     doGameSetup();
 }
 
-void Game::setDataAs(uint8_t *data, size_t size) {
-    uint8_t *dataCopy = static_cast<uint8_t*>(malloc(size));
-    memcpy(dataCopy, data, size);
-    this->data = dataCopy;
-    this->dataSize = size;
+// Sets the image without starting the game, ready for restoreState.
+void Game::useImage(std::shared_ptr<const GameImage> image) {
+    this->image = std::move(image);
+    globals.assign(this->image->getGlobalCount(), 0);
+
+    // room for a stat block for every character the game defines, so the
+    // arena normally never has to move
+    statBlockSize = getSkillCount() * 3 + getDamageTypeCount();
+    unsigned characterCount = 0;
+    for (std::uint32_t objRef : this->image->getObjectList()) {
+        if (getObjectProperty(objRef, propClass) == ocCharacter) {
+            ++characterCount;
+        }
+    }
+    statArena.clear();
+    statArena.reserve(characterCount * statBlockSize);
+}
+
+// Wraps a copy of an in-memory game image without starting the game; used by
+// tests that need to exercise the data accessors directly.
+void Game::setDataAs(const uint8_t *data, size_t size) {
+    useImage(GameImage::fromMemory(data, size));
+}
 
-    doGameSetup();
+static std::uint64_t clockSeed() {
+    std::random_device device;
+    std::uint64_t seed = device();
+    seed = (seed << 32) ^ device();
+    return seed ^ std::chrono::steady_clock::now().time_since_epoch().count();
 }
 
 void Game::doGameSetup() {
-    const int skillTable = readWord(headerSkillTable);
-    const int skillCount = readByte(skillTable);
-    for (int i = 0; i < skillCount; ++i) {
-        const int skillSrc = skillTable + i * sklSize + 1;
-        SkillDef skillDef;
-        skillDef.nameAddress    = readWord(skillSrc + sklName);
-        if (readWord(skillSrc + sklName) == 0) {
-            continue;
-        }
-        skillDef.baseSkill      = readWord(skillSrc + sklBaseSkill);
-        skillDef.flags          = readWord(skillSrc + sklFlags);
-        skillDef.defaultValue   = readWord(skillSrc + sklDefault);
-        skillDef.recoveryRate   = readWord(skillSrc + sklRecovery);
-        skillDefs.push_back(std::move(skillDef));
-    }
-    say(skillDefs.size());
+    say(getSkillCount());
     say("\n");
 
-    const int damageTypeTable = readWord(headerDamageTypes);
-    const int dtCount = readByte(damageTypeTable);
-    for (int i = 0; i < dtCount; ++i) {
-        const int typeSrc = damageTypeTable + 1 + i * damageTypeSize;
-        DamageType dType;
-        dType.nameAddress = readWord(typeSrc);
-        if (dType.nameAddress) {
-            damageTypes.push_back(std::move(dType));
-        }
-    }
-
     location = 0;
     isRunning = true;
     say(getString(readWord(headerTitle)));
@@ -88,7 +79,7 @@ void Game::doGameSetup() {
     say(")\n");
     say(getString(readWord(headerByline)));
     say("\n\n");
-    srand(time(nullptr));
+    rng.seed(hasFixedSeed ? randomSeed : clockSeed());
     doScene(readWord(headerStartNode));
 }
 
@@ -98,25 +89,19 @@ void Game::doGameSetup() {
  * ************************************************************************* */
 
 int Game::getSkillCount() const {
-    return skillDefs.size();
+    return image->getSkillCount();
 }
 
 const SkillDef* Game::getSkillDef(unsigned skillNo) const {
-    if (skillNo >= skillDefs.size()) {
-        return nullptr;
-    }
-    return &skillDefs[skillNo];
+    return image->getSkillDef(skillNo);
 }
 
 int Game::getDamageTypeCount() const {
-    return damageTypes.size();
+    return image->getDamageTypeCount();
 }
 
 const DamageType* Game::getDamageType(unsigned damageTypeNo) const {
-    if (damageTypeNo >= damageTypes.size()) {
-        return nullptr;
-    }
-    return &damageTypes[damageTypeNo];
+    return image->getDamageType(damageTypeNo);
 }
 
 /* ************************************************************************* *
@@ -124,13 +109,13 @@ const DamageType* Game::getDamageType(unsigned damageTypeNo) const {
  * ************************************************************************* */
 
 void Game::clearOutput() {
-    outputBuffer = "";
+    output.clear();
 }
 
-std::string Game::getOutput() const {
-    std::string text = outputBuffer;
-    tidyString(text);
-    return trim(text);
+// The output is tidied as it's produced, so this is just a reference to it;
+// it's only valid until the game next does something.
+const std::string& Game::getOutput() const {
+    return output.str();
 }
 
 std::string Game::getTimeString(bool exact) {
@@ -165,143 +150,86 @@ std::string Game::getTimeString(bool exact) {
 }
 
 int Game::getType(std::uint32_t address) const {
-    return readByte(address);
+    return image->getType(address);
 }
 
 bool Game::isType(std::uint32_t address, uint8_t type) const {
-    return readByte(address) == type;
+    return image->isType(address, type);
 }
 
 std::uint8_t Game::readByte(std::uint32_t pos) const {
-    if (!data) return 0;
-    if (pos >= dataSize) throw PlayError("Tried to read past end of file.");
-    return (uint8_t)data[pos];
+    if (!image) return 0;
+    return image->readByte(pos);
 }
 
 std::uint16_t Game::readShort(std::uint32_t pos) const {
-    if (!data) return 0;
-    if (pos >= dataSize) throw PlayError("Tried to read past end of file.");
-    std::uint16_t v = 0;
-    v |= (unsigned char)data[pos];
-    v |= (unsigned char)data[pos+1] << 8;
-    return v;
+    if (!image) return 0;
+    return image->readShort(pos);
 }
 
 std::uint32_t Game::readWord(std::uint32_t pos) const {
-    if (!data) return 0;
-    if (pos >= dataSize) throw PlayError("Tried to read past end of file.");
-    std::uint32_t result = 0, value;
-    value = data[pos];  result |= value;
-    value = data[pos+1];  result |= value << 8;
-    value = data[pos+2];  result |= value << 16;
-    value = data[pos+3];  result |= value << 24;
-    return result;
+    if (!image) return 0;
+    return image->readWord(pos);
 }
 
 const char *Game::getString(std::uint32_t address) const {
-    if (!isType(address, idString)) {
-        std::stringstream ss;
-        ss << "Tried to read non-string at address 0x" << std::hex << std::uppercase << address;
-        ss << " as a string.";
-        throw PlayError(ss.str());
-    }
-    return reinterpret_cast<const char*>(&data[address+1]);
+    return image->getString(address);
 }
 
 std::uint32_t Game::getFromMap(std::uint32_t address, std::uint32_t value) const {
-    if (!isType(address, idMap)) {
-        throw PlayError("Tried to get value from non-map");
-    }
-
-    std::uint32_t mapSize = readWord(address + gmapCount);
-    for (unsigned int i = 0; i < mapSize; ++i) {
-        std::uint32_t key = readWord(address + gmapHeader + i * gmapEntrySize);
-        if (key == value) {
-            return readWord(address + 5 + i * 8 + 4);
-        }
-    }
-    return 0;
+    return image->getFromMap(address, value);
 }
 
 bool Game::mapHasValue(std::uint32_t address, std::uint32_t value) const {
-    if (!isType(address, idMap)) {
-        throw PlayError("Tried to check for key in non-map");
-    }
-
-    std::uint32_t mapSize = readWord(address + gmapCount);
-    for (unsigned int i = 0; i < mapSize; ++i) {
-        std::uint32_t key = readWord(address + gmapHeader + i * gmapEntrySize);
-        if (key == value) {
-            return true;
-        }
-    }
-    return false;
+    return image->mapHasValue(address, value);
 }
 
 std::uint32_t Game::getObjectProperty(std::uint32_t objRef, std::uint16_t propId) {
-    if (!isType(objRef, idObject)) {
-        throw PlayError("Tried to get property of non-object");
-    }
-
-    const int count = readShort(objRef + 1);
-    const std::uint32_t firstProperty = objRef + 3;
-    for (int i = 0; i < count; ++i) {
-        const std::uint32_t currentProperty = firstProperty + objPropSize * i;
-        if (propId == readShort(currentProperty + objPropId)) {
-            return readWord(currentProperty + objPropValue);
-        }
-    }
-
-    return 0;
+    return image->getObjectProperty(objRef, propId);
 }
 
 bool Game::objectHasProperty(std::uint32_t objRef, std::uint16_t propId) {
-    if (!isType(objRef, idObject)) {
-        throw PlayError("Tried to test property of non-object");
-    }
-
-    const int count = readShort(objRef + 1);
-    const std::uint32_t firstProperty = objRef + 3;
-    for (int i = 0; i < count; ++i) {
-        const std::uint32_t currentProperty = firstProperty + objPropSize * i;
-        if (propId == readShort(currentProperty + objPropId)) {
-            return true;
-        }
-    }
-
-    return false;
+    return image->objectHasProperty(objRef, propId);
 }
 
 std::string Game::getNameOf(std::uint32_t address) {
-    std::stringstream ss;
+    std::string name;
+    appendNameOf(name, address);
+    return name;
+}
 
+// Adds the name of address to the end of text. Strings come straight from
+// the image and object names from its cache, so nothing is allocated beyond
+// what text needs to grow.
+void Game::appendNameOf(std::string &text, std::uint32_t address) {
     int type = getType(address);
     switch(type) {
         case idString:
-            return getString(address);
+            text += getString(address);
+            return;
         case idObject: {
-            std::uint32_t name = getObjectProperty(address, propName);
-            if (name == 0) {
-                ss << "[ObjectDef@" << std::hex << std::uppercase << address << "]";
+            const std::string *name = image->findObjectName(address);
+            if (name) {
+                text += *name;
             } else {
-                std::uint32_t article = getObjectProperty(address, propArticle);
-                if (article) {
-                    ss << getString(article);
-                }
-                ss << getString(name);
+                text += image->composeObjectName(address);
             }
-            return ss.str(); }
+            return; }
         default: {
             std::stringstream ss;
             ss << "[object#";
             ss << std::hex << std::uppercase << address;
             ss << '/' << (int) type << ']';
-            return ss.str();
+            text += ss.str();
         }
     }
 }
 
 std::string Game::getPronoun(std::uint32_t cRef, int pronounType) {
+    return pronounOf(cRef, pronounType);
+}
+
+const char* Game::pronounOf(std::uint32_t cRef, int pronounType) {
     if (getObjectProperty(cRef, propClass) != ocCharacter) {
         throw PlayError("Tried to get pronoun for non-character");
     }
@@ -310,43 +238,46 @@ std::string Game::getPronoun(std::uint32_t cRef, int pronounType) {
 }
 
 bool Game::addItems(int qty, std::uint32_t itemIdent) {
-    for (unsigned i = 0; i < inventory.size(); ++i) {
-        if (inventory[i].itemIdent == itemIdent) {
-            inventory[i].qty += qty;
-            return true;
+    const int index = inventory.find(itemIdent);
+    if (index >= 0) {
+        if (journaling()) {
+            journal(JournalEntry::Inventory, itemIdent, index + 1, inventory[index].qty);
         }
+        inventory.setQty(index, inventory[index].qty + qty);
+        return true;
+    }
+    if (journaling()) {
+        journal(JournalEntry::Inventory, itemIdent, 0, 0);
     }
-    inventory.push_back(CarriedItem(qty, itemIdent));
-    std::sort(inventory.begin(), inventory.end(), [this](const Game::CarriedItem &a, const Game::CarriedItem &b) {
-        const char *aName = getString(getObjectProperty(a.itemIdent, propName));
-        const char *bName = getString(getObjectProperty(b.itemIdent, propName));
-        return strcmp(aName, bName) < 0;
-    });
+    inventory.insert(CarriedItem(qty, itemIdent), itemSortKey(itemIdent));
     return true;
 }
 
+// The inventory is kept in order of item name. Items the image could not
+// place by name (unindexed or unnamed objects) go after the rest.
+std::uint32_t Game::itemSortKey(std::uint32_t itemIdent) const {
+    const int order = image->getNameOrder(itemIdent);
+    return order < 0 ? 0xFFFFFFFF : order;
+}
+
 bool Game::removeItems(int qty, std::uint32_t itemIdent) {
-    for (auto ci = inventory.begin(); ci != inventory.end(); ++ci) {
-        if (ci->itemIdent == itemIdent) {
-            if (ci->qty >= qty) {
-                ci->qty -= qty;
-                if (ci->qty <= 0) {
-                    inventory.erase(ci);
-                }
-                return true;
-            }
-        }
+    const int index = inventory.find(itemIdent);
+    if (index < 0 || inventory[index].qty < qty) {
+        return false;
     }
-    return false;
+    if (journaling()) {
+        journal(JournalEntry::Inventory, itemIdent, index + 1, inventory[index].qty);
+    }
+    inventory.setQty(index, inventory[index].qty - qty);
+    if (inventory[index].qty <= 0) {
+        inventory.erase(index);
+    }
+    return true;
 }
 
 int Game::itemQty(std::uint32_t itemIdent) {
-    for (CarriedItem &ci : inventory) {
-        if (ci.itemIdent == itemIdent) {
-            return ci.qty;
-        }
-    }
-    return 0;
+    const int index = inventory.find(itemIdent);
+    return index < 0 ? 0 : inventory[index].qty;
 }
 
 Game::Character* Game::getCharacter(std::uint32_t address) {
@@ -354,29 +285,55 @@ Game::Character* Game::getCharacter(std::uint32_t address) {
         address = party[address];
     }
 
-    auto theChar = characters.find(address);
-    if (theChar != characters.end()) {
-        return theChar->second;
+    Character *c = findCharacter(address);
+    if (c) {
+        return c;
     }
 
     resetCharacter(address);
-    theChar = characters.find(address);
-    if (theChar != characters.end()) {
-        return theChar->second;
-    }
-    return nullptr;
+    return findCharacter(address);
 }
 
 const Game::Character* Game::getCharacter(std::uint32_t address) const {
     if (address < party.size()) {
         address = party[address];
     }
+    return findCharacter(address);
+}
+
+// Returns the pool index of cRef's record, or -1 if it has none yet.
+int Game::findCharacterIndex(std::uint32_t cRef) const {
+    const int objectSlot = image->findObjectSlot(cRef);
+    if (objectSlot < 0 || static_cast<unsigned>(objectSlot) >= characterSlots.size()) {
+        return -1;
+    }
+    return static_cast<int>(characterSlots[objectSlot]) - 1;
+}
 
-    auto theChar = characters.find(address);
-    if (theChar != characters.end()) {
-        return theChar->second;
+Game::Character* Game::findCharacter(std::uint32_t cRef) {
+    const int index = findCharacterIndex(cRef);
+    return index < 0 ? nullptr : &characterPool[index];
+}
+
+const Game::Character* Game::findCharacter(std::uint32_t cRef) const {
+    const int index = findCharacterIndex(cRef);
+    return index < 0 ? nullptr : &characterPool[index];
+}
+
+// Adds a record to the end of the pool along with a zeroed stat block.
+Game::Character& Game::addCharacter() {
+    characterPool.push_back(Character());
+    statArena.resize(characterPool.size() * statBlockSize, 0);
+    pointStatsAtArena();
+    return characterPool.back();
+}
+
+// Points every pooled character at its block of the stat arena; needed
+// whenever the arena may have moved.
+void Game::pointStatsAtArena() {
+    for (unsigned i = 0; i < characterPool.size(); ++i) {
+        characterPool[i].stats = statArena.data() + i * statBlockSize;
     }
-    return nullptr;
 }
 
 void Game::doRest(int forTime) {
@@ -407,7 +364,7 @@ void Game::doRest(int forTime) {
                     say(-result);
                 }
                 say(" ");
-                say(getNameOf(readWord(readWord(headerSkillTable) + skillNumber*sklSize + sklName)));
+                sayNameOf(readWord(readWord(headerSkillTable) + skillNumber*sklSize + sklName));
                 say(". ");
             }
         }
@@ -416,6 +373,22 @@ void Game::doRest(int forTime) {
 }
 
 bool Game::isKOed(std::uint32_t cRef) {
+    Character *c = getCharacter(cRef);
+    if (!c) return calcKOed(cRef);
+
+    if (!c->koValid) {
+        c->koed = calcKOed(cRef);
+        c->koValid = true;
+    }
+#ifdef GTRPGE_CHECK_STAT_CACHE
+    if (c->koed != calcKOed(cRef)) {
+        throw PlayError("Cached KO status is out of date");
+    }
+#endif
+    return c->koed;
+}
+
+bool Game::calcKOed(std::uint32_t cRef) {
     for (int i = 0; i < getSkillCount(); ++i) {
         const SkillDef *skillDef = getSkillDef(i);
         if (skillDef == nullptr) continue;
@@ -437,41 +410,58 @@ int Game::skillRecoveryRate(int skillNo) {
 }
 
 void Game::resetCharacter(std::uint32_t cRef) {
-    auto oldChar = characters.find(cRef);
-    if (oldChar != characters.end()) {
-        delete oldChar->second;
-        characters.erase(cRef);
+    const std::uint32_t sex = getObjectProperty(cRef, propSex);
+    const int objectSlot = image->findObjectSlot(cRef);
+    if (objectSlot < 0) {
+        throw PlayError("Tried to use non-object as character");
+    }
+
+    // reuse the character's existing record if it has one
+    if (characterSlots.size() != image->getObjectList().size()) {
+        characterSlots.resize(image->getObjectList().size(), 0);
+    }
+    unsigned &poolSlot = characterSlots[objectSlot];
+    if (poolSlot == 0) {
+        addCharacter();
+        poolSlot = characterPool.size();
+        if (journaling()) {
+            journal(JournalEntry::NewCharacter, poolSlot - 1, 0, 0);
+        }
+    } else if (journaling()) {
+        UndoTurn &turn = undoHistory.back();
+        journal(JournalEntry::ResetCharacter, poolSlot - 1, turn.records.size(), 0);
+        const Character &old = characterPool[poolSlot - 1];
+        turn.records.push_back(old);
+        turn.records.back().stats = nullptr;
+        turn.recordStats.insert(turn.recordStats.end(), old.stats, old.stats + statBlockSize);
     }
 
-    Character *c = new Character;
+    Character *c = &characterPool[poolSlot - 1];
     c->def = cRef;
-    c->sex = getObjectProperty(cRef, propSex);
+    c->sex = sex;
     c->species = getObjectProperty(cRef, propSpecies);
-    characters.insert(std::make_pair(cRef, c));
+    c->skillCount = getSkillCount();
+    std::fill(c->stats, c->stats + statBlockSize, 0);
+    c->gear.clear();
+    invalidateStats(c);
 
     std::uint32_t skillsMap = getObjectProperty(c->def, propSkills);
-    for (int i = 0; i < getDamageTypeCount(); ++i) {
-        c->resistAdj[i] = 0;
-    }
     for (int i = 0; i < getSkillCount(); ++i) {
-        c->skillAdj[i] = 0;
-        c->skillCur[i] = 0;
-
         const SkillDef *skillDef = getSkillDef(i);
         if (skillDef == nullptr) continue;
 
         if (skillsMap != 0) {
             if (skillDef->testFlags(sklVariable)) {
                 if (skillDef->testFlags(sklKOFull)) {
-                    c->skillCur[i] = 0;
+                    c->skillCur(i) = 0;
                 } else {
                     if (mapHasValue(skillsMap, i)) {
-                        c->skillCur[i] = getFromMap(skillsMap, i);
+                        c->skillCur(i) = getFromMap(skillsMap, i);
                     } else {
-                        c->skillCur[i] = skillDef->defaultValue;
+                        c->skillCur(i) = skillDef->defaultValue;
                     }
                     if (skillDef->testFlags(sklX5)) {
-                        c->skillCur[i] *= sklX5Multiplier;
+                        c->skillCur(i) *= sklX5Multiplier;
                     }
                 }
             }
@@ -484,7 +474,10 @@ void Game::resetCharacter(std::uint32_t cRef) {
         for (int i = 0; i < count; ++i) {
             std::uint32_t itemRef = readWord(gearList+2+i*4);
             std::uint32_t slot = getObjectProperty(itemRef, propSlot);
-            c->gear.insert(std::make_pair(slot, itemRef));
+            if (!c->gear.has(slot)) {
+                c->gear.set(slot, itemRef);
+                invalidateStats(c);
+            }
             std::uint32_t onEquip = getObjectProperty(itemRef, propOnEquip);
             if (onEquip) {
                 doNode(onEquip);
@@ -512,7 +505,21 @@ void Game::doDamage(std::uint32_t cRef, int amount, int to, int type) {
     int resist = -getResistance(cRef, type);
     resist += 100;
     amount = amount * resist / 100;
+    if (!inCombat || currentCombatant >= combatants.size()) {
+        adjSkillCur(cRef, to, -amount);
+        return;
+    }
+
+    const int before = getSkillCur(cRef, to);
     adjSkillCur(cRef, to, -amount);
+    const int dealt = before - getSkillCur(cRef, to);
+    if (dealt > 0) {
+        if (getObjectProperty(combatants[currentCombatant], propFaction) == 0) {
+            combatStats.damageByAllies += dealt;
+        } else {
+            combatStats.damageByEnemies += dealt;
+        }
+    }
 }
 
 int Game::doSkillCheck(std::uint32_t cRef, int skill, int modifiers, int target) {
@@ -554,6 +561,34 @@ int Game::getSkillMax(std::uint32_t cRef, int skillNo) {
     Character *c = getCharacter(cRef);
     if (!c) return 0;
 
+    if (!c->skillMaxValid) {
+        for (int i = 0; i < getSkillCount(); ++i) {
+            c->skillMax(i) = calcSkillMax(c, i);
+        }
+        c->skillMaxValid = true;
+    }
+#ifdef GTRPGE_CHECK_STAT_CACHE
+    if (c->skillMax(skillNo) != calcSkillMax(c, skillNo)) {
+        throw PlayError("Cached maximum skill value is out of date");
+    }
+#endif
+    return c->skillMax(skillNo);
+}
+
+bool Game::statCacheCurrent(std::uint32_t cRef) {
+    Character *c = getCharacter(cRef);
+    for (int i = 0; i < getSkillCount(); ++i) {
+        if (getSkillMax(cRef, i) != calcSkillMax(c, i)) {
+            return false;
+        }
+    }
+    return isKOed(cRef) == calcKOed(cRef);
+}
+
+int Game::calcSkillMax(Character *c, int skillNo) {
+    const SkillDef *skillDef = getSkillDef(skillNo);
+    if (skillDef == nullptr) return 0;
+
     std::uint32_t skillsMap = getObjectProperty(c->def, propSkills);
     int base = 0;
     if (skillsMap == 0 || !mapHasValue(skillsMap, skillNo)) {
@@ -569,7 +604,7 @@ int Game::getSkillMax(std::uint32_t cRef, int skillNo) {
         }
     }
 
-    base += c->skillAdj[skillNo];
+    base += c->skillAdj(skillNo);
 
     if (skillDef->testFlags(sklX5)) {
         base *= sklX5Multiplier;
@@ -578,10 +613,22 @@ int Game::getSkillMax(std::uint32_t cRef, int skillNo) {
 }
 
 void Game::adjSkillMax(std::uint32_t cRef, int skillNo, int adjustment) {
+    if (getSkillDef(skillNo) == nullptr) {
+        throw PlayError("Tried to adjust invalid skill");
+    }
     Character *c = getCharacter(cRef);
     if (!c) return;
 
-    c->skillAdj[skillNo] += adjustment;
+    journalStat(c, skillNo);
+    c->skillAdj(skillNo) += adjustment;
+    invalidateStats(c);
+}
+
+// Drops a character's cached maximum skill values and KO status; called
+// whenever their gear or skill adjustments change.
+void Game::invalidateStats(Character *c) {
+    c->skillMaxValid = false;
+    c->koValid = false;
 }
 
 int Game::getSkillCur(std::uint32_t cRef, int skillNo) {
@@ -590,31 +637,40 @@ int Game::getSkillCur(std::uint32_t cRef, int skillNo) {
     Character *c = getCharacter(cRef);
     if (skillDef->testFlags(sklVariable)) {
         if (!c) return 0;
-        return c->skillCur[skillNo];
+        return c->skillCur(skillNo);
     } else {
         return getSkillMax(cRef, skillNo);
     }
 }
 
 void Game::adjSkillCur(std::uint32_t cRef, int skillNo, int adjustment) {
+    if (getSkillDef(skillNo) == nullptr) {
+        throw PlayError("Tried to adjust invalid skill");
+    }
     Character *c = getCharacter(cRef);
     if (!c) return;
 
-    int cur = c->skillCur[skillNo];
+    int cur = c->skillCur(skillNo);
     int max = getSkillMax(cRef, skillNo);
 
     cur += adjustment;
     if (cur < 0)    cur = 0;
     if (cur > max)  cur = max;
 
-    c->skillCur[skillNo] = cur;
+    journalStat(c, c->skillCount + skillNo);
+    c->skillCur(skillNo) = cur;
+    c->koValid = false;
 }
 
 void Game::adjResistance(std::uint32_t cRef, int damageType, int amount) {
+    if (getDamageType(damageType) == nullptr) {
+        throw PlayError("Tried to adjust invalid damage type");
+    }
     Character *c = getCharacter(cRef);
     if (!c) return;
 
-    c->resistAdj[damageType] += amount;
+    journalStat(c, c->skillCount * 3 + damageType);
+    c->resistAdj(damageType) += amount;
 }
 
 int Game::getResistance(std::uint32_t cRef, int damageType) {
@@ -634,7 +690,9 @@ int Game::getResistance(std::uint32_t cRef, int damageType) {
         }
     }
 
-    base += c->resistAdj[damageType];
+    if (getDamageType(damageType) != nullptr) {
+        base += c->resistAdj(damageType);
+    }
 
     return base;
 }
@@ -646,7 +704,7 @@ std::vector<std::uint32_t> Game::getActions(std::uint32_t cRef) {
     if (!c) return actions;
 
     const std::uint32_t weaponSlot = readWord(headerWeaponSlot);
-    if (c->gear.count(weaponSlot) == 0) {
+    if (!c->gear.has(weaponSlot)) {
         list = getObjectProperty(cRef, propBaseAbilities);
         if (list) {
             unsigned count = readByte(list+1);
@@ -691,7 +749,7 @@ void Game::doScene(std::uint32_t address) {
 
     if (startedCombat) {
         startedCombat = false;
-        random_shuffle(combatants.begin(), combatants.end());
+        std::shuffle(combatants.begin(), combatants.end(), rng);
         say("\n");
         doCombatLoop();
     }
@@ -728,32 +786,85 @@ std::uint32_t Game::call(std::uint32_t sceneOrNode, bool clearAfter, bool clearB
     }
 
     if (clearAfter) {
-        for (unsigned i = 0; i < storageTempCount; ++i) {
-            storage.erase(storageFirstTemp-i);
-        }
+        std::fill_n(tempRegisters.begin() + tempBase, storageTempCount, 0);
     }
 
     return result;
 }
 
+void Game::resetCombat(std::uint32_t afterNode) {
+    afterCombatNode = afterNode;
+    inCombat = startedCombat = true;
+    combatants.clear();
+    currentCombatant = 0;
+    combatRound = 1;
+    combatStats = CombatStats{0, 0, 0};
+    for (const auto &partyMember : party) {
+        combatants.push_back(partyMember);
+    }
+}
+
+void Game::addToCombat(std::uint32_t cRef) {
+    restoreCharacter(cRef);
+    combatants.push_back(cRef);
+}
+
+// Starts a fight without a scene: the allies become the party, everyone is
+// reset to their starting state and the fight runs until it ends or an ally
+// is waiting for an option to be chosen.
+void Game::startCombat(const std::vector<std::uint32_t> &allies, const std::vector<std::uint32_t> &enemies) {
+    clearOutput();
+    options.clear();
+    party = allies;
+    for (std::uint32_t cRef : allies) {
+        resetCharacter(cRef);
+    }
+    for (std::uint32_t cRef : enemies) {
+        resetCharacter(cRef);
+    }
+
+    resetCombat(0);
+    for (std::uint32_t cRef : enemies) {
+        addToCombat(cRef);
+    }
+    startedCombat = false;
+    std::shuffle(combatants.begin(), combatants.end(), rng);
+    doCombatLoop();
+}
+
+// Enemies always choose their own actions; allies wait for the player unless
+// they have an ai node and allies are using theirs.
+bool Game::actsOnOwn(std::uint32_t cRef) {
+    if (getObjectProperty(cRef, propFaction) != 0) {
+        return true;
+    }
+    return alliesUseAi && getObjectProperty(cRef, propAi) != 0;
+}
+
 void Game::doCombatLoop() {
-    while (getObjectProperty(combatants[currentCombatant], propFaction) != 0 ||
-            isKOed(combatants[currentCombatant])) {
-        if (!isKOed(combatants[currentCombatant])) {
-            std::uint32_t ai = getObjectProperty(combatants[currentCombatant], propAi);
+    while (true) {
+        if (combatRoundLimit && combatRound > combatRoundLimit) {
+            endCombat();
+            return;
+        }
+        const std::uint32_t who = combatants[currentCombatant];
+        if (!actsOnOwn(who) && !isKOed(who)) {
+            break;
+        }
+
+        if (!isKOed(who)) {
+            std::uint32_t ai = getObjectProperty(who, propAi);
             if (ai > 0) {
-                setTemp(0, combatants[currentCombatant]);
+                setTemp(0, who);
                 call(ai, false, false);
             } else {
-                say(toUpperFirst(getNameOf(combatants[currentCombatant])));
+                sayNameOf(who, caseUpperFirst);
                 say(" does nothing.\n");
             }
         }
         int status = combatStatus();
         if (status != 0) {
-            inCombat = false;
-            say("Combat is over.\n");
-            options.push_back(Option(1, afterCombatNode));
+            endCombat();
             return;
         }
         advanceCombatant();
@@ -762,10 +873,17 @@ void Game::doCombatLoop() {
     doCombatOptions();
 
     say("What does ");
-    say(getNameOf(combatants[currentCombatant]));
+    sayNameOf(combatants[currentCombatant]);
     say(" do?\n");
 }
 
+void Game::endCombat() {
+    inCombat = false;
+    combatStats.rounds = combatRoundLimit ? std::min(combatRound, combatRoundLimit) : combatRound;
+    say("Combat is over.\n");
+    options.push_back(Option(1, afterCombatNode));
+}
+
 int Game::combatStatus() {
     int allies = 0, enemies = 0;
     for (std::uint32_t whoRef : combatants) {
@@ -812,13 +930,14 @@ void Game::doOption(int optionNumber) {
     std::uint32_t dest = options[optionNumber].dest;
     std::uint32_t nameAddr = options[optionNumber].name;
     std::uint32_t extra = options[optionNumber].extra;
+    beginTurn();
     clearOutput();
 
     if (inCombat) {
         options.clear();
 
         if (dest == optionDoNothing) {
-            say(toUpperFirst(getNameOf(combatants[currentCombatant])));
+            sayNameOf(combatants[currentCombatant], caseUpperFirst);
             say(" does nothing.\n");
             advanceCombatant();
             doCombatLoop();
@@ -884,6 +1003,7 @@ void Game::useItem(int itemNumber) {
     uint32_t article = getObjectProperty(item, propArticle);
     uint32_t name = getObjectProperty(item, propName);
 
+    beginTurn();
     clearOutput();
     say("\n> Using ");
     say(getString(article));
@@ -909,14 +1029,17 @@ void Game::equipItem(std::uint32_t whoIdent, int itemNumber) {
     uint32_t slot = getObjectProperty(item, propSlot);
     if (!slot) return;
 
-    if (who->gear.count(slot) > 0) {
-        std::uint32_t oldItem = who->gear[slot];
+    beginTurn();
+    if (who->gear.has(slot)) {
+        std::uint32_t oldItem = who->gear.get(slot);
         std::uint32_t onRemove = getObjectProperty(oldItem, propOnRemove);
         if (onRemove) {
             call(onRemove, false, false);
         }
         addItems(1, oldItem);
-        who->gear.erase(slot);
+        journalGear(who, slot);
+        who->gear.remove(slot);
+        invalidateStats(who);
     }
 
     removeItems(1, item);
@@ -924,7 +1047,9 @@ void Game::equipItem(std::uint32_t whoIdent, int itemNumber) {
     if (onEquip) {
         call(onEquip, false, false);
     }
-    who->gear.insert(std::make_pair(slot, item));
+    journalGear(who, slot);
+    who->gear.set(slot, item);
+    invalidateStats(who);
 }
 
 void Game::unequipItem(std::uint32_t whoIdent, std::uint32_t slotIdent) {
@@ -933,13 +1058,16 @@ void Game::unequipItem(std::uint32_t whoIdent, std::uint32_t slotIdent) {
         return;
     }
 
-    auto gearIter = who->gear.find(slotIdent);
-    if (gearIter == who->gear.end()) {
+    const std::uint32_t item = who->gear.get(slotIdent);
+    if (!item) {
         return;
     }
 
-    addItems(1, gearIter->second);
-    who->gear.erase(slotIdent);
+    beginTurn();
+    addItems(1, item);
+    journalGear(who, slotIdent);
+    who->gear.remove(slotIdent);
+    invalidateStats(who);
 }
 
 void Game::doAction(std::uint32_t cRef, std::uint32_t action) {
@@ -951,11 +1079,12 @@ void Game::doAction(std::uint32_t cRef, std::uint32_t action) {
         return;
     }
 
+    beginTurn();
     clearOutput();
     say("\n> ");
-    say(toUpperFirst(getNameOf(cRef)));
+    sayNameOf(cRef, caseUpperFirst);
     say (" uses their ");
-    say(getNameOf(action));
+    sayNameOf(action);
     say(" ability\n\n");
 
     call(peaceNode, true, true);
@@ -970,14 +1099,32 @@ bool Game::isInCombat() const {
 }
 
 void Game::say(const std::string &text) {
-    if (text.empty()) return;
-    outputBuffer += text;
+    output.append(text);
+}
+
+void Game::say(const char *text, TextCase textCase) {
+    output.append(text, strlen(text), textCase);
 }
 
 void Game::say(int number) {
     say(std::to_string(number));
 }
 
+// Says the name of address without building it first; see appendNameOf.
+void Game::sayNameOf(std::uint32_t address, TextCase textCase) {
+    if (getType(address) == idString) {
+        say(getString(address), textCase);
+        return;
+    }
+    const std::string *name = image->findObjectName(address);
+    if (name) {
+        output.append(name->data(), name->size(), textCase);
+    } else {
+        const std::string composed = getNameOf(address);
+        output.append(composed.data(), composed.size(), textCase);
+    }
+}
+
 void Game::sayError(const std::string &errorMessage) {
     say("\n");
     say(errorMessage);
@@ -985,16 +1132,93 @@ void Game::sayError(const std::string &errorMessage) {
 }
 
 uint32_t Game::fetch(uint32_t key) const {
-    if (storage.count(key) == 0) {
-        return 0;
+    if (isTempKey(key)) {
+        return tempRegisters[tempBase + storageFirstTemp - key];
+    }
+    const int slot = image->findGlobal(key);
+    if (slot >= 0) {
+        return globals[slot];
+    }
+    return storage.get(key);
+}
+
+void Game::store(std::uint32_t key, std::uint32_t value) {
+    if (isTempKey(key)) {
+        tempRegisters[tempBase + storageFirstTemp - key] = value;
+        return;
+    }
+    const int slot = image->findGlobal(key);
+    if (slot >= 0) {
+        if (journaling()) {
+            journal(JournalEntry::Global, slot, 0, globals[slot]);
+        }
+        globals[slot] = value;
+    } else {
+        if (journaling()) {
+            journal(JournalEntry::Storage, key, 0, storage.get(key));
+        }
+        storage.set(key, value);
+    }
+}
+
+std::uint32_t Game::fetchGlobal(unsigned slot) const {
+    if (slot >= globals.size()) {
+        throw PlayError("Tried to read bad global variable slot");
+    }
+    return globals[slot];
+}
+
+void Game::storeGlobal(unsigned slot, std::uint32_t value) {
+    if (slot >= globals.size()) {
+        throw PlayError("Tried to update bad global variable slot");
+    }
+    if (journaling()) {
+        journal(JournalEntry::Global, slot, 0, globals[slot]);
     }
-    auto i = storage.find(key);
-    return i->second;
+    globals[slot] = value;
 }
 
 void Game::setTemp(unsigned tempNo, std::uint32_t value) {
     if (tempNo >= storageTempCount) {
         throw PlayError("Tried to update bad temp storage position");
     }
-    storage[storageFirstTemp - tempNo] = value;
+    tempRegisters[tempBase + tempNo] = value;
+}
+
+
+/* ************************************************************************* *
+ * CHARACTER GEAR LISTS                                                      *
+ * ************************************************************************* */
+
+static bool gearSlotLess(const Game::GearList::Entry &entry, std::uint32_t slot) {
+    return entry.first < slot;
+}
+
+bool Game::GearList::has(std::uint32_t slot) const {
+    auto iter = std::lower_bound(entries.begin(), entries.end(), slot, gearSlotLess);
+    return iter != entries.end() && iter->first == slot;
+}
+
+std::uint32_t Game::GearList::get(std::uint32_t slot) const {
+    auto iter = std::lower_bound(entries.begin(), entries.end(), slot, gearSlotLess);
+    if (iter != entries.end() && iter->first == slot) {
+        return iter->second;
+    }
+    return 0;
+}
+
+void Game::GearList::set(std::uint32_t slot, std::uint32_t item) {
+    auto iter = std::lower_bound(entries.begin(), entries.end(), slot, gearSlotLess);
+    if (iter != entries.end() && iter->first == slot) {
+        iter->second = item;
+    } else {
+        entries.insert(iter, Entry(slot, item));
+    }
+}
+
+void Game::GearList::remove(std::uint32_t slot) {
+    auto iter = std::lower_bound(entries.begin(), entries.end(), slot, gearSlotLess);
+    if (iter != entries.end() && iter->first == slot) {
+        entries.erase(iter);
+    }
 }
@@ -2,324 +2,417 @@
 #include <sstream>
 
 #include "play.h"
+#include "profiler.h"
+#include "weightedsampler.h"
 
-class Stack {
-public:
-    void push(std::uint32_t value) {
-        mStack.push_back(value);
-    }
-    std::uint32_t pop() {
-        if (mStack.empty()) {
-            throw PlayError("stack underflow in VM");
-        }
-        std::uint32_t value = mStack.back();
-        mStack.pop_back();
-        return value;
-    }
-    std::uint32_t peek(unsigned position = 0) {
-        if (position >= mStack.size()) {
-            throw PlayError("stack index out of bounds in VM");
-        }
+// The interpreter loop can be compiled either as a switch or, on compilers
+// supporting labels as values, as a direct-threaded loop where each opcode
+// jumps straight to the next opcode's handler. Define
+// GTRPGE_THREADED_DISPATCH (make VM_DISPATCH=threaded) to select the latter.
+// Labels as values are a GNU extension, so -Wpedantic is silenced just around
+// the dispatch table and the computed gotos.
+#if defined(GTRPGE_THREADED_DISPATCH) && defined(__GNUC__)
+#define VM_THREADED
+#define VM_PEDANTIC_OFF \
+    _Pragma("GCC diagnostic push") \
+    _Pragma("GCC diagnostic ignored \"-Wpedantic\"")
+#define VM_PEDANTIC_ON \
+    _Pragma("GCC diagnostic pop")
+#define VM_DISPATCH() \
+    do { VM_PEDANTIC_OFF goto *dispatchTable[cmdCode]; VM_PEDANTIC_ON } while (0)
+#endif
 
-        return mStack[mStack.size() - 1 - position];
-    }
-    void swap(unsigned pos1 = 0, unsigned pos2 = 1) {
-        if (pos1 >= mStack.size() || pos2 >= mStack.size()) {
-            throw PlayError("stack index out of bounds in VM");
-        }
+// Code runs from the image's decoded copy of the node. A jump to an address
+// that doesn't start an instruction of the current block continues in the
+// block decoded from that address instead. Dispatches are only counted while
+// profiling.
+#define VM_FETCH() \
+    do { \
+        insn = pc++; \
+        cmdCode = insn->opcode; \
+        if (profiler) { \
+            ++dispatchStats.dispatches; \
+            dispatchStats.instructions += insn->length; \
+            profiler->instruction(address, cmdCode); \
+        } \
+    } while (0)
+#define VM_JUMP(target) \
+    do { \
+        const std::uint32_t jumpTo = (target); \
+        int index = block->indexOf(jumpTo); \
+        if (index < 0) { \
+            block = image->decodeAt(jumpTo); \
+            index = 0; \
+        } \
+        pc = &block->code[index]; \
+    } while (0)
+// Superinstructions either move past the instructions they cover or, for
+// fused jumps, go straight to the target resolved when the node was decoded.
+#define VM_SKIP_FUSED() \
+    pc += insn->length - 1
+#define VM_JUMP_FUSED() \
+    do { \
+        if (insn->target >= 0) { \
+            pc = &block->code[insn->target]; \
+        } else { \
+            VM_JUMP(insn->operand); \
+        } \
+    } while (0)
+#define VM_JUMP_FUSED_IF(condition) \
+    do { \
+        if (condition) { \
+            VM_JUMP_FUSED(); \
+        } else { \
+            VM_SKIP_FUSED(); \
+        } \
+    } while (0)
 
-        std::uint32_t value = mStack[pos1];
-        mStack[pos1] = mStack[pos2];
-        mStack[pos2] = value;
-    }
-
-    bool isEmpty() const {
-        return mStack.empty();
-    }
-    unsigned size() const {
-        return mStack.size();
-    }
-private:
-    std::vector<std::uint32_t> mStack;
-};
+#ifdef VM_THREADED
+#define VM_CASE(op)     L_##op:
+#define VM_DEFAULT      L_unknown:
+#define VM_NEXT()       do { VM_FETCH(); VM_DISPATCH(); } while (0)
+#else
+#define VM_CASE(op)     case op:
+#define VM_DEFAULT      default:
+#define VM_NEXT()       break
+#endif
 
 std::uint32_t Game::doNode(std::uint32_t address) {
-    std::uint32_t ip = address;
-    if (!isType(ip++, idNode)) {
+    if (!isType(address, idNode)) {
         std::stringstream ss;
-        ss << "Tried to run non-node at " << std::hex << std::uppercase << (int)readByte(ip-1) << ".";
+        ss << "Tried to run non-node at " << std::hex << std::uppercase << (int)readByte(address) << ".";
         throw PlayError(ss.str());
     }
-    Stack stack;
+    OperandStackFrame frame(operandStack);
+    OperandStack &stack = operandStack;
+    ProfiledNode profiledNode(profiler, address, stack.allocationCount());
+
+    const DecodedCode *block = image->decodeAt(address + 1);
+    const DecodedInstruction *pc = &block->code[0];
+    const DecodedInstruction *insn;
+
+#ifdef VM_THREADED
+#define VM_UNKNOWN4     &&L_unknown, &&L_unknown, &&L_unknown, &&L_unknown
+#define VM_UNKNOWN16    VM_UNKNOWN4, VM_UNKNOWN4, VM_UNKNOWN4, VM_UNKNOWN4
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    static void *const dispatchTable[dopLastOpcode + 1] = {
+        /* 0x00 */ &&L_opEnd, &&L_opPush, &&L_opPop, &&L_opCallNode,
+        /* 0x04 */ &&L_unknown, &&L_opStartGame, &&L_opAddTime, &&L_opAddOption,
+        /* 0x08 */ &&L_opAddOptionXtra, &&L_opAddContinue, &&L_opAddReturn, &&L_opSay,
+        /* 0x0C */ &&L_opSayNumber, &&L_opSayUF, &&L_opSayTC, &&L_opSayPronoun,
+        /* 0x10 */ &&L_opSayPronounUF, &&L_opJump, &&L_opJumpTrue, &&L_opJumpFalse,
+        /* 0x14 */ &&L_opJumpEq, &&L_opJumpNeq, &&L_opJumpLt, &&L_opJumpLte,
+        /* 0x18 */ &&L_opJumpGt, &&L_opJumpGte, &&L_opStore, &&L_opFetch,
+        /* 0x1C */ &&L_opAddItems, &&L_opRemoveItems, &&L_opItemQty, &&L_opListSize,
+        /* 0x20 */ &&L_opListGet, &&L_opFetchGlobal, &&L_opStoreGlobal, &&L_unknown, &&L_unknown,
+        /* 0x25 */ &&L_opResetCharacter, &&L_opGetSex, &&L_opSetSex,
+        /* 0x28 */ &&L_opGetSpecies, &&L_opSetSpecies, &&L_unknown, &&L_unknown,
+        /* 0x2C */ VM_UNKNOWN4,
+        /* 0x30 */ &&L_opGetSkill, &&L_opAdjSkill, &&L_opGetSkillCur, &&L_opAdjSkillCur,
+        /* 0x34 */ &&L_opSkillCheck, &&L_opDoDamage, &&L_opAdd, &&L_opSubtract,
+        /* 0x38 */ &&L_opMultiply, &&L_opDivide, &&L_opModulo, &&L_opPower,
+        /* 0x3C */ &&L_opIncrement, &&L_opDecrement, &&L_opAddToParty, &&L_opIsInParty,
+        /* 0x40 */ &&L_opRemoveFromParty, &&L_opResetCombat, &&L_opAddToCombat, &&L_opCombatant,
+        /* 0x44 */ &&L_opGetProperty, &&L_opRandomOfFaction, &&L_opRandomNotFaction, &&L_opStackSwap,
+        /* 0x48 */ &&L_opStackDup, &&L_opStackCount, &&L_opIsKOed, &&L_opHasProperty,
+        /* 0x4C */ &&L_opPartySize, &&L_opPartyIsKOed, &&L_opDoRest, &&L_opCombatStatus,
+        /* 0x50 */ &&L_opPartyAt, &&L_opGetEquip, &&L_opSetEquip, &&L_opRandom,
+        /* 0x54 */ &&L_opGetResistance, &&L_opAdjResistance, &&L_opRandomEvent,
+        /* 0x57 */ &&L_unknown, VM_UNKNOWN4, VM_UNKNOWN4,
+        /* 0x60 */ VM_UNKNOWN16, VM_UNKNOWN16, VM_UNKNOWN16, VM_UNKNOWN16, VM_UNKNOWN16,
+        /* 0xB0 */ VM_UNKNOWN16, VM_UNKNOWN16, VM_UNKNOWN16, VM_UNKNOWN16, VM_UNKNOWN16,
+        /* decoded only */ &&L_dopTruncated, &&L_dopPushPushAddOption, &&L_dopPushFetch,
+        &&L_dopPushSay, &&L_dopPushJump, &&L_dopPushJumpTrue, &&L_dopPushJumpFalse,
+        &&L_dopPushJumpEq, &&L_dopPushJumpNeq, &&L_dopPushJumpLt, &&L_dopPushJumpLte,
+        &&L_dopPushJumpGt, &&L_dopPushJumpGte
+    };
+#pragma GCC diagnostic pop
+#undef VM_UNKNOWN4
+#undef VM_UNKNOWN16
+#endif
 
     std::uint32_t a1, a2, a3, a4;
+    std::uint16_t cmdCode;
     while (true) {
-        std::uint8_t cmdCode = readByte(ip++);
+        VM_FETCH();
 
+#ifdef VM_THREADED
+        VM_DISPATCH();
+        {
+#else
         switch(cmdCode) {
-            case opEnd:
+#endif
+            VM_CASE(opEnd)
                 if (stack.isEmpty()) {
                     return 0;
                 } else {
                     return stack.pop();
                 }
-            case opCallNode: {
+            VM_CASE(opCallNode) {
                 a2 = stack.pop();
                 a1 = stack.pop();
-                std::uint32_t curTemp[storageTempCount];
-                for (unsigned i = 0; i < storageTempCount; ++i) {
-                    curTemp[i] = storage[storageFirstTemp - i];
-                    if (i < a1) {
-                        setTemp(i, stack.pop());
-                    } else {
-                        setTemp(i, 0);
-                    }
+                // the called node gets the next set of temps, holding its
+                // arguments followed by zeros
+                const unsigned callerTemps = tempBase;
+                const unsigned calleeTemps = tempBase + storageTempCount;
+                if (tempRegisters.size() < calleeTemps + storageTempCount) {
+                    tempRegisters.resize(calleeTemps + storageTempCount);
                 }
-                a1 = call(a2, false, false);
-                stack.push(a1);
                 for (unsigned i = 0; i < storageTempCount; ++i) {
-                    storage[storageFirstTemp - i] = curTemp[i];
+                    tempRegisters[calleeTemps + i] = i < a1 ? stack.pop() : 0;
+                }
+                tempBase = calleeTemps;
+                try {
+                    a1 = call(a2, false, false);
+                } catch (...) {
+                    tempBase = callerTemps;
+                    throw;
                 }
-                break; }
-            case opStartGame: // start-game;
+                tempBase = callerTemps;
+                stack.push(a1);
+                VM_NEXT(); }
+            VM_CASE(opStartGame) // start-game;
                 gameStarted = true;
-                break;
-            case opAddTime: // add-time [hours] [minutes];
+                VM_NEXT();
+            VM_CASE(opAddTime) // add-time [hours] [minutes];
                 a2 = stack.pop();
                 a1 = stack.pop();
                 gameTime += a1 * minutesPerHour + a2;
-                break;
-            case opPush:
-                a1 = readWord(ip);
-                ip += 4;
-                stack.push(a1);
-                break;
-            case opPop:
+                VM_NEXT();
+            VM_CASE(opPush)
+                stack.push(insn->operand);
+                VM_NEXT();
+            VM_CASE(opPop)
                 stack.pop();
-                break;
+                VM_NEXT();
 
-            case opAddOption:
+            VM_CASE(opAddOption)
                 a2 = stack.pop();
                 a1 = stack.pop();
                 options.push_back(Option(a1, a2));
-                break;
-            case opAddOptionXtra:
+                VM_NEXT();
+            VM_CASE(opAddOptionXtra)
                 a3 = stack.pop();
                 a2 = stack.pop();
                 a1 = stack.pop();
                 options.push_back(Option(a1, a2, a3));
-                break;
-            case opAddContinue:
+                VM_NEXT();
+            VM_CASE(opAddContinue)
                 a1 = stack.pop();
                 options.push_back(Option(1, a1));
-                break;
-            case opAddReturn:
+                VM_NEXT();
+            VM_CASE(opAddReturn)
                 options.push_back(Option(1, location));
-                break;
+                VM_NEXT();
 
-            case opSay:
-                say(getNameOf(stack.pop()));
-                break;
-            case opSayUF:
-                say(toUpperFirst(getNameOf(stack.pop())));
-                break;
-            case opSayTC:
-                say(toTitleCase(getNameOf(stack.pop())));
-                break;
-            case opSayPronoun:
+            VM_CASE(opSay)
+                sayNameOf(stack.pop());
+                VM_NEXT();
+            VM_CASE(opSayUF)
+                sayNameOf(stack.pop(), caseUpperFirst);
+                VM_NEXT();
+            VM_CASE(opSayTC)
+                sayNameOf(stack.pop(), caseTitle);
+                VM_NEXT();
+            VM_CASE(opSayPronoun)
                 a2 = stack.pop();
                 a1 = stack.pop();
-                say(getPronoun(a1, a2));
-                break;
-            case opSayPronounUF:
+                say(pronounOf(a1, a2));
+                VM_NEXT();
+            VM_CASE(opSayPronounUF)
                 a2 = stack.pop();
                 a1 = stack.pop();
-                say(toUpperFirst(getPronoun(a1, a2)));
-                break;
-            case opSayNumber:
+                say(pronounOf(a1, a2), caseUpperFirst);
+                VM_NEXT();
+            VM_CASE(opSayNumber)
                 say(stack.pop());
-                break;
+                VM_NEXT();
 
-            case opJump:
-                ip = stack.pop();
-                break;
-            case opJumpTrue:
+            VM_CASE(opJump)
+                VM_JUMP(stack.pop());
+                VM_NEXT();
+            VM_CASE(opJumpTrue)
                 a2 = stack.pop();
                 a1 = stack.pop();
                 if (a1) {
-                    ip = a2;
+                    VM_JUMP(a2);
                 }
-                break;
-            case opJumpFalse:
+                VM_NEXT();
+            VM_CASE(opJumpFalse)
                 a2 = stack.pop();
                 a1 = stack.pop();
                 if (!a1) {
-                    ip = a2;
+                    VM_JUMP(a2);
                 }
-                break;
-            case opJumpEq:
+                VM_NEXT();
+            VM_CASE(opJumpEq)
                 a3 = stack.pop();
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (a1 == a2) {
-                    ip = a3;
+                    VM_JUMP(a3);
                 }
-                break;
-            case opJumpNeq:
+                VM_NEXT();
+            VM_CASE(opJumpNeq)
                 a3 = stack.pop();
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (a1 != a2) {
-                    ip = a3;
+                    VM_JUMP(a3);
                 }
-                break;
-            case opJumpLt:
+                VM_NEXT();
+            VM_CASE(opJumpLt)
                 a3 = stack.pop();
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (static_cast<int>(a1) > static_cast<int>(a2)) {
-                    ip = a3;
+                    VM_JUMP(a3);
                 }
-                break;
-            case opJumpLte:
+                VM_NEXT();
+            VM_CASE(opJumpLte)
                 a3 = stack.pop();
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (static_cast<int>(a1) >= static_cast<int>(a2)) {
-                    ip = a3;
+                    VM_JUMP(a3);
                 }
-                break;
-            case opJumpGt:
+                VM_NEXT();
+            VM_CASE(opJumpGt)
                 a3 = stack.pop();
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (static_cast<int>(a1) < static_cast<int>(a2)) {
-                    ip = a3;
+                    VM_JUMP(a3);
                 }
-                break;
-            case opJumpGte:
+                VM_NEXT();
+            VM_CASE(opJumpGte)
                 a3 = stack.pop();
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (static_cast<int>(a1) <= static_cast<int>(a2)) {
-                    ip = a3;
+                    VM_JUMP(a3);
                 }
-                break;
+                VM_NEXT();
 
-            case opStore:
+            VM_CASE(opStore)
                 a2 = stack.pop();
                 a1 = stack.pop();
-                if (a2) {
-                    storage[a1] = a2;
-                } else {
-                    storage.erase(a1);
-                }
-                break;
-            case opFetch:
+                store(a1, a2);
+                VM_NEXT();
+            VM_CASE(opFetch)
                 stack.push(fetch(stack.pop()));
-                break;
+                VM_NEXT();
+            VM_CASE(opFetchGlobal)
+                stack.push(fetchGlobal(insn->operand));
+                VM_NEXT();
+            VM_CASE(opStoreGlobal)
+                storeGlobal(insn->operand, stack.pop());
+                VM_NEXT();
 
-            case opAddItems:
+            VM_CASE(opAddItems)
                 a2 = stack.pop(); // qty
                 a1 = stack.pop(); // itemIdent
                 stack.push(addItems(a2, a1));
-                break;
-            case opRemoveItems:
+                VM_NEXT();
+            VM_CASE(opRemoveItems)
                 a2 = stack.pop(); // qty
                 a1 = stack.pop(); // itemIDent
                 stack.push(removeItems(a2, a1));
-                break;
-            case opItemQty:
+                VM_NEXT();
+            VM_CASE(opItemQty)
                 a1 = stack.pop(); // itemIdent
                 stack.push(itemQty(a1));
-                break;
+                VM_NEXT();
 
-            case opResetCharacter:
+            VM_CASE(opResetCharacter)
                 resetCharacter(stack.pop());
-                break;
-            case opGetSex: {
+                VM_NEXT();
+            VM_CASE(opGetSex) {
                 Character *c = getCharacter(stack.pop());
                 stack.push(c->sex);
-                break;
+                VM_NEXT();
             }
-            case opGetSpecies: {
+            VM_CASE(opGetSpecies) {
                 Character *c = getCharacter(stack.pop());
                 stack.push(c->species);
-                break;
+                VM_NEXT();
             }
-            case opSetSex: {
+            VM_CASE(opSetSex) {
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (getObjectProperty(a1, propClass) != ocSex) {
                     throw PlayError("Tried to set character sex to non-sex.");
                 }
                 Character *c = getCharacter(a2);
+                journalIdentity(c, JournalEntry::Sex);
                 c->sex = a1;
-                break;
+                VM_NEXT();
             }
-            case opSetSpecies: {
+            VM_CASE(opSetSpecies) {
                 a1 = stack.pop();
                 a2 = stack.pop();
                 if (getObjectProperty(a1, propClass) != ocSpecies) {
                     throw PlayError("Tried to set character species to non-species.");
                 }
                 Character *c = getCharacter(a2);
+                journalIdentity(c, JournalEntry::Species);
                 c->species = a1;
-                break;
+                VM_NEXT();
             }
-            case opGetSkill:
+            VM_CASE(opGetSkill)
                 a1 = stack.pop();
                 a2 = stack.pop();
                 stack.push(getSkillMax(a2, a1));
-                break;
-            case opAdjSkill:
+                VM_NEXT();
+            VM_CASE(opAdjSkill)
                 a1 = stack.pop();
                 a2 = stack.pop();
                 a3 = stack.pop();
                 adjSkillMax(a3, a2, a1);
-                break;
-            case opGetSkillCur:
+                VM_NEXT();
+            VM_CASE(opGetSkillCur)
                 a1 = stack.pop();
                 a2 = stack.pop();
                 stack.push(getSkillCur(a2, a1));
-                break;
-            case opAdjSkillCur:
+                VM_NEXT();
+            VM_CASE(opAdjSkillCur)
                 a1 = stack.pop();
                 a2 = stack.pop();
                 a3 = stack.pop();
                 adjSkillCur(a3, a2, a1);
-                break;
-            case opSkillCheck:
+                VM_NEXT();
+            VM_CASE(opSkillCheck)
                 a1 = stack.pop(); // target
                 a2 = stack.pop(); // modifier
                 a3 = stack.pop(); // skill
                 a4 = stack.pop(); // character
                 stack.push(doSkillCheck(a4, a3, a2, a1));
-                break;
-            case opDoDamage:
+                VM_NEXT();
+            VM_CASE(opDoDamage)
                 a1 = stack.pop();
                 a2 = stack.pop();
                 a3 = stack.pop();
                 a4 = stack.pop();
                 doDamage(a4, a3, a2, a1);
-                break;
+                VM_NEXT();
 
-            case opAdd:
+            VM_CASE(opAdd)
                 stack.push(stack.pop()+stack.pop());
-                break;
-            case opSubtract:
+                VM_NEXT();
+            VM_CASE(opSubtract)
                 stack.push(stack.pop()-stack.pop());
-                break;
-            case opMultiply:
+                VM_NEXT();
+            VM_CASE(opMultiply)
                 stack.push(stack.pop()*stack.pop());
-                break;
-            case opDivide:
+                VM_NEXT();
+            VM_CASE(opDivide)
                 stack.push(stack.pop()/stack.pop());
-                break;
-            case opModulo:
+                VM_NEXT();
+            VM_CASE(opModulo)
                 stack.push(stack.pop()%stack.pop());
-                break;
-            case opPower:
+                VM_NEXT();
+            VM_CASE(opPower)
                 a1 = stack.pop();
                 a2 = stack.pop();
                 a3 = 1;
@@ -327,18 +420,18 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                     a3 *= a1;
                 }
                 stack.push(a3);
-                break;
-            case opIncrement:
+                VM_NEXT();
+            VM_CASE(opIncrement)
                 stack.push(stack.pop()+1);
-                break;
-            case opDecrement:
+                VM_NEXT();
+            VM_CASE(opDecrement)
                 stack.push(stack.pop()-1);
-                break;
+                VM_NEXT();
 
-            case opAddToParty:
+            VM_CASE(opAddToParty)
                 party.push_back(stack.pop());
-                break;
-            case opIsInParty: {
+                VM_NEXT();
+            VM_CASE(opIsInParty) {
                 a1 = stack.pop();
                 bool found = false;
                 for (unsigned i = 0; i < party.size(); ++i) {
@@ -347,9 +440,9 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                     }
                 }
                 stack.push(found);
-                break;
+                VM_NEXT();
             }
-            case opRemoveFromParty: {
+            VM_CASE(opRemoveFromParty) {
                 a1 = stack.pop();
                 auto i = party.begin();
                 while (i != party.end()) {
@@ -359,41 +452,32 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                         ++i;
                     }
                 }
-                break;
+                VM_NEXT();
             }
 
-            case opResetCombat:
-                afterCombatNode = stack.pop();
-                inCombat = startedCombat = true;
-                combatants.clear();
-                currentCombatant = 0;
-                combatRound = 1;
-                for (const auto &partyMember : party) {
-                    combatants.push_back(partyMember);
-                }
-                break;
-            case opAddToCombat:
-                a1 = stack.pop();
-                restoreCharacter(a1);
-                combatants.push_back(a1);
-                break;
-            case opCombatant:
+            VM_CASE(opResetCombat)
+                resetCombat(stack.pop());
+                VM_NEXT();
+            VM_CASE(opAddToCombat)
+                addToCombat(stack.pop());
+                VM_NEXT();
+            VM_CASE(opCombatant)
                 a1 = stack.pop();
                 if (a1 >= combatants.size()) {
                     stack.push(0);
                 } else {
                     stack.push(combatants[a1]);
                 }
-                break;
+                VM_NEXT();
 
-            case opGetProperty: {
+            VM_CASE(opGetProperty) {
                 a2 = stack.pop();
                 a1 = stack.pop();
                 stack.push(getObjectProperty(a1, a2));
-                break; }
+                VM_NEXT(); }
 
-            case opRandomOfFaction: {
-                if (!inCombat) break;
+            VM_CASE(opRandomOfFaction) {
+                if (!inCombat) VM_NEXT();
                 a1 = stack.pop();
                 std::vector<std::uint32_t> options;
                 for (std::uint32_t who : combatants) {
@@ -404,11 +488,11 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                 if (options.empty()) {
                     stack.push(0);
                 } else {
-                    stack.push(options[rand() % options.size()]);
+                    stack.push(options[rng.below(options.size())]);
                 }
-                break; }
-            case opRandomNotFaction: {
-                if (!inCombat) break;
+                VM_NEXT(); }
+            VM_CASE(opRandomNotFaction) {
+                if (!inCombat) VM_NEXT();
                 a1 = stack.pop();
                 std::vector<std::uint32_t> options;
                 for (std::uint32_t who : combatants) {
@@ -419,32 +503,32 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                 if (options.empty()) {
                     stack.push(0);
                 } else {
-                    stack.push(options[rand() % options.size()]);
+                    stack.push(options[rng.below(options.size())]);
                 }
-                break; }
+                VM_NEXT(); }
 
-            case opStackSwap:
+            VM_CASE(opStackSwap)
                 stack.swap();
-                break;
-            case opStackDup:
+                VM_NEXT();
+            VM_CASE(opStackDup)
                 stack.push(stack.peek());
-                break;
-            case opStackCount:
+                VM_NEXT();
+            VM_CASE(opStackCount)
                 stack.push(stack.size());
-                break;
+                VM_NEXT();
 
-            case opIsKOed: {
+            VM_CASE(opIsKOed) {
                 stack.push(isKOed(stack.pop()));
-                break; }
-            case opHasProperty:
+                VM_NEXT(); }
+            VM_CASE(opHasProperty)
                 a2 = stack.pop();
                 a1 = stack.pop();
                 stack.push(objectHasProperty(a1, a2));
-                break;
-            case opPartySize:
+                VM_NEXT();
+            VM_CASE(opPartySize)
                 stack.push(party.size());
-                break;
-            case opPartyIsKOed: {
+                VM_NEXT();
+            VM_CASE(opPartyIsKOed) {
                 bool partyIsKOed = true;
                 for (unsigned i = 0; i < party.size(); ++i) {
                     if (!isKOed(party[i])) {
@@ -453,35 +537,31 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                     }
                 }
                 stack.push(partyIsKOed);
-                break;}
-            case opDoRest:
+                VM_NEXT(); }
+            VM_CASE(opDoRest)
                 doRest(stack.pop());
-                break;
-            case opCombatStatus:
+                VM_NEXT();
+            VM_CASE(opCombatStatus)
                 stack.push(combatStatus());
-                break;
-            case opPartyAt:
+                VM_NEXT();
+            VM_CASE(opPartyAt)
                 a1 = stack.pop();
                 if (a1 >= party.size()) {
                     stack.push(0);
                 } else {
                     stack.push(party[a1]);
                 }
-                break;
-            case opGetEquip: {
+                VM_NEXT();
+            VM_CASE(opGetEquip) {
                 a1 = stack.pop(); // slot
                 a2 = stack.pop(); // whoRef
                 Character *who = getCharacter(a2);
                 if (!who) {
                     throw PlayError("Tried to get equipment on non-character");
                 }
-                if (who->gear.count(a1) > 0) {
-                    stack.push(who->gear[a1]);
-                } else {
-                    stack.push(0);
-                }
-                break; }
-            case opSetEquip: {
+                stack.push(who->gear.get(a1));
+                VM_NEXT(); }
+            VM_CASE(opSetEquip) {
                 a1 = stack.pop(); // itemRef
                 a2 = stack.pop(); // whoRef
                 Character *who = getCharacter(a2);
@@ -495,32 +575,34 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                 if (slot == 0) {
                     throw PlayError("Tried to equip non-equippable item");
                 }
-                who->gear[slot] = a1;
-                break; }
+                journalGear(who, slot);
+                who->gear.set(slot, a1);
+                invalidateStats(who);
+                VM_NEXT(); }
 
-            case opRandom:
+            VM_CASE(opRandom)
                 a2 = stack.pop();
                 a1 = stack.pop();
                 a3 = a2 - a1;
-                stack.push(a1 + rand() % (a3 + 1));
-                break;
+                stack.push(a1 + rng.below(a3 + 1));
+                VM_NEXT();
 
-            case opAdjResistance:
+            VM_CASE(opAdjResistance)
                 a1 = stack.pop(); // amount
                 a2 = stack.pop(); // resistance
                 a3 = stack.pop(); // who
                 adjResistance(a3, a2, a1);
-                break;
-            case opGetResistance:
+                VM_NEXT();
+            VM_CASE(opGetResistance)
                 a2 = stack.pop(); // resistance
                 a3 = stack.pop(); // who
                 stack.push(getResistance(a3, a2));
-                break;
+                VM_NEXT();
 
-            case opRandomEvent: {
+            VM_CASE(opRandomEvent) {
                 a1 = stack.pop(); // datalist address
                 const int listSize = readByte(a1+1);
-                std::vector<std::uint32_t> deck;
+                WeightedSampler events;
 
                 for (int i = 0; i < listSize; ++i) {
                     const std::uint32_t listItem = readWord(a1 + 2 + i * 4);
@@ -531,24 +613,26 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                     if (countNode) {
                         count = call(countNode, false, false);
                     }
-
-                    for (int j = 0; j < count; ++j) {
-                        deck.push_back(listItem);
-                    }
+                    events.add(listItem, count);
                 }
 
-                const std::uint32_t result = deck[rand() % deck.size()];
-                stack.push(result);
-                break;}
+                if (events.totalWeight() == 0) {
+                    throw PlayError("No events available in random-event");
+                }
+                if (events.totalWeight() > 0xFFFFFFFF) {
+                    throw PlayError("Total event count too large in random-event");
+                }
+                stack.push(events.pick(rng.below(events.totalWeight())));
+                VM_NEXT(); }
 
-            case opListSize:
+            VM_CASE(opListSize)
                 a1 = stack.pop(); // list address
                 if (!isType(a1, idList)) {
                     throw PlayError("Tried to get size of non-list");
                 }
                 stack.push(readByte(a1+1));
-                break;
-            case opListGet:
+                VM_NEXT();
+            VM_CASE(opListGet)
                 a2 = stack.pop(); // list index
                 a1 = stack.pop(); // list address
                 if (!isType(a1, idList)) {
@@ -560,13 +644,73 @@ std::uint32_t Game::doNode(std::uint32_t address) {
                     throw PlayError("Index out of range in list-get");
                 }
                 stack.push(readWord(a1 + 2 + a2 * 4));
-                break;
+                VM_NEXT();
+
+            VM_CASE(dopPushPushAddOption)
+                options.push_back(Option(insn->operand, insn->operand2));
+                VM_SKIP_FUSED();
+                VM_NEXT();
+            VM_CASE(dopPushFetch)
+                stack.push(fetch(insn->operand));
+                VM_SKIP_FUSED();
+                VM_NEXT();
+            VM_CASE(dopPushSay)
+                sayNameOf(insn->operand);
+                VM_SKIP_FUSED();
+                VM_NEXT();
+            VM_CASE(dopPushJump)
+                VM_JUMP_FUSED();
+                VM_NEXT();
+            VM_CASE(dopPushJumpTrue)
+                a1 = stack.pop();
+                VM_JUMP_FUSED_IF(a1);
+                VM_NEXT();
+            VM_CASE(dopPushJumpFalse)
+                a1 = stack.pop();
+                VM_JUMP_FUSED_IF(!a1);
+                VM_NEXT();
+            VM_CASE(dopPushJumpEq)
+                a1 = stack.pop();
+                a2 = stack.pop();
+                VM_JUMP_FUSED_IF(a1 == a2);
+                VM_NEXT();
+            VM_CASE(dopPushJumpNeq)
+                a1 = stack.pop();
+                a2 = stack.pop();
+                VM_JUMP_FUSED_IF(a1 != a2);
+                VM_NEXT();
+            VM_CASE(dopPushJumpLt)
+                a1 = stack.pop();
+                a2 = stack.pop();
+                VM_JUMP_FUSED_IF(static_cast<int>(a1) > static_cast<int>(a2));
+                VM_NEXT();
+            VM_CASE(dopPushJumpLte)
+                a1 = stack.pop();
+                a2 = stack.pop();
+                VM_JUMP_FUSED_IF(static_cast<int>(a1) >= static_cast<int>(a2));
+                VM_NEXT();
+            VM_CASE(dopPushJumpGt)
+                a1 = stack.pop();
+                a2 = stack.pop();
+                VM_JUMP_FUSED_IF(static_cast<int>(a1) < static_cast<int>(a2));
+                VM_NEXT();
+            VM_CASE(dopPushJumpGte)
+                a1 = stack.pop();
+                a2 = stack.pop();
+                VM_JUMP_FUSED_IF(static_cast<int>(a1) <= static_cast<int>(a2));
+                VM_NEXT();
+
+            VM_CASE(dopTruncated)
+                // the checked reads throw the appropriate error
+                readByte(insn->address);
+                readWord(insn->address + 1);
+                throw PlayError("Truncated instruction in node");
 
-            default: {
+            VM_DEFAULT {
                 std::stringstream ss;
                 ss << std::hex;
                 ss << "Encountered unknown command 0x" << (int)cmdCode;
-                ss << " at 0x" << (ip-1) << '.';
+                ss << " at 0x" << insn->address << '.';
                 throw PlayError(ss.str());
             }
         }
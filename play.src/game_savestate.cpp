@@ -0,0 +1,469 @@
+#include <algorithm>
+#include <istream>
+#include <ostream>
+#include <set>
+#include <sstream>
+#include <tuple>
+
+#include "play.h"
+#include "varint.h"
+
+// Snapshot layout: the magic bytes and format version, the image's build
+// number, then each part of the game state in the order written below. All
+// numbers after the build number are varints (see varint.h).
+static const char snapshotMagic[4] = { 'G', 'T', 'S', 'V' };
+static const unsigned snapshotVersion = 1;
+// no real game comes anywhere near this many options, items or characters
+static const std::uint32_t maxCount = 0x100000;
+
+static const unsigned flagGameStarted   = 0x01;
+static const unsigned flagIsRunning     = 0x02;
+static const unsigned flagInLocation    = 0x04;
+static const unsigned flagNewLocation   = 0x08;
+static const unsigned flagInCombat      = 0x10;
+static const unsigned flagStartedCombat = 0x20;
+
+
+/* ************************************************************************* *
+ * HELPERS                                                                   *
+ * ************************************************************************* */
+
+// Guards against allocating huge amounts for a corrupt count.
+static std::uint32_t readCount(std::istream &in) {
+    const std::uint32_t count = readVarint(in);
+    if (count > maxCount) {
+        throw PlayError("Malformed value in saved data.");
+    }
+    return count;
+}
+
+static void writeList(std::ostream &out, const std::vector<std::uint32_t> &list) {
+    writeVarint(out, list.size());
+    for (std::uint32_t value : list) {
+        writeVarint(out, value);
+    }
+}
+
+static void readList(std::istream &in, std::vector<std::uint32_t> &list) {
+    list.resize(readCount(in));
+    for (std::uint32_t &value : list) {
+        value = readVarint(in);
+    }
+}
+
+
+/* ************************************************************************* *
+ * SAVING                                                                    *
+ * ************************************************************************* */
+
+// Writes the parts of the state kept whole by the undo history.
+void Game::writeTurnState(std::ostream &out) const {
+    unsigned flags = 0;
+    if (gameStarted)    flags |= flagGameStarted;
+    if (isRunning)      flags |= flagIsRunning;
+    if (inLocation)     flags |= flagInLocation;
+    if (newLocation)    flags |= flagNewLocation;
+    if (inCombat)       flags |= flagInCombat;
+    if (startedCombat)  flags |= flagStartedCombat;
+    writeVarint(out, flags);
+    writeVarint(out, location);
+    writeVarint(out, locationName);
+    writeVarint(out, gameTime);
+    writeVarint(out, afterCombatNode);
+    writeVarint(out, currentCombatant);
+    writeVarint(out, combatRound);
+
+    writeVarint(out, options.size());
+    for (const Option &option : options) {
+        writeVarint(out, option.name);
+        writeVarint(out, option.dest);
+        writeVarint(out, option.extra);
+    }
+    writeList(out, party);
+    writeList(out, combatants);
+    // temps are only written for the outermost call, the only one there is
+    // between turns
+    for (unsigned i = 0; i < storageTempCount; ++i) {
+        writeVarint(out, tempRegisters[i]);
+    }
+    const std::string text = output.rawText();
+    writeVarint(out, text.size());
+    out.write(text.data(), text.size());
+    rng.write(out);
+}
+
+void Game::saveState(std::ostream &out) const {
+    out.write(snapshotMagic, sizeof(snapshotMagic));
+    writeVarint(out, snapshotVersion);
+    writeVarint(out, readWord(headerBuildNumber));
+    writeTurnState(out);
+
+    writeVarint(out, inventory.size());
+    for (const CarriedItem &item : inventory) {
+        writeSignedVarint(out, item.qty);
+        writeVarint(out, item.itemIdent);
+    }
+    writeList(out, globals);
+    storage.write(out);
+
+    // the stat block's size comes from the image, and the cached skill
+    // maximums are left out to be recomputed after restoring
+    writeVarint(out, characterPool.size());
+    for (const Character &c : characterPool) {
+        writeVarint(out, c.def);
+        writeVarint(out, c.sex);
+        writeVarint(out, c.species);
+        for (unsigned i = 0; i < c.skillCount * 2; ++i) {
+            writeSignedVarint(out, c.stats[i]);
+        }
+        for (unsigned i = c.skillCount * 3; i < statBlockSize; ++i) {
+            writeSignedVarint(out, c.stats[i]);
+        }
+        writeVarint(out, c.gear.size());
+        for (const GearList::Entry &entry : c.gear) {
+            writeVarint(out, entry.first);
+            writeVarint(out, entry.second);
+        }
+    }
+
+    if (!out) {
+        throw PlayError("Could not write saved game.");
+    }
+}
+
+
+/* ************************************************************************* *
+ * RESTORING                                                                 *
+ * ************************************************************************* */
+
+void Game::readTurnState(std::istream &in, TurnState &state) const {
+    const unsigned flags = readVarint(in);
+    state.gameStarted = flags & flagGameStarted;
+    state.isRunning = flags & flagIsRunning;
+    state.inLocation = flags & flagInLocation;
+    state.newLocation = flags & flagNewLocation;
+    state.inCombat = flags & flagInCombat;
+    state.startedCombat = flags & flagStartedCombat;
+    state.location = readVarint(in);
+    state.locationName = readVarint(in);
+    state.gameTime = readVarint(in);
+    state.afterCombatNode = readVarint(in);
+    state.currentCombatant = readVarint(in);
+    state.combatRound = readVarint(in);
+
+    state.options.resize(readCount(in));
+    for (Option &option : state.options) {
+        option.name = readVarint(in);
+        option.dest = readVarint(in);
+        option.extra = readVarint(in);
+    }
+    readList(in, state.party);
+    readList(in, state.combatants);
+    state.temps.resize(storageTempCount);
+    for (std::uint32_t &temp : state.temps) {
+        temp = readVarint(in);
+    }
+    state.output.resize(readCount(in));
+    if (!state.output.empty() && !in.read(&state.output[0], state.output.size())) {
+        throw PlayError("Unexpected end of saved data.");
+    }
+    state.rng.read(in);
+}
+
+// Everything is read into locals first, so a snapshot that turns out to be
+// truncated or corrupt leaves the game as it was.
+void Game::restoreState(std::istream &in) {
+    if (!image) {
+        throw PlayError("Cannot restore a game without a game file.");
+    }
+    char magic[sizeof(snapshotMagic)];
+    if (!in.read(magic, sizeof(magic))
+            || !std::equal(magic, magic + sizeof(magic), snapshotMagic)) {
+        throw PlayError("Not a saved game.");
+    }
+    if (readVarint(in) != snapshotVersion) {
+        throw PlayError("Saved game is from an unsupported version.");
+    }
+    if (readVarint(in) != readWord(headerBuildNumber)) {
+        throw PlayError("Saved game is from a different build of this game.");
+    }
+
+    TurnState state;
+    readTurnState(in, state);
+
+    // the items were saved in name order, which lookups depend on
+    ItemList newInventory;
+    const std::uint32_t itemCount = readCount(in);
+    std::uint32_t lastKey = 0;
+    for (std::uint32_t i = 0; i < itemCount; ++i) {
+        const int qty = readSignedVarint(in);
+        const std::uint32_t itemIdent = readVarint(in);
+        const std::uint32_t key = itemSortKey(itemIdent);
+        if (key < lastKey || newInventory.find(itemIdent) >= 0) {
+            throw PlayError("Saved game does not match the game file.");
+        }
+        newInventory.insertAt(i, CarriedItem(qty, itemIdent), key);
+        lastKey = key;
+    }
+    std::vector<std::uint32_t> newGlobals;
+    readList(in, newGlobals);
+    if (newGlobals.size() != globals.size()) {
+        throw PlayError("Saved game does not match the game file.");
+    }
+    StorageTable newStorage;
+    newStorage.read(in);
+
+    const unsigned skillCount = getSkillCount();
+    std::vector<Character> newCharacters(readCount(in));
+    std::vector<int> newStats(newCharacters.size() * statBlockSize, 0);
+    std::vector<unsigned> newSlots(image->getObjectList().size(), 0);
+    for (unsigned index = 0; index < newCharacters.size(); ++index) {
+        Character &c = newCharacters[index];
+        c.def = readVarint(in);
+        const int objectSlot = image->findObjectSlot(c.def);
+        if (objectSlot < 0 || newSlots[objectSlot] != 0) {
+            throw PlayError("Saved game does not match the game file.");
+        }
+        newSlots[objectSlot] = index + 1;
+
+        c.sex = readVarint(in);
+        c.species = readVarint(in);
+        c.skillCount = skillCount;
+        int *stats = newStats.data() + index * statBlockSize;
+        for (unsigned i = 0; i < skillCount * 2; ++i) {
+            stats[i] = readSignedVarint(in);
+        }
+        for (unsigned i = skillCount * 3; i < statBlockSize; ++i) {
+            stats[i] = readSignedVarint(in);
+        }
+        const std::uint32_t gearCount = readCount(in);
+        for (std::uint32_t i = 0; i < gearCount; ++i) {
+            const std::uint32_t slot = readVarint(in);
+            c.gear.set(slot, readVarint(in));
+        }
+        c.skillMaxValid = false;
+        c.koValid = false;
+        c.koed = false;
+    }
+
+    applyTurnState(state);
+    inventory.swap(newInventory);
+    globals.swap(newGlobals);
+    storage = std::move(newStorage);
+    characterPool.resize(newCharacters.size());
+    for (unsigned i = 0; i < newCharacters.size(); ++i) {
+        characterPool[i] = std::move(newCharacters[i]);
+    }
+    statArena.swap(newStats);
+    pointStatsAtArena();
+    characterSlots.swap(newSlots);
+    undoHistory.clear();
+    undoBytes = 0;
+}
+
+
+/* ************************************************************************* *
+ * UNDO HISTORY                                                              *
+ * ************************************************************************* */
+
+// Moves the state's contents into the game, leaving state unusable.
+void Game::applyTurnState(TurnState &state) {
+    gameStarted = state.gameStarted;
+    isRunning = state.isRunning;
+    inLocation = state.inLocation;
+    newLocation = state.newLocation;
+    inCombat = state.inCombat;
+    startedCombat = state.startedCombat;
+    location = state.location;
+    locationName = state.locationName;
+    afterCombatNode = state.afterCombatNode;
+    gameTime = state.gameTime;
+    currentCombatant = state.currentCombatant;
+    combatRound = state.combatRound;
+    options.swap(state.options);
+    party.swap(state.party);
+    combatants.swap(state.combatants);
+    tempRegisters.assign(state.temps.begin(), state.temps.end());
+    tempBase = 0;
+    output.assign(state.output);
+    rng = state.rng;
+}
+
+void Game::setUndoLimit(unsigned maxTurns, size_t maxBytes) {
+    undoMaxTurns = maxTurns;
+    undoMaxBytes = maxBytes;
+    if (maxTurns == 0) {
+        undoHistory.clear();
+        undoBytes = 0;
+    } else {
+        trimUndoHistory();
+    }
+}
+
+size_t Game::undoMemoryUsed() const {
+    return undoBytes;
+}
+
+unsigned Game::poolIndexOf(const Character *c) const {
+    return characterSlots[image->findObjectSlot(c->def)] - 1;
+}
+
+void Game::journalStat(const Character *c, unsigned statIndex) {
+    if (journaling()) {
+        journal(JournalEntry::Stat, poolIndexOf(c), statIndex, c->stats[statIndex]);
+    }
+}
+
+void Game::journalGear(const Character *c, std::uint32_t slot) {
+    if (journaling()) {
+        journal(JournalEntry::Gear, poolIndexOf(c), slot, c->gear.get(slot));
+    }
+}
+
+// Records a character's sex or species (as kind says) before it changes.
+void Game::journalIdentity(const Character *c, JournalEntry::Kind kind) {
+    if (journaling()) {
+        journal(kind, poolIndexOf(c), 0, kind == JournalEntry::Sex ? c->sex : c->species);
+    }
+}
+
+// Starts recording a new turn, first compacting the one before it (which
+// may have been changed by calls made between turns).
+void Game::beginTurn() {
+    if (undoMaxTurns == 0) {
+        return;
+    }
+    if (!undoHistory.empty() && undoHistory.back().bytes == 0) {
+        compactTurn(undoHistory.back());
+    }
+    std::ostringstream state;
+    writeTurnState(state);
+    undoHistory.push_back(UndoTurn());
+    UndoTurn &turn = undoHistory.back();
+    turn.state = state.str();
+    turn.bytes = 0;
+    trimUndoHistory();
+}
+
+// Keeps only the first (oldest) entry for each thing changed, since undoing
+// a turn replays its entries newest first and so that is the one that wins,
+// then drops storage entries for things that ended the turn as they began
+// it. Inventory entries are all kept: each puts a removed item back at the
+// position it had when it was removed, which only holds if every later
+// change to the list is undone first.
+void Game::compactTurn(UndoTurn &turn) {
+    std::set<std::tuple<int, std::uint32_t, std::uint32_t> > seen;
+    std::vector<JournalEntry> kept;
+    for (const JournalEntry &entry : turn.entries) {
+        if (entry.kind != JournalEntry::NewCharacter && entry.kind != JournalEntry::ResetCharacter
+                && entry.kind != JournalEntry::Inventory) {
+            if (!seen.insert(std::make_tuple(entry.kind, entry.target, entry.field)).second) {
+                continue;
+            }
+        }
+
+        if (entry.kind == JournalEntry::Storage && storage.get(entry.target) == entry.oldValue) {
+            continue;
+        }
+        if (entry.kind == JournalEntry::Global && globals[entry.target] == entry.oldValue) {
+            continue;
+        }
+        kept.push_back(entry);
+    }
+    turn.entries.swap(kept);
+
+    turn.bytes = sizeof(UndoTurn) + turn.entries.size() * sizeof(JournalEntry);
+    turn.bytes += turn.state.capacity();
+    for (const Character &c : turn.records) {
+        turn.bytes += sizeof(Character) + c.gear.size() * sizeof(GearList::Entry);
+    }
+    turn.bytes += turn.recordStats.capacity() * sizeof(int);
+    undoBytes += turn.bytes;
+}
+
+// Drops the oldest turns until the history is back within its limits; the
+// turn being recorded is always kept.
+void Game::trimUndoHistory() {
+    while (undoHistory.size() > 1
+            && (undoHistory.size() > undoMaxTurns || undoBytes > undoMaxBytes)) {
+        undoBytes -= undoHistory.front().bytes;
+        undoHistory.pop_front();
+    }
+}
+
+void Game::undoEntry(const JournalEntry &entry, UndoTurn &turn) {
+    switch(entry.kind) {
+        case JournalEntry::Storage:
+            storage.set(entry.target, entry.oldValue);
+            break;
+        case JournalEntry::Global:
+            globals[entry.target] = entry.oldValue;
+            break;
+        case JournalEntry::Inventory: {
+            const int index = inventory.find(entry.target);
+            if (entry.field == 0) {
+                if (index >= 0) {
+                    inventory.erase(index);
+                }
+            } else if (index >= 0) {
+                inventory.setQty(index, entry.oldValue);
+            } else {
+                inventory.insertAt(entry.field - 1, CarriedItem(entry.oldValue, entry.target),
+                                   itemSortKey(entry.target));
+            }
+            break; }
+        case JournalEntry::Stat: {
+            Character &c = characterPool[entry.target];
+            c.stats[entry.field] = entry.oldValue;
+            invalidateStats(&c);
+            break; }
+        case JournalEntry::Gear: {
+            Character &c = characterPool[entry.target];
+            if (entry.oldValue) {
+                c.gear.set(entry.field, entry.oldValue);
+            } else {
+                c.gear.remove(entry.field);
+            }
+            invalidateStats(&c);
+            break; }
+        case JournalEntry::Sex:
+            characterPool[entry.target].sex = entry.oldValue;
+            break;
+        case JournalEntry::Species:
+            characterPool[entry.target].species = entry.oldValue;
+            break;
+        case JournalEntry::NewCharacter:
+            characterSlots[image->findObjectSlot(characterPool.back().def)] = 0;
+            characterPool.pop_back();
+            statArena.resize(characterPool.size() * statBlockSize);
+            break;
+        case JournalEntry::ResetCharacter: {
+            Character &c = characterPool[entry.target];
+            int *stats = c.stats;
+            c = std::move(turn.records[entry.field]);
+            c.stats = stats;
+            auto saved = turn.recordStats.begin() + entry.field * statBlockSize;
+            std::copy(saved, saved + statBlockSize, stats);
+            invalidateStats(&c);
+            break; }
+    }
+}
+
+// Takes back the most recent turn: its journal is replayed newest first,
+// then the state copied when it began is put back.
+bool Game::undo() {
+    if (undoHistory.empty()) {
+        return false;
+    }
+    UndoTurn &turn = undoHistory.back();
+    for (auto entry = turn.entries.rbegin(); entry != turn.entries.rend(); ++entry) {
+        undoEntry(*entry, turn);
+    }
+    std::istringstream in(turn.state);
+    TurnState state;
+    readTurnState(in, state);
+    applyTurnState(state);
+    undoBytes -= turn.bytes;
+    undoHistory.pop_back();
+    return true;
+}
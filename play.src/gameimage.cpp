@@ -0,0 +1,561 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define GTRPGE_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "gameimage.h"
+
+
+/* ************************************************************************* *
+ * LOADING DATA FROM GAME FILE                                               *
+ * ************************************************************************* */
+
+std::shared_ptr<const GameImage> GameImage::loadFromFile(const std::string &filename, bool fuse) {
+    std::shared_ptr<GameImage> image(new GameImage);
+    image->fuseCode = fuse;
+
+#ifdef GTRPGE_USE_MMAP
+    // Map the game file read-only; the page cache shares a single copy of
+    // the image between every process playing the same file.
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw PlayError("Could not read game data from "+filename+".");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        throw PlayError("Could not read game data.");
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw PlayError("Could not map game data from "+filename+".");
+    }
+
+    image->data = static_cast<const std::uint8_t*>(mapping);
+    image->dataSize = info.st_size;
+    image->isMapped = true;
+#else
+    std::ifstream inf(filename, std::ios::binary | std::ios::in | std::ios::ate);
+    if (!inf) {
+        throw PlayError("Could not read game data from "+filename+".");
+    }
+    std::streamsize size = inf.tellg();
+    inf.seekg(0);
+
+    std::uint8_t *buffer = new std::uint8_t[size];
+    image->data = buffer;
+    image->dataSize = size;
+    if (!inf.read((char*)buffer, size)) {
+        throw PlayError("Could not read game data.");
+    }
+#endif
+
+    if (image->dataSize < headerSize || memcmp(image->data, "GRPG", 4) != 0) {
+        throw PlayError(filename+" is not a game file.");
+    }
+    image->buildTables();
+    return image;
+}
+
+// Copies an in-memory image. Tables are only built when the data starts
+// with a game file header, so tests may wrap arbitrary bytes.
+std::shared_ptr<const GameImage> GameImage::fromMemory(const std::uint8_t *data, size_t size, bool fuse) {
+    std::shared_ptr<GameImage> image(new GameImage);
+    image->fuseCode = fuse;
+
+    std::uint8_t *dataCopy = new std::uint8_t[size];
+    memcpy(dataCopy, data, size);
+    image->data = dataCopy;
+    image->dataSize = size;
+
+    if (size >= headerSize && memcmp(data, "GRPG", 4) == 0) {
+        image->buildTables();
+    }
+    return image;
+}
+
+GameImage::~GameImage() {
+    if (!data) return;
+#ifdef GTRPGE_USE_MMAP
+    if (isMapped) {
+        munmap(const_cast<std::uint8_t*>(data), dataSize);
+        return;
+    }
+#endif
+    delete[] data;
+}
+
+void GameImage::buildTables() {
+    sortedMaps = (readWord(headerFlags) & hflSortedMaps) != 0;
+
+    const int skillTable = readWord(headerSkillTable);
+    const int skillCount = readByte(skillTable);
+    for (int i = 0; i < skillCount; ++i) {
+        const int skillSrc = skillTable + i * sklSize + 1;
+        SkillDef skillDef;
+        skillDef.nameAddress    = readWord(skillSrc + sklName);
+        if (readWord(skillSrc + sklName) == 0) {
+            continue;
+        }
+        skillDef.baseSkill      = readWord(skillSrc + sklBaseSkill);
+        skillDef.flags          = readWord(skillSrc + sklFlags);
+        skillDef.defaultValue   = readWord(skillSrc + sklDefault);
+        skillDef.recoveryRate   = readWord(skillSrc + sklRecovery);
+        skillDefs.push_back(std::move(skillDef));
+    }
+
+    const int damageTypeTable = readWord(headerDamageTypes);
+    const int dtCount = readByte(damageTypeTable);
+    for (int i = 0; i < dtCount; ++i) {
+        const int typeSrc = damageTypeTable + 1 + i * damageTypeSize;
+        DamageType dType;
+        dType.nameAddress = readWord(typeSrc);
+        if (dType.nameAddress) {
+            damageTypes.push_back(std::move(dType));
+        }
+    }
+
+    std::uint32_t firstNode = buildObjectIndex(damageTypeTable + 1 + dtCount * damageTypeSize);
+
+    // older game files have no globals table and keep all storage in the
+    // Game's hash table
+    const std::uint32_t globalsTable = readWord(headerGlobals);
+    if (globalsTable && readByte(globalsTable) == idGlobals) {
+        const std::uint32_t count = readWord(globalsTable + 1);
+        for (std::uint32_t i = 0; i < count; ++i) {
+            globalKeys.push_back(readWord(globalsTable + 5 + i * 4));
+        }
+        firstNode = globalsTable + 5 + count * 4;
+    }
+
+    decodeNodes(firstNode);
+}
+
+// Returns the slot of a global variable's storage key, or -1 if the key was
+// not given a slot when the game was built.
+int GameImage::findGlobal(std::uint32_t key) const {
+    auto pos = std::lower_bound(globalKeys.begin(), globalKeys.end(), key);
+    if (pos == globalKeys.end() || *pos != key) {
+        return -1;
+    }
+    return pos - globalKeys.begin();
+}
+
+// The lists, maps and objects follow the damage type table back to back and
+// end where the first node begins, so they can be walked by their headers.
+// Returns where the walk stopped.
+std::uint32_t GameImage::buildObjectIndex(std::uint32_t firstItem) {
+    std::uint32_t pos = firstItem;
+    while (pos < dataSize) {
+        const int type = readByte(pos);
+        if (type == idList) {
+            pos += 2 + readByte(pos + 1) * 4;
+        } else if (type == idMap) {
+            pos += gmapHeader + readWord(pos + gmapCount) * gmapEntrySize;
+        } else if (type == idObject) {
+            const int count = readShort(pos + 1);
+
+            ObjectProperties props;
+            props.present = 0;
+            for (int i = 0; i <= propCount; ++i) {
+                props.values[i] = 0;
+            }
+            for (int i = 0; i < count; ++i) {
+                const std::uint32_t currentProperty = pos + 3 + objPropSize * i;
+                const std::uint16_t propId = readShort(currentProperty + objPropId);
+                if (propId > propCount) continue;
+                const std::uint64_t bit = static_cast<std::uint64_t>(1) << propId;
+                if (props.present & bit) continue;
+                props.present |= bit;
+                props.values[propId] = readWord(currentProperty + objPropValue);
+            }
+
+            objectProperties.push_back(props);
+            objectList.push_back(pos);
+            pos += 3 + count * objPropSize;
+        } else {
+            break;
+        }
+    }
+
+    // address to slot table covering every indexed object
+    objectBase = firstItem;
+    objectSlots.assign((pos - firstItem) / objectSpacing + 1, 0);
+    for (unsigned i = 0; i < objectList.size(); ++i) {
+        objectSlots[(objectList[i] - objectBase) / objectSpacing] = i + 1;
+    }
+
+    // names whose parts are not strings are left to fail when they are shown
+    objectNames.resize(objectList.size());
+    for (unsigned i = 0; i < objectList.size(); ++i) {
+        const std::uint32_t name = getObjectProperty(objectList[i], propName);
+        const std::uint32_t article = getObjectProperty(objectList[i], propArticle);
+        if ((name == 0 || isType(name, idString)) && (article == 0 || isType(article, idString))) {
+            objectNames[i] = composeObjectName(objectList[i]);
+        }
+    }
+
+    std::vector<unsigned> byName;
+    for (unsigned i = 0; i < objectList.size(); ++i) {
+        const std::uint32_t name = getObjectProperty(objectList[i], propName);
+        if (name != 0 && isType(name, idString)) {
+            byName.push_back(i);
+        }
+    }
+    auto nameOf = [this](unsigned slot) {
+        return getString(getObjectProperty(objectList[slot], propName));
+    };
+    std::sort(byName.begin(), byName.end(), [&nameOf](unsigned a, unsigned b) {
+        return strcmp(nameOf(a), nameOf(b)) < 0;
+    });
+    objectNameOrder.assign(objectList.size(), -1);
+    int order = -1;
+    for (unsigned i = 0; i < byName.size(); ++i) {
+        if (i == 0 || strcmp(nameOf(byName[i - 1]), nameOf(byName[i])) != 0) {
+            ++order;
+        }
+        objectNameOrder[byName[i]] = order;
+    }
+    return pos;
+}
+
+// The article and name of an object as shown to the player, or a placeholder
+// giving its address if it has no name.
+std::string GameImage::composeObjectName(std::uint32_t objRef) const {
+    const std::uint32_t name = getObjectProperty(objRef, propName);
+    if (name == 0) {
+        std::stringstream ss;
+        ss << "[ObjectDef@" << std::hex << std::uppercase << objRef << "]";
+        return ss.str();
+    }
+    std::string text;
+    const std::uint32_t article = getObjectProperty(objRef, propArticle);
+    if (article) {
+        text += getString(article);
+    }
+    text += getString(name);
+    return text;
+}
+
+
+/* ************************************************************************* *
+ * DECODED CODE                                                              *
+ * ************************************************************************* */
+
+// Nodes sit back to back at the end of the file and a block is decoded up to
+// and including the next node's idNode byte, so each block shows where the
+// next node starts.
+void GameImage::decodeNodes(std::uint32_t firstNode) {
+    std::uint32_t node = firstNode;
+    while (node < dataSize && readByte(node) == idNode) {
+        std::unique_ptr<DecodedCode> block = decodeBlock(node + 1);
+        const DecodedInstruction &last = block->code.back();
+        const bool more = last.opcode == idNode;
+        node = last.address;
+        nodeCode.insert(std::make_pair(block->start, std::move(block)));
+        if (!more) {
+            break;
+        }
+    }
+}
+
+// Returns the decoded instructions starting at address. Every node is decoded
+// when the image is loaded; any other address is decoded on first use.
+const DecodedCode* GameImage::decodeAt(std::uint32_t address) const {
+    auto node = nodeCode.find(address);
+    if (node != nodeCode.end()) {
+        return node->second.get();
+    }
+
+    std::lock_guard<std::mutex> lock(decodedCodeLock);
+    auto existing = decodedCode.find(address);
+    if (existing != decodedCode.end()) {
+        return existing->second.get();
+    }
+    std::unique_ptr<DecodedCode> block = decodeBlock(address);
+    const DecodedCode *result = block.get();
+    decodedCode.insert(std::make_pair(address, std::move(block)));
+    return result;
+}
+
+// Decodes the instructions starting at address. Decoding stops after the
+// first idNode byte (which the interpreter will reject as an unknown command,
+// as it would the raw byte); if the end of the file or a truncated instruction
+// is reached first, a dopTruncated marks the spot.
+std::unique_ptr<DecodedCode> GameImage::decodeBlock(std::uint32_t address) const {
+    std::unique_ptr<DecodedCode> block(new DecodedCode);
+    block->start = address;
+    std::uint32_t pos = address;
+    bool reachedNode = false;
+    while (pos < dataSize && !reachedNode) {
+        DecodedInstruction instruction;
+        instruction.opcode = data[pos];
+        instruction.length = 1;
+        instruction.operand = instruction.operand2 = 0;
+        instruction.target = -1;
+        instruction.address = pos;
+        std::uint32_t size = 1;
+        if (instruction.opcode == opPush) {
+            size = 5;
+        } else if (instruction.opcode == opFetchGlobal || instruction.opcode == opStoreGlobal) {
+            size = 3;
+        }
+        if (dataSize - pos < size) {
+            break;
+        }
+        if (size == 5) {
+            instruction.operand = readWord(pos + 1);
+        } else if (size == 3) {
+            instruction.operand = readShort(pos + 1);
+        }
+        reachedNode = instruction.opcode == idNode;
+
+        block->instructionAt.resize(pos - address + size, -1);
+        block->instructionAt[pos - address] = block->code.size();
+        block->code.push_back(instruction);
+        pos += size;
+    }
+    if (!reachedNode) {
+        block->code.push_back(DecodedInstruction{ dopTruncated, 1, 0, 0, -1, pos });
+    }
+    if (fuseCode) {
+        fuseInstructions(*block);
+    }
+    return block;
+}
+
+// Replaces common push sequences with superinstructions. Almost every
+// statement compiles to pushes followed by the opcode consuming them, so the
+// pairs chosen here cover most of what the demo game runs.
+void GameImage::fuseInstructions(DecodedCode &block) {
+    auto &code = block.code;
+    for (size_t i = 0; i + 1 < code.size(); ++i) {
+        DecodedInstruction &first = code[i];
+        if (first.opcode != opPush) {
+            continue;
+        }
+
+        if (i + 2 < code.size() && code[i + 1].opcode == opPush
+                && code[i + 2].opcode == opAddOption) {
+            first.opcode = dopPushPushAddOption;
+            first.operand2 = code[i + 1].operand;
+            first.length = 3;
+            continue;
+        }
+
+        std::uint16_t fused = 0;
+        switch (code[i + 1].opcode) {
+            case opFetch:       fused = dopPushFetch;       break;
+            case opSay:         fused = dopPushSay;         break;
+            case opJump:        fused = dopPushJump;        break;
+            case opJumpTrue:    fused = dopPushJumpTrue;    break;
+            case opJumpFalse:   fused = dopPushJumpFalse;   break;
+            case opJumpEq:      fused = dopPushJumpEq;      break;
+            case opJumpNeq:     fused = dopPushJumpNeq;     break;
+            case opJumpLt:      fused = dopPushJumpLt;      break;
+            case opJumpLte:     fused = dopPushJumpLte;     break;
+            case opJumpGt:      fused = dopPushJumpGt;      break;
+            case opJumpGte:     fused = dopPushJumpGte;     break;
+        }
+        if (fused) {
+            first.opcode = fused;
+            first.length = 2;
+            if (fused >= dopPushJump) {
+                first.target = block.indexOf(first.operand);
+            }
+        }
+    }
+}
+
+
+/* ************************************************************************* *
+ * FETCHING GAME DATA                                                        *
+ * ************************************************************************* */
+
+int GameImage::getSkillCount() const {
+    return skillDefs.size();
+}
+
+const SkillDef* GameImage::getSkillDef(unsigned skillNo) const {
+    if (skillNo >= skillDefs.size()) {
+        return nullptr;
+    }
+    return &skillDefs[skillNo];
+}
+
+int GameImage::getDamageTypeCount() const {
+    return damageTypes.size();
+}
+
+const DamageType* GameImage::getDamageType(unsigned damageTypeNo) const {
+    if (damageTypeNo >= damageTypes.size()) {
+        return nullptr;
+    }
+    return &damageTypes[damageTypeNo];
+}
+
+
+/* ************************************************************************* *
+ * RAW DATA ACCESS                                                           *
+ * ************************************************************************* */
+
+int GameImage::getType(std::uint32_t address) const {
+    return readByte(address);
+}
+
+bool GameImage::isType(std::uint32_t address, uint8_t type) const {
+    return readByte(address) == type;
+}
+
+std::uint8_t GameImage::readByte(std::uint32_t pos) const {
+    if (pos >= dataSize) throw PlayError("Tried to read past end of file.");
+    return (uint8_t)data[pos];
+}
+
+std::uint16_t GameImage::readShort(std::uint32_t pos) const {
+    if (pos >= dataSize || dataSize - pos < 2) throw PlayError("Tried to read past end of file.");
+    std::uint16_t v = 0;
+    v |= (unsigned char)data[pos];
+    v |= (unsigned char)data[pos+1] << 8;
+    return v;
+}
+
+std::uint32_t GameImage::readWord(std::uint32_t pos) const {
+    if (pos >= dataSize || dataSize - pos < 4) throw PlayError("Tried to read past end of file.");
+    std::uint32_t result = 0, value;
+    value = data[pos];  result |= value;
+    value = data[pos+1];  result |= value << 8;
+    value = data[pos+2];  result |= value << 16;
+    value = data[pos+3];  result |= value << 24;
+    return result;
+}
+
+const char *GameImage::getString(std::uint32_t address) const {
+    if (!isType(address, idString)) {
+        std::stringstream ss;
+        ss << "Tried to read non-string at address 0x" << std::hex << std::uppercase << address;
+        ss << " as a string.";
+        throw PlayError(ss.str());
+    }
+    return reinterpret_cast<const char*>(&data[address+1]);
+}
+
+std::uint32_t GameImage::getFromMap(std::uint32_t address, std::uint32_t value) const {
+    if (!isType(address, idMap)) {
+        throw PlayError("Tried to get value from non-map");
+    }
+
+    std::uint32_t entry;
+    if (findMapEntry(address, value, entry)) {
+        return readWord(entry + 4);
+    }
+    return 0;
+}
+
+bool GameImage::mapHasValue(std::uint32_t address, std::uint32_t value) const {
+    if (!isType(address, idMap)) {
+        throw PlayError("Tried to check for key in non-map");
+    }
+
+    std::uint32_t entry;
+    return findMapEntry(address, value, entry);
+}
+
+// Finds the entry for key in the map at address. Files built with sorted
+// maps are binary searched; older files fall back to a linear scan.
+bool GameImage::findMapEntry(std::uint32_t address, std::uint32_t key, std::uint32_t &entry) const {
+    const std::uint32_t mapSize = readWord(address + gmapCount);
+    const std::uint32_t firstEntry = address + gmapHeader;
+
+    if (sortedMaps) {
+        if ((dataSize - firstEntry) / gmapEntrySize < mapSize) {
+            throw PlayError("Tried to read past end of file.");
+        }
+        std::uint32_t low = 0, high = mapSize;
+        while (low < high) {
+            const std::uint32_t middle = low + (high - low) / 2;
+            const std::uint32_t middleKey = readWord(firstEntry + middle * gmapEntrySize);
+            if (middleKey < key) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        if (low < mapSize && readWord(firstEntry + low * gmapEntrySize) == key) {
+            entry = firstEntry + low * gmapEntrySize;
+            return true;
+        }
+        return false;
+    }
+
+    for (std::uint32_t i = 0; i < mapSize; ++i) {
+        if (readWord(firstEntry + i * gmapEntrySize) == key) {
+            entry = firstEntry + i * gmapEntrySize;
+            return true;
+        }
+    }
+    return false;
+}
+
+std::uint32_t GameImage::getObjectProperty(std::uint32_t objRef, std::uint16_t propId) const {
+    if (propId <= propCount) {
+        const ObjectProperties *props = findObject(objRef);
+        if (props) {
+            return props->values[propId];
+        }
+    }
+    return scanObjectProperty(objRef, propId);
+}
+
+bool GameImage::objectHasProperty(std::uint32_t objRef, std::uint16_t propId) const {
+    if (propId <= propCount) {
+        const ObjectProperties *props = findObject(objRef);
+        if (props) {
+            return (props->present & (static_cast<std::uint64_t>(1) << propId)) != 0;
+        }
+    }
+    return scanObjectHasProperty(objRef, propId);
+}
+
+std::uint32_t GameImage::scanObjectProperty(std::uint32_t objRef, std::uint16_t propId) const {
+    if (!isType(objRef, idObject)) {
+        throw PlayError("Tried to get property of non-object");
+    }
+
+    const int count = readShort(objRef + 1);
+    const std::uint32_t firstProperty = objRef + 3;
+    for (int i = 0; i < count; ++i) {
+        const std::uint32_t currentProperty = firstProperty + objPropSize * i;
+        if (propId == readShort(currentProperty + objPropId)) {
+            return readWord(currentProperty + objPropValue);
+        }
+    }
+
+    return 0;
+}
+
+bool GameImage::scanObjectHasProperty(std::uint32_t objRef, std::uint16_t propId) const {
+    if (!isType(objRef, idObject)) {
+        throw PlayError("Tried to test property of non-object");
+    }
+
+    const int count = readShort(objRef + 1);
+    const std::uint32_t firstProperty = objRef + 3;
+    for (int i = 0; i < count; ++i) {
+        const std::uint32_t currentProperty = firstProperty + objPropSize * i;
+        if (propId == readShort(currentProperty + objPropId)) {
+            return true;
+        }
+    }
+
+    return false;
+}
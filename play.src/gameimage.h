@@ -0,0 +1,217 @@
+#ifndef GAMEIMAGE_H
+#define GAMEIMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "constants.h"
+
+#include "playerror.h"
+
+struct SkillDef {
+    unsigned baseSkill;
+    unsigned nameAddress;
+    unsigned flags;
+    unsigned defaultValue;
+    unsigned recoveryRate;
+
+    bool testFlags(unsigned testFor) const {
+        return (flags & testFor) == testFor;
+    }
+};
+
+struct DamageType {
+    unsigned nameAddress;
+};
+
+// Opcodes that only appear in decoded code; real opcodes are single bytes.
+const std::uint16_t dopTruncated            = 0x100; // decoding ran off the end of the file
+// superinstructions: a push fused with the instruction(s) that consume it
+const std::uint16_t dopPushPushAddOption    = 0x101;
+const std::uint16_t dopPushFetch            = 0x102;
+const std::uint16_t dopPushSay              = 0x103;
+const std::uint16_t dopPushJump             = 0x104;
+const std::uint16_t dopPushJumpTrue         = 0x105;
+const std::uint16_t dopPushJumpFalse        = 0x106;
+const std::uint16_t dopPushJumpEq           = 0x107;
+const std::uint16_t dopPushJumpNeq          = 0x108;
+const std::uint16_t dopPushJumpLt           = 0x109;
+const std::uint16_t dopPushJumpLte          = 0x10A;
+const std::uint16_t dopPushJumpGt           = 0x10B;
+const std::uint16_t dopPushJumpGte          = 0x10C;
+const std::uint16_t dopLastOpcode           = dopPushJumpGte;
+
+// A single decoded instruction. The address it was read from is kept for
+// error messages.
+//
+// A superinstruction replaces only the first of the instructions it covers
+// (length of them in all); the others stay in place after it so jumps may
+// still land on them. operand2 holds the second push of
+// dopPushPushAddOption, and target is the index of a fused jump's
+// destination within the same block, or -1 if it lies elsewhere.
+struct DecodedInstruction {
+    std::uint16_t opcode;
+    std::uint16_t length;
+    std::uint32_t operand, operand2;
+    std::int32_t target;
+    std::uint32_t address;
+};
+
+// The bytecode from some address up to the start of the next node, decoded
+// once and shared by every session running the image. Jump targets are
+// resolved through instructionAt, which maps each byte offset from start to
+// the index of the instruction beginning there (or -1).
+struct DecodedCode {
+    std::uint32_t start;
+    std::vector<DecodedInstruction> code;
+    std::vector<std::int32_t> instructionAt;
+
+    int indexOf(std::uint32_t address) const {
+        if (address < start || address - start >= instructionAt.size()) {
+            return -1;
+        }
+        return instructionAt[address - start];
+    }
+};
+
+// The immutable part of a loaded game: the raw file bytes plus the tables
+// built from them at load time. An image is never modified once created, so
+// any number of Game sessions (on any number of threads) may share one.
+class GameImage {
+public:
+    // fuse false decodes without superinstructions, to measure what they save
+    static std::shared_ptr<const GameImage> loadFromFile(const std::string &filename, bool fuse = true);
+    static std::shared_ptr<const GameImage> fromMemory(const std::uint8_t *data, size_t size, bool fuse = true);
+
+    GameImage(const GameImage &) = delete;
+    GameImage& operator=(const GameImage &) = delete;
+    ~GameImage();
+
+    // ////////////////////////////////////////////////////////////////////////
+    // Raw Data Access                                                       //
+    size_t size() const {
+        return dataSize;
+    }
+    bool hasSortedMaps() const {
+        return sortedMaps;
+    }
+    std::uint8_t readByte(std::uint32_t pos) const;
+    std::uint16_t readShort(std::uint32_t pos) const;
+    std::uint32_t readWord(std::uint32_t pos) const;
+
+    int getType(std::uint32_t address) const;
+    bool isType(std::uint32_t address, uint8_t type) const;
+    const char *getString(std::uint32_t address) const;
+    std::uint32_t getFromMap(std::uint32_t address, std::uint32_t value) const;
+    bool mapHasValue(std::uint32_t address, std::uint32_t value) const;
+    std::uint32_t getObjectProperty(std::uint32_t objRef, std::uint16_t propId) const;
+    bool objectHasProperty(std::uint32_t objRef, std::uint16_t propId) const;
+    // unindexed lookups; used for custom properties and unindexed objects
+    std::uint32_t scanObjectProperty(std::uint32_t objRef, std::uint16_t propId) const;
+    bool scanObjectHasProperty(std::uint32_t objRef, std::uint16_t propId) const;
+    const std::vector<std::uint32_t>& getObjectList() const {
+        return objectList;
+    }
+    // position of objRef in getObjectList(), or -1 if it is not an object
+    int findObjectSlot(std::uint32_t objRef) const {
+        if (objRef < objectBase) return -1;
+        const std::uint32_t bucket = (objRef - objectBase) / objectSpacing;
+        if (bucket >= objectSlots.size()) return -1;
+        const std::uint32_t slot = objectSlots[bucket];
+        if (slot == 0 || objectList[slot - 1] != objRef) return -1;
+        return slot - 1;
+    }
+    // The article and name of an object, composed at load time, or nullptr
+    // if the object is unindexed or its name must be composed on each use
+    // (see composeObjectName).
+    const std::string* findObjectName(std::uint32_t objRef) const {
+        const int slot = findObjectSlot(objRef);
+        if (slot < 0 || objectNames[slot].empty()) return nullptr;
+        return &objectNames[slot];
+    }
+    std::string composeObjectName(std::uint32_t objRef) const;
+    // Where the object's name falls among the names of every indexed object
+    // (equal names share a place), for sorting by name without comparing
+    // strings; -1 if it is unindexed or its name is not a string.
+    int getNameOrder(std::uint32_t objRef) const {
+        const int slot = findObjectSlot(objRef);
+        return slot < 0 ? -1 : objectNameOrder[slot];
+    }
+
+    // ////////////////////////////////////////////////////////////////////////
+    // Decoded Code                                                          //
+    const DecodedCode* decodeAt(std::uint32_t address) const;
+
+    // ////////////////////////////////////////////////////////////////////////
+    // Game Tables                                                           //
+    int getSkillCount() const;
+    const SkillDef* getSkillDef(unsigned skillNo) const;
+    int getDamageTypeCount() const;
+    const DamageType* getDamageType(unsigned damageTypeNo) const;
+    size_t getGlobalCount() const {
+        return globalKeys.size();
+    }
+    int findGlobal(std::uint32_t key) const;
+
+private:
+    // Values of the built-in properties (1 to propCount) of one object,
+    // resolved at load time so lookups never walk the property records.
+    static_assert(propCount < 64, "built-in properties must fit the presence mask");
+    struct ObjectProperties {
+        std::uint64_t present;
+        std::uint32_t values[propCount + 1];
+    };
+
+    GameImage()
+    : data(nullptr), dataSize(0), isMapped(false), sortedMaps(false),
+      fuseCode(true), objectBase(0)
+    { }
+    void buildTables();
+    std::uint32_t buildObjectIndex(std::uint32_t firstItem);
+    bool findMapEntry(std::uint32_t address, std::uint32_t key, std::uint32_t &entry) const;
+    const ObjectProperties* findObject(std::uint32_t objRef) const {
+        const int slot = findObjectSlot(objRef);
+        if (slot < 0) return nullptr;
+        return &objectProperties[slot];
+    }
+
+    // objects are at least this many bytes long, so no two share a bucket
+    static const std::uint32_t objectSpacing = 3;
+
+    const std::uint8_t *data;
+    size_t dataSize;
+    bool isMapped;
+    bool sortedMaps;
+    bool fuseCode;
+
+    std::vector<SkillDef> skillDefs;
+    std::vector<DamageType> damageTypes;
+    // storage keys given global variable slots by the assembler, in slot
+    // (and so ascending key) order
+    std::vector<std::uint32_t> globalKeys;
+
+    std::vector<std::uint32_t> objectList;
+    std::vector<ObjectProperties> objectProperties;
+    std::uint32_t objectBase;
+    std::vector<std::uint32_t> objectSlots; // 1 + index into objectList
+    std::vector<std::string> objectNames;   // by slot; empty if not cached
+    std::vector<int> objectNameOrder;       // by slot
+
+    // every node, decoded at load time and never changed afterwards, so
+    // looking one up needs no lock
+    std::unordered_map<std::uint32_t, std::unique_ptr<DecodedCode> > nodeCode;
+    // anything else run as code (a jump into another node, or an image with
+    // no tables), filled in lazily
+    mutable std::mutex decodedCodeLock;
+    mutable std::unordered_map<std::uint32_t, std::unique_ptr<DecodedCode> > decodedCode;
+    void decodeNodes(std::uint32_t firstNode);
+    std::unique_ptr<DecodedCode> decodeBlock(std::uint32_t address) const;
+    static void fuseInstructions(DecodedCode &block);
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef ITEMLIST_H
+#define ITEMLIST_H
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "playerror.h"
+
+class CarriedItem {
+public:
+    CarriedItem()
+    : qty(0), itemIdent(0)
+    { }
+    CarriedItem(int qty, int itemIdent)
+    : qty(qty), itemIdent(itemIdent)
+    { }
+
+    int qty;
+    std::uint32_t itemIdent;
+};
+
+// The party's inventory: carried items in name order. The order comes from a
+// collation key the caller works out once per item (see
+// GameImage::getNameOrder), so keeping the list in order never compares
+// names; items with equal keys stay in the order they were added. Within the
+// list each key is paired with a tie-breaker that grows as items are added,
+// which makes every item's full key distinct: finding an item is a hash
+// lookup of its full key and a binary search, O(log n) even among the many
+// items that share a key (as every unnamed item does), and adding or removing
+// one only moves the entries after it.
+class ItemList {
+public:
+    typedef std::vector<CarriedItem>::const_iterator const_iterator;
+
+    ItemList()
+    : nextTie(0)
+    { }
+
+    size_t size() const {
+        return items.size();
+    }
+    bool empty() const {
+        return items.empty();
+    }
+    const CarriedItem& operator[](size_t index) const {
+        return items[index];
+    }
+    const_iterator begin() const {
+        return items.begin();
+    }
+    const_iterator end() const {
+        return items.end();
+    }
+
+    // Returns the position of itemIdent, or -1 if it is not carried.
+    int find(std::uint32_t itemIdent) const {
+        auto entry = itemKeys.find(itemIdent);
+        if (entry == itemKeys.end()) {
+            return -1;
+        }
+        return std::lower_bound(keys.begin(), keys.end(), entry->second) - keys.begin();
+    }
+    // Adds an item that is not already carried in key order and returns its
+    // position.
+    unsigned insert(const CarriedItem &item, std::uint32_t key) {
+        if (nextTie == maxTie) {
+            renumber();
+        }
+        const std::uint64_t fullKey = makeKey(key, nextTie++);
+        const unsigned index = std::upper_bound(keys.begin(), keys.end(), fullKey) - keys.begin();
+        place(index, item, fullKey);
+        return index;
+    }
+    // Adds an item at a known position, as when putting back one that was
+    // removed. The position must lie between items with lower and higher
+    // keys, or finding items would stop working.
+    void insertAt(unsigned index, const CarriedItem &item, std::uint32_t key) {
+        if (index > items.size()
+                || (index > 0 && keys[index - 1] >> 32 > key)
+                || (index < keys.size() && keys[index] >> 32 < key)) {
+            throw PlayError("Tried to put an item out of order in the inventory.");
+        }
+        std::uint32_t tie;
+        if (!findTie(index, key, tie)) {
+            renumber();
+            findTie(index, key, tie);
+        }
+        if (tie >= nextTie) {
+            nextTie = tie + 1;
+        }
+        place(index, item, makeKey(key, tie));
+    }
+    void erase(unsigned index) {
+        itemKeys.erase(items[index].itemIdent);
+        items.erase(items.begin() + index);
+        keys.erase(keys.begin() + index);
+    }
+    void setQty(unsigned index, int qty) {
+        items[index].qty = qty;
+    }
+    void clear() {
+        items.clear();
+        keys.clear();
+        itemKeys.clear();
+        nextTie = 0;
+    }
+    void swap(ItemList &other) {
+        items.swap(other.items);
+        keys.swap(other.keys);
+        itemKeys.swap(other.itemKeys);
+        std::swap(nextTie, other.nextTie);
+    }
+private:
+    static const std::uint32_t maxTie = 0xFFFFFFFF;
+
+    static std::uint64_t makeKey(std::uint32_t key, std::uint32_t tie) {
+        return static_cast<std::uint64_t>(key) << 32 | tie;
+    }
+    void place(unsigned index, const CarriedItem &item, std::uint64_t fullKey) {
+        items.insert(items.begin() + index, item);
+        keys.insert(keys.begin() + index, fullKey);
+        itemKeys[item.itemIdent] = fullKey;
+    }
+    // Finds a tie-breaker that puts key between the entries either side of
+    // index; fails if the neighbours sharing the key leave no room.
+    bool findTie(unsigned index, std::uint32_t key, std::uint32_t &tie) const {
+        std::uint64_t low = 0, high = static_cast<std::uint64_t>(maxTie) + 1;
+        if (index > 0 && keys[index - 1] >> 32 == key) {
+            low = (keys[index - 1] & maxTie) + 1;
+        }
+        if (index < keys.size() && keys[index] >> 32 == key) {
+            high = keys[index] & maxTie;
+        }
+        if (low >= high || low >= maxTie) {
+            return false;
+        }
+        tie = low;
+        return true;
+    }
+    // Respaces the tie-breakers, keeping the order and leaving room before
+    // and after every entry; only needed after billions of additions or when
+    // putting an item back among others that share its key.
+    void renumber() {
+        for (unsigned i = 0; i < items.size(); ++i) {
+            keys[i] = makeKey(keys[i] >> 32, i * 2 + 1);
+            itemKeys[items[i].itemIdent] = keys[i];
+        }
+        nextTie = items.size() * 2 + 1;
+    }
+
+    std::vector<CarriedItem> items;
+    std::vector<std::uint64_t> keys;    // in step with items: key and tie
+    std::unordered_map<std::uint32_t, std::uint64_t> itemKeys;
+    std::uint32_t nextTie;
+};
+
+#endif
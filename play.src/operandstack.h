@@ -0,0 +1,122 @@
+#ifndef OPERANDSTACK_H
+#define OPERANDSTACK_H
+
+#include <cstdint>
+#include <vector>
+
+#include "playerror.h"
+
+// The interpreter's operand stack. Each running node works in its own frame
+// stacked on top of its callers' frames, but every frame lives in the one
+// buffer owned by the Game. The buffer starts with room for initialSize
+// values and only grows (up to maxSize values), so running a node allocates
+// nothing once it is large enough for the game's scripts; allocationCount()
+// reports how often it has had to grow.
+class OperandStack {
+public:
+    static const unsigned defaultMaxSize = 65536;
+    static const unsigned defaultMaxDepth = 256;
+    static const unsigned initialSize = 256;
+
+    OperandStack()
+    : values(initialSize), base(0), top(0), depth(0),
+      maxSize(defaultMaxSize), maxDepth(defaultMaxDepth), allocations(0)
+    { }
+
+    void setLimits(unsigned maxSize, unsigned maxDepth) {
+        this->maxSize = maxSize;
+        this->maxDepth = maxDepth;
+    }
+    std::uint64_t allocationCount() const {
+        return allocations;
+    }
+    unsigned frameDepth() const {
+        return depth;
+    }
+
+    // Starts a new, empty frame; returns the value to pass to popFrame.
+    unsigned pushFrame() {
+        if (depth >= maxDepth) {
+            throw PlayError("maximum node call depth exceeded in VM");
+        }
+        ++depth;
+        unsigned oldBase = base;
+        base = top;
+        return oldBase;
+    }
+    // Discards the current frame along with anything left on it.
+    void popFrame(unsigned oldBase) {
+        --depth;
+        top = base;
+        base = oldBase;
+    }
+
+    void push(std::uint32_t value) {
+        if (top == values.size()) {
+            grow();
+        }
+        values[top++] = value;
+    }
+    std::uint32_t pop() {
+        if (top == base) {
+            throw PlayError("stack underflow in VM");
+        }
+        return values[--top];
+    }
+    std::uint32_t peek(unsigned position = 0) const {
+        if (position >= size()) {
+            throw PlayError("stack index out of bounds in VM");
+        }
+        return values[top - 1 - position];
+    }
+    // Positions count from the bottom of the frame.
+    void swap(unsigned pos1 = 0, unsigned pos2 = 1) {
+        if (pos1 >= size() || pos2 >= size()) {
+            throw PlayError("stack index out of bounds in VM");
+        }
+
+        std::uint32_t value = values[base + pos1];
+        values[base + pos1] = values[base + pos2];
+        values[base + pos2] = value;
+    }
+
+    bool isEmpty() const {
+        return top == base;
+    }
+    unsigned size() const {
+        return top - base;
+    }
+private:
+    void grow() {
+        if (values.size() >= maxSize) {
+            throw PlayError("stack overflow in VM");
+        }
+        unsigned newSize = values.size() * 2;
+        values.resize(newSize < maxSize ? newSize : maxSize);
+        ++allocations;
+    }
+
+    std::vector<std::uint32_t> values;
+    unsigned base, top, depth;
+    unsigned maxSize, maxDepth;
+    std::uint64_t allocations;
+};
+
+// Keeps a node's frame on the stack for as long as it's running, including
+// when it exits with an exception.
+class OperandStackFrame {
+public:
+    OperandStackFrame(OperandStack &stack)
+    : stack(stack), oldBase(stack.pushFrame())
+    { }
+    ~OperandStackFrame() {
+        stack.popFrame(oldBase);
+    }
+    OperandStackFrame(const OperandStackFrame &) = delete;
+    OperandStackFrame& operator=(const OperandStackFrame &) = delete;
+private:
+    OperandStack &stack;
+    unsigned oldBase;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef OUTPUTSINK_H
+#define OUTPUTSINK_H
+
+#include <algorithm>
+#include <cctype>
+#include <string>
+#include <vector>
+
+// How OutputSink::append capitalizes what it is given: not at all, the first
+// letter (as toUpperFirst) or the first letter of each word (as toTitleCase).
+enum TextCase {
+    caseAsIs, caseUpperFirst, caseTitle
+};
+
+// Receives a game's tidied output as it is produced; see OutputSink.
+class OutputConsumer {
+public:
+    virtual ~OutputConsumer() { }
+    // Called when the output is cleared for a new turn.
+    virtual void beginOutput() { }
+    // Called with each piece of output once it is final.
+    virtual void writeOutput(const std::string &text) = 0;
+};
+
+// Collects game output, tidying it as it arrives. The result always equals
+// trim(tidyString(...)) of everything appended since the last clear, so it
+// can be handed out as is. Whitespace at the end is held back until more
+// text follows it (and dropped if none does); everything else is passed on
+// to the consumers as soon as it is appended.
+class OutputSink {
+public:
+    void clear() {
+        text.clear();
+        pending.clear();
+        for (OutputConsumer *consumer : consumers) {
+            consumer->beginOutput();
+        }
+    }
+    void append(const char *data, size_t length, TextCase textCase = caseAsIs) {
+        const size_t oldSize = text.size();
+        for (size_t i = 0; i < length; ++i) {
+            if (textCase != caseAsIs && (i == 0 || (textCase == caseTitle
+                    && isspace(static_cast<unsigned char>(data[i - 1]))))) {
+                put(toupper(data[i]));
+            } else {
+                put(data[i]);
+            }
+        }
+        if (text.size() != oldSize && !consumers.empty()) {
+            const std::string added = text.substr(oldSize);
+            for (OutputConsumer *consumer : consumers) {
+                consumer->writeOutput(added);
+            }
+        }
+    }
+    void append(const std::string &data) {
+        append(data.data(), data.size());
+    }
+
+    const std::string& str() const {
+        return text;
+    }
+    // The output along with any held back whitespace; appending this to a
+    // cleared sink puts it back in the same state.
+    std::string rawText() const {
+        return text + pending;
+    }
+    // Replaces the output without telling the consumers.
+    void assign(const std::string &data) {
+        std::vector<OutputConsumer*> saved;
+        saved.swap(consumers);
+        text.clear();
+        pending.clear();
+        append(data);
+        consumers.swap(saved);
+    }
+
+    // Consumers are owned by the caller and must be removed before they are
+    // destroyed.
+    void addConsumer(OutputConsumer *consumer) {
+        consumers.push_back(consumer);
+    }
+    void removeConsumer(OutputConsumer *consumer) {
+        consumers.erase(std::remove(consumers.begin(), consumers.end(), consumer), consumers.end());
+    }
+private:
+    // Follows tidyString's rules: tabs become spaces and carriage returns
+    // newlines, repeated whitespace and whitespace after a newline are
+    // dropped, and a newline replaces the whitespace before it. Whitespace
+    // before any text is dropped too, as trim would remove it.
+    void put(char c) {
+        if (c == '\t') c = ' ';
+        if (c == '\r') c = '\n';
+
+        if (!isspace(static_cast<unsigned char>(c))) {
+            text += pending;
+            pending.clear();
+            text += c;
+            return;
+        }
+        if (text.empty()) {
+            return;
+        }
+        const char prev = pending.empty() ? text.back() : pending.back();
+        if (c == prev || prev == '\n') {
+            return;
+        }
+        if (c == '\n') {
+            pending.clear();
+        }
+        pending += c;
+    }
+
+    // text never starts or ends with whitespace; pending holds the
+    // whitespace that followed it
+    std::string text, pending;
+    std::vector<OutputConsumer*> consumers;
+};
+
+#endif
@@ -3,40 +3,89 @@
 
 #include <array>
 #include <cstdint>
+#include <deque>
+#include <iosfwd>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "constants.h"
+#include "gameimage.h"
+#include "itemlist.h"
+#include "operandstack.h"
+#include "outputsink.h"
+#include "random.h"
+#include "storagetable.h"
 
 #include "playerror.h"
 
-struct SkillDef {
-    unsigned baseSkill;
-    unsigned nameAddress;
-    unsigned flags;
-    unsigned defaultValue;
-    unsigned recoveryRate;
-
-    bool testFlags(unsigned testFor) const {
-        return (flags & testFor) == testFor;
-    }
-};
-
-struct DamageType {
-    unsigned nameAddress;
-};
+class Profiler;
 
 class Game {
 public:
+    // Items equipped by a character as (slot, item) pairs ordered by slot.
+    // Characters rarely have more than a handful of slots, so a flat vector
+    // beats a tree for every operation.
+    class GearList {
+    public:
+        typedef std::pair<std::uint32_t, std::uint32_t> Entry;
+        typedef std::vector<Entry>::const_iterator const_iterator;
+
+        const_iterator begin() const {
+            return entries.begin();
+        }
+        const_iterator end() const {
+            return entries.end();
+        }
+        size_t size() const {
+            return entries.size();
+        }
+        bool empty() const {
+            return entries.empty();
+        }
+        void clear() {
+            entries.clear();
+        }
+
+        bool has(std::uint32_t slot) const;
+        std::uint32_t get(std::uint32_t slot) const;
+        void set(std::uint32_t slot, std::uint32_t item);
+        void remove(std::uint32_t slot);
+    private:
+        std::vector<Entry> entries;
+    };
+
+    // Per-character state. The skill and resistance values live in a fixed
+    // size block carved from the Game's stat arena: skillCount skill
+    // adjustments, skillCount current skill values, skillCount cached
+    // maximum skill values, then one resistance adjustment per damage type.
+    //
+    // The cached maximums and KO flag are only recomputed after something
+    // they depend on changes; see invalidateStats. Building with
+    // GTRPGE_CHECK_STAT_CACHE defined checks every cached read against a full
+    // recomputation.
     struct Character {
         std::uint32_t def;
         std::uint32_t sex, species;
-        std::map<unsigned, int> resistAdj;
-        std::map<unsigned, int> skillAdj;
-        std::map<unsigned, int> skillCur;
-        std::map<std::uint32_t, std::uint32_t> gear;
+        unsigned skillCount;
+        int *stats;     // this character's block in the Game's statArena
+        GearList gear;
+        bool skillMaxValid;
+        bool koValid, koed;
+
+        int& skillAdj(unsigned skillNo) {
+            return stats[skillNo];
+        }
+        int& skillCur(unsigned skillNo) {
+            return stats[skillCount + skillNo];
+        }
+        int& skillMax(unsigned skillNo) {
+            return stats[skillCount * 2 + skillNo];
+        }
+        int& resistAdj(unsigned damageType) {
+            return stats[skillCount * 3 + damageType];
+        }
     };
 
 
@@ -54,31 +103,94 @@ public:
         std::uint32_t extra;
     };
 
-    class CarriedItem {
-    public:
-        CarriedItem()
-        : qty(0), itemIdent(0)
-        { }
-        CarriedItem(int qty, int itemIdent)
-        : qty(qty), itemIdent(itemIdent)
-        { }
+    // Counts kept by the interpreter loop while a profiler is attached; with
+    // superinstructions a dispatch may cover several instructions.
+    struct DispatchStats {
+        std::uint64_t dispatches;
+        std::uint64_t instructions;
+    };
 
-        int qty;
-        std::uint32_t itemIdent;
+    // Totals for the current (or most recent) fight; damage is the amount
+    // actually lost by the targets of each side's attacks.
+    struct CombatStats {
+        unsigned rounds;
+        std::uint64_t damageByAllies;
+        std::uint64_t damageByEnemies;
     };
 
     Game()
-    : gameStarted(false), locationName(0), isRunning(false), data(nullptr),
-      gameTime(0), inCombat(false), startedCombat(false)
+    : gameStarted(false), currentCombatant(0), combatRound(0),
+      locationName(0), isRunning(false), tempRegisters(storageTempCount),
+      tempBase(0), location(0), inLocation(false), newLocation(false),
+      statBlockSize(0), gameTime(0), inCombat(false), startedCombat(false),
+      afterCombatNode(0), alliesUseAi(false),
+      combatRoundLimit(0), combatStats{0, 0, 0}, dispatchStats{0, 0},
+      profiler(nullptr), hasFixedSeed(false), randomSeed(0),
+      undoMaxTurns(0), undoMaxBytes(0), undoBytes(0)
     { }
-    ~Game() {
-        delete[] data;
-    }
+    Game(const Game &) = delete;
+    Game& operator=(const Game &) = delete;
 
     // ////////////////////////////////////////////////////////////////////////
     // Game Engine Startup                                                   //
     void loadDataFromFile(const std::string &filename);
-    void setDataAs(uint8_t *data, size_t size);
+    void startWithImage(std::shared_ptr<const GameImage> image);
+    void useImage(std::shared_ptr<const GameImage> image);
+    void setDataAs(const uint8_t *data, size_t size);
+    const std::shared_ptr<const GameImage>& getImage() const {
+        return image;
+    }
+    // Deterministic mode: once a seed is set, starting (or restarting) the
+    // game seeds the random generator with it rather than from the clock,
+    // so the same choices always produce the same game.
+    void setRandomSeed(std::uint64_t seed) {
+        hasFixedSeed = true;
+        randomSeed = seed;
+        rng.seed(seed);
+    }
+    RandomGenerator& getRandom() {
+        return rng;
+    }
+    const DispatchStats& getDispatchStats() const {
+        return dispatchStats;
+    }
+    // The profiler (if any) is owned by the caller and must outlive its use.
+    void setProfiler(Profiler *profiler) {
+        this->profiler = profiler;
+    }
+    Profiler* getProfiler() const {
+        return profiler;
+    }
+    // Limits the operand stack to maxSize values in all and node calls to
+    // maxDepth levels of nesting.
+    void setStackLimits(unsigned maxSize, unsigned maxDepth) {
+        operandStack.setLimits(maxSize, maxDepth);
+    }
+
+    // ////////////////////////////////////////////////////////////////////////
+    // Saving and restoring                                                  //
+    // A snapshot holds all of the game's mutable state and can only be
+    // restored into a game using an image with the same build number.
+    // Restoring replaces the current state outright without running the
+    // game setup again, so a game only given an image by useImage can be
+    // restored into. Take snapshots between turns, not from inside a node.
+    void saveState(std::ostream &out) const;
+    void restoreState(std::istream &in);
+
+    // ////////////////////////////////////////////////////////////////////////
+    // Undo history                                                          //
+    // Once a limit is set, each player action (doOption, useItem, equipItem,
+    // unequipItem and doAction) keeps a journal of just what it changes, so
+    // actions can be taken back one at a time, most recent first. The oldest
+    // actions are forgotten once there are more than maxTurns of them or
+    // they take more than maxBytes; a maxTurns of zero turns undo off.
+    // Restoring a snapshot forgets the whole history.
+    void setUndoLimit(unsigned maxTurns, size_t maxBytes);
+    unsigned undoDepth() const {
+        return undoHistory.size();
+    }
+    size_t undoMemoryUsed() const;
+    bool undo();
 
     // ////////////////////////////////////////////////////////////////////////
     // Fetching game data                                                    //
@@ -90,11 +202,20 @@ public:
     // ////////////////////////////////////////////////////////////////////////
     // Fetching game state                                                   //
     std::string getTimeString(bool exact = false);
-    std::string getOutput() const;
+    const std::string& getOutput() const;
+    // Consumers see the output as it is produced, a piece at a time (say,
+    // to stream it to a client); they are owned by the caller.
+    void addOutputConsumer(OutputConsumer *consumer) {
+        output.addConsumer(consumer);
+    }
+    void removeOutputConsumer(OutputConsumer *consumer) {
+        output.removeConsumer(consumer);
+    }
 
     std::uint32_t getObjectProperty(std::uint32_t objRef, std::uint16_t propId);
     bool objectHasProperty(std::uint32_t objRef, std::uint16_t propId);
     std::string getNameOf(std::uint32_t address);
+    void appendNameOf(std::string &text, std::uint32_t address);
     std::string getPronoun(std::uint32_t cRef, int pronounType);
 
     Character* getCharacter(std::uint32_t address);
@@ -104,6 +225,9 @@ public:
     int skillRecoveryRate(int skillNo);
     int getSkillMax(std::uint32_t cRef, int skillNo);
     int getSkillCur(std::uint32_t cRef, int skillNo);
+    // Recomputes cRef's skill maximums and KO status and reports whether the
+    // cached values matched; for tests.
+    bool statCacheCurrent(std::uint32_t cRef);
     void adjResistance(std::uint32_t cRef, int damageType, int amount);
     int getResistance(std::uint32_t cRef, int damageType);
     std::vector<std::uint32_t> getActions(std::uint32_t cRef);
@@ -123,13 +247,27 @@ public:
     void unequipItem(std::uint32_t whoIdent, std::uint32_t slotIdent);
     void doAction(std::uint32_t cRef, std::uint32_t action);
 
+    // ////////////////////////////////////////////////////////////////////////
+    // Headless combat                                                       //
+    // With alliesUseAi set, allies that have an ai node act on their own as
+    // enemies do instead of waiting for an option to be chosen. Fights still
+    // going after roundLimit rounds (if not zero) end in a draw.
+    void setAutoCombat(bool alliesUseAi, unsigned roundLimit) {
+        this->alliesUseAi = alliesUseAi;
+        combatRoundLimit = roundLimit;
+    }
+    void startCombat(const std::vector<std::uint32_t> &allies, const std::vector<std::uint32_t> &enemies);
+    const CombatStats& getCombatStats() const {
+        return combatStats;
+    }
+
 
     // ////////////////////////////////////////////////////////////////////////
     // Public game state data                                                //
     bool gameStarted;
     unsigned currentCombatant, combatRound;
     std::vector<Option> options;
-    std::vector<CarriedItem> inventory;
+    ItemList inventory;
     std::uint32_t locationName;
     std::vector<std::uint32_t> party;
     std::vector<std::uint32_t> combatants;
@@ -137,7 +275,7 @@ private:
     // ////////////////////////////////////////////////////////////////////////
     // Miscellaneous                                                         //
     void doGameSetup();
-    static int roll(int dice, int sides);
+    int roll(int dice, int sides);
 
     // ////////////////////////////////////////////////////////////////////////
     // Raw Data Management                                                   //
@@ -149,16 +287,28 @@ private:
 
     // ////////////////////////////////////////////////////////////////////////
     // Character Management                                                  //
+    int findCharacterIndex(std::uint32_t cRef) const;
+    Character* findCharacter(std::uint32_t cRef);
+    const Character* findCharacter(std::uint32_t cRef) const;
+    Character& addCharacter();
+    void pointStatsAtArena();
     void resetCharacter(std::uint32_t cRef);
     void restoreCharacter(std::uint32_t cRef);
     void doDamage(std::uint32_t cRef, int amount, int to, int type);
     int doSkillCheck(std::uint32_t cRef, int skill, int modifiers, int target);
     void adjSkillMax(std::uint32_t cRef, int skillNo, int adjustment);
     void adjSkillCur(std::uint32_t cRef, int skillNo, int adjustment);
+    void invalidateStats(Character *c);
+    int calcSkillMax(Character *c, int skillNo);
+    bool calcKOed(std::uint32_t cRef);
 
     // ////////////////////////////////////////////////////////////////////////
     // combat methods                                                        //
+    void resetCombat(std::uint32_t afterNode);
+    void addToCombat(std::uint32_t cRef);
+    bool actsOnOwn(std::uint32_t cRef);
     void doCombatLoop();
+    void endCombat();
     void advanceCombatant();
     void doCombatOptions();
 
@@ -172,7 +322,10 @@ private:
     // Output manipulation                                                   //
     void clearOutput();
     void say(const std::string &text);
+    void say(const char *text, TextCase textCase = caseAsIs);
     void say(int number);
+    void sayNameOf(std::uint32_t address, TextCase textCase = caseAsIs);
+    const char* pronounOf(std::uint32_t cRef, int pronounType);
     void sayError(const std::string &errorMessage);
 
     // ////////////////////////////////////////////////////////////////////////
@@ -180,30 +333,121 @@ private:
     bool addItems(int qty, std::uint32_t itemIdent);
     bool removeItems(int qty, std::uint32_t itemIdent);
     int itemQty(std::uint32_t itemIdent);
+    std::uint32_t itemSortKey(std::uint32_t itemIdent) const;
+
+    // ////////////////////////////////////////////////////////////////////////
+    // undo journal                                                          //
+    // The parts of the game state that are small enough to keep whole for
+    // every turn (packed as in a snapshot); storage, characters and
+    // inventory are journaled change by change instead.
+    struct TurnState {
+        bool gameStarted, isRunning, inLocation, newLocation;
+        bool inCombat, startedCombat;
+        std::uint32_t location, locationName, afterCombatNode;
+        unsigned gameTime, currentCombatant, combatRound;
+        std::vector<Option> options;
+        std::vector<std::uint32_t> party, combatants;
+        std::vector<std::uint32_t> temps;
+        std::string output;
+        RandomGenerator rng;
+    };
+    // A single change: which kind of thing changed, which one (target and
+    // field) and what it held before. Characters are identified by their
+    // index in the character pool.
+    struct JournalEntry {
+        enum Kind {
+            Storage,        // target: key
+            Global,         // target: slot
+            Inventory,      // target: item; field: 1 + its index if it was carried
+            Stat,           // target: character; field: index into stats
+            Gear,           // target: character; field: slot
+            Sex,            // target: character
+            Species,        // target: character
+            NewCharacter,   // target: character
+            ResetCharacter  // target: character; field: index into records
+        };
+        Kind kind;
+        std::uint32_t target, field, oldValue;
+    };
+    struct UndoTurn {
+        std::string state;
+        std::vector<JournalEntry> entries;
+        // characters as they were before resetCharacter replaced them, with
+        // their stat blocks copied to recordStats (statBlockSize each)
+        std::vector<Character> records;
+        std::vector<int> recordStats;
+        // memory used, or zero until the turn is compacted
+        size_t bytes;
+    };
+
+    void writeTurnState(std::ostream &out) const;
+    void readTurnState(std::istream &in, TurnState &state) const;
+    void applyTurnState(TurnState &state);
+    bool journaling() const {
+        return !undoHistory.empty();
+    }
+    void journal(JournalEntry::Kind kind, std::uint32_t target, std::uint32_t field, std::uint32_t oldValue) {
+        undoHistory.back().entries.push_back(JournalEntry{kind, target, field, oldValue});
+    }
+    void journalStat(const Character *c, unsigned statIndex);
+    void journalGear(const Character *c, std::uint32_t slot);
+    void journalIdentity(const Character *c, JournalEntry::Kind kind);
+    unsigned poolIndexOf(const Character *c) const;
+    void beginTurn();
+    void compactTurn(UndoTurn &turn);
+    void trimUndoHistory();
+    void undoEntry(const JournalEntry &entry, UndoTurn &turn);
 
     // ////////////////////////////////////////////////////////////////////////
     // stack and stored data management                                      //
+    static bool isTempKey(std::uint32_t key) {
+        return key > storageFirstTemp - storageTempCount;
+    }
     uint32_t fetch(uint32_t key) const;
+    void store(std::uint32_t key, std::uint32_t value);
+    std::uint32_t fetchGlobal(unsigned slot) const;
+    void storeGlobal(unsigned slot, std::uint32_t value);
     void setTemp(unsigned tempNo, std::uint32_t value);
 
 
     // ////////////////////////////////////////////////////////////////////////
     // Private data storage                                                  //
     bool isRunning;
-    std::map<std::uint32_t, std::uint32_t> storage;
+    // keys the assembler gave a slot (see GameImage::findGlobal) live in
+    // globals, everything else in storage
+    std::vector<std::uint32_t> globals;
+    StorageTable storage;
+    // the temps (_0 to _9) of every running node call, storageTempCount per
+    // call; the current call's start at tempBase
+    std::vector<std::uint32_t> tempRegisters;
+    unsigned tempBase;
     std::uint32_t location;
     bool inLocation;
     bool newLocation;
-    uint8_t *data;
-    size_t dataSize;
-    std::map<std::uint32_t, Character*> characters;
-    std::string outputBuffer;
+    std::shared_ptr<const GameImage> image;
+    // characters are pooled and only freed by undo, so pointers to them stay
+    // valid; characterSlots maps the image's object slots to 1 + their pool
+    // index. Pool record n's stats are block n of statArena.
+    std::deque<Character> characterPool;
+    std::vector<unsigned> characterSlots;
+    std::vector<int> statArena;
+    unsigned statBlockSize;
+    OutputSink output;
     unsigned gameTime;
     bool inCombat, startedCombat;
     std::uint32_t afterCombatNode;
-
-    std::vector<SkillDef> skillDefs;
-    std::vector<DamageType> damageTypes;
+    bool alliesUseAi;
+    unsigned combatRoundLimit;
+    CombatStats combatStats;
+    DispatchStats dispatchStats;
+    Profiler *profiler;
+    OperandStack operandStack;
+    RandomGenerator rng;
+    bool hasFixedSeed;
+    std::uint64_t randomSeed;
+    std::deque<UndoTurn> undoHistory;
+    unsigned undoMaxTurns;
+    size_t undoMaxBytes, undoBytes;
 };
 
 std::string toTitleCase(std::string text);
@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#include "profiler.h"
+
+struct OpcodeName {
+    std::uint16_t opcode;
+    const char *name;
+};
+
+// matches the command names used by the assembler
+static const OpcodeName opcodeNames[] = {
+    { opEnd,                "end" },
+    { opPush,               "push" },
+    { opPop,                "pop" },
+    { opCallNode,           "call" },
+    { opSetLocation,        "set-location" },
+    { opStartGame,          "start-game" },
+    { opAddTime,            "add-time" },
+    { opAddOption,          "add-option" },
+    { opAddOptionXtra,      "add-option-xtra" },
+    { opAddContinue,        "add-continue" },
+    { opAddReturn,          "add-return" },
+    { opSay,                "say" },
+    { opSayNumber,          "say-number" },
+    { opSayUF,              "say-uf" },
+    { opSayTC,              "say-tc" },
+    { opSayPronoun,         "say-pronoun" },
+    { opSayPronounUF,       "say-pronoun-uf" },
+    { opJump,               "jump" },
+    { opJumpTrue,           "jump-true" },
+    { opJumpFalse,          "jump-false" },
+    { opJumpEq,             "jump-eq" },
+    { opJumpNeq,            "jump-neq" },
+    { opJumpLt,             "jump-lt" },
+    { opJumpLte,            "jump-lte" },
+    { opJumpGt,             "jump-gt" },
+    { opJumpGte,            "jump-gte" },
+    { opStore,              "store" },
+    { opFetch,              "fetch" },
+    { opFetchGlobal,        "fetch-global" },
+    { opStoreGlobal,        "store-global" },
+    { opAddItems,           "add-items" },
+    { opRemoveItems,        "remove-items" },
+    { opItemQty,            "item-qty" },
+    { opListSize,           "list-size" },
+    { opListGet,            "list-get" },
+    { opResetCharacter,     "reset-character" },
+    { opGetSex,             "get-sex" },
+    { opSetSex,             "set-sex" },
+    { opGetSpecies,         "get-species" },
+    { opSetSpecies,         "set-species" },
+    { opGetSkill,           "get-skill" },
+    { opAdjSkill,           "adj-skill" },
+    { opGetSkillCur,        "get-skill-cur" },
+    { opAdjSkillCur,        "adj-skill-cur" },
+    { opSkillCheck,         "skill-check" },
+    { opDoDamage,           "do-damage" },
+    { opAdd,                "add" },
+    { opSubtract,           "subtract" },
+    { opMultiply,           "multiply" },
+    { opDivide,             "divide" },
+    { opModulo,             "modulo" },
+    { opPower,              "power" },
+    { opIncrement,          "increment" },
+    { opDecrement,          "decrement" },
+    { opAddToParty,         "add-to-party" },
+    { opIsInParty,          "is-in-party" },
+    { opRemoveFromParty,    "remove-from-party" },
+    { opResetCombat,        "reset-combat" },
+    { opAddToCombat,        "add-to-combat" },
+    { opCombatant,          "combatant" },
+    { opGetProperty,        "get-property" },
+    { opRandomOfFaction,    "random-of-faction" },
+    { opRandomNotFaction,   "random-not-faction" },
+    { opStackSwap,          "stk-swap" },
+    { opStackDup,           "stk-dup" },
+    { opStackCount,         "stk-count" },
+    { opIsKOed,             "is-koed" },
+    { opHasProperty,        "has-property" },
+    { opPartySize,          "party-size" },
+    { opPartyIsKOed,        "party-is-koed" },
+    { opDoRest,             "do-rest" },
+    { opCombatStatus,       "combat-status" },
+    { opPartyAt,            "party-at" },
+    { opGetEquip,           "get-equip" },
+    { opSetEquip,           "set-equip" },
+    { opRandom,             "random" },
+    { opGetResistance,      "get-resistance" },
+    { opAdjResistance,      "adj-resistance" },
+    { opRandomEvent,        "random-event" },
+
+    { dopTruncated,         "(truncated)" },
+    { dopPushPushAddOption, "push+push+add-option" },
+    { dopPushFetch,         "push+fetch" },
+    { dopPushSay,           "push+say" },
+    { dopPushJump,          "push+jump" },
+    { dopPushJumpTrue,      "push+jump-true" },
+    { dopPushJumpFalse,     "push+jump-false" },
+    { dopPushJumpEq,        "push+jump-eq" },
+    { dopPushJumpNeq,       "push+jump-neq" },
+    { dopPushJumpLt,        "push+jump-lt" },
+    { dopPushJumpLte,       "push+jump-lte" },
+    { dopPushJumpGt,        "push+jump-gt" },
+    { dopPushJumpGte,       "push+jump-gte" },
+};
+
+Profiler::Profiler() {
+    reset();
+}
+
+void Profiler::reset() {
+    for (OpcodeStats &stats : opcodes) {
+        stats.count = 0;
+        stats.ns = 0;
+    }
+    nodes.clear();
+    nodeCalls = 0;
+    firstStackAllocations = lastStackAllocations = 0;
+    intervalOpen = false;
+    lastOpcode = 0;
+    lastNode = 0;
+}
+
+
+/* ************************************************************************* *
+ * SYMBOLS                                                                   *
+ * ************************************************************************* */
+
+// Reads the label listing written by the assembler (dbg_labels.txt); each
+// line after the first is "0x<address>: <name>".
+bool Profiler::loadLabels(const std::string &filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        return false;
+    }
+
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::string::size_type colon = line.find(": ");
+        if (colon == std::string::npos) {
+            continue;
+        }
+        // lines without a hex address are skipped
+        const std::string number = line.substr(0, colon);
+        char *end;
+        const unsigned long address = strtoul(number.c_str(), &end, 16);
+        if (end == number.c_str() || *end != 0 || address > 0xFFFFFFFFUL) {
+            continue;
+        }
+        labels[address] = line.substr(colon + 2);
+    }
+    return true;
+}
+
+std::string Profiler::symbolize(std::uint32_t address) const {
+    auto label = labels.find(address);
+    if (label != labels.end()) {
+        return label->second;
+    }
+
+    std::stringstream ss;
+    ss << "0x" << std::hex << std::setw(8) << std::setfill('0') << address;
+    return ss.str();
+}
+
+std::string Profiler::opcodeName(std::uint16_t opcode) {
+    for (const OpcodeName &entry : opcodeNames) {
+        if (entry.opcode == opcode) {
+            return entry.name;
+        }
+    }
+
+    std::stringstream ss;
+    ss << "0x" << std::hex << std::setw(2) << std::setfill('0') << opcode;
+    return ss.str();
+}
+
+
+/* ************************************************************************* *
+ * COLLECTING DATA                                                           *
+ * ************************************************************************* */
+
+void Profiler::enterNode(std::uint32_t node, std::uint64_t stackAllocations) {
+    closeInterval(Clock::now());
+    ++nodes[node].calls;
+    if (nodeCalls == 0) {
+        firstStackAllocations = stackAllocations;
+    }
+    lastStackAllocations = stackAllocations;
+    ++nodeCalls;
+}
+
+void Profiler::leaveNode() {
+    closeInterval(Clock::now());
+}
+
+
+/* ************************************************************************* *
+ * REPORTS                                                                   *
+ * ************************************************************************* */
+
+// Both reports list opcodes and nodes from most to least time spent.
+static std::vector<std::uint16_t> sortedOpcodes(const Profiler &profiler) {
+    std::vector<std::uint16_t> result;
+    for (std::uint16_t opcode = 0; opcode <= dopLastOpcode; ++opcode) {
+        if (profiler.getOpcodeStats(opcode).count) {
+            result.push_back(opcode);
+        }
+    }
+    std::stable_sort(result.begin(), result.end(),
+        [&profiler](std::uint16_t left, std::uint16_t right) {
+            return profiler.getOpcodeStats(left).ns > profiler.getOpcodeStats(right).ns;
+        });
+    return result;
+}
+
+static std::vector<std::uint32_t> sortedNodes(const Profiler &profiler) {
+    std::vector<std::uint32_t> result;
+    for (const auto &node : profiler.getNodeStats()) {
+        result.push_back(node.first);
+    }
+    const auto &nodes = profiler.getNodeStats();
+    std::sort(result.begin(), result.end(),
+        [&nodes](std::uint32_t left, std::uint32_t right) {
+            const Profiler::NodeStats &l = nodes.at(left), &r = nodes.at(right);
+            return l.ns != r.ns ? l.ns > r.ns : left < right;
+        });
+    return result;
+}
+
+void Profiler::writeReport(std::ostream &out) const {
+    std::uint64_t totalNs = 0, totalCount = 0;
+    for (const OpcodeStats &stats : opcodes) {
+        totalNs += stats.ns;
+        totalCount += stats.count;
+    }
+    const double percentScale = totalNs ? 100.0 / totalNs : 0.0;
+
+    out << "VM PROFILE: " << totalCount << " dispatches, " << totalNs << " ns\n";
+    out << "Operand stack allocations: " << getStackAllocations();
+    out << " in " << nodeCalls << " node calls\n\n";
+    out << std::left << std::setw(24) << "OPCODE" << std::right;
+    out << std::setw(12) << "COUNT" << std::setw(14) << "TOTAL NS";
+    out << std::setw(10) << "NS/EXEC" << std::setw(8) << "%" << '\n';
+    out << std::fixed << std::setprecision(1);
+    for (std::uint16_t opcode : sortedOpcodes(*this)) {
+        const OpcodeStats &stats = opcodes[opcode];
+        out << std::left << std::setw(24) << opcodeName(opcode) << std::right;
+        out << std::setw(12) << stats.count << std::setw(14) << stats.ns;
+        out << std::setw(10) << static_cast<double>(stats.ns) / stats.count;
+        out << std::setw(8) << stats.ns * percentScale << '\n';
+    }
+
+    out << '\n' << std::left << std::setw(60) << "NODE" << std::right;
+    out << std::setw(10) << "CALLS" << std::setw(14) << "INSTRUCTIONS";
+    out << std::setw(14) << "TOTAL NS" << std::setw(8) << "%" << '\n';
+    for (std::uint32_t address : sortedNodes(*this)) {
+        const NodeStats &stats = nodes.at(address);
+        out << std::left << std::setw(60) << symbolize(address) << std::right;
+        out << std::setw(10) << stats.calls << std::setw(14) << stats.instructions;
+        out << std::setw(14) << stats.ns << std::setw(8) << stats.ns * percentScale << '\n';
+    }
+}
+
+void Profiler::writeCSV(std::ostream &out) const {
+    out << "kind,id,name,count,instructions,ns\n";
+    for (std::uint16_t opcode : sortedOpcodes(*this)) {
+        const OpcodeStats &stats = opcodes[opcode];
+        out << "opcode," << opcode << ',' << opcodeName(opcode) << ',';
+        out << stats.count << ',' << stats.count << ',' << stats.ns << '\n';
+    }
+    for (std::uint32_t address : sortedNodes(*this)) {
+        const NodeStats &stats = nodes.at(address);
+        out << "node," << address << ',' << symbolize(address) << ',';
+        out << stats.calls << ',' << stats.instructions << ',' << stats.ns << '\n';
+    }
+}
+
+// Writes the text report to basename.txt and the CSV to basename.csv.
+bool Profiler::dump(const std::string &basename) const {
+    std::ofstream text(basename + ".txt");
+    std::ofstream csv(basename + ".csv");
+    if (!text || !csv) {
+        return false;
+    }
+    writeReport(text);
+    writeCSV(csv);
+    return true;
+}
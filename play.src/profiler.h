@@ -0,0 +1,118 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <unordered_map>
+
+#include "gameimage.h"
+
+// Collects execution counts and time spent per opcode and per node while a
+// Game is running with a profiler attached (see Game::setProfiler). Time is
+// measured between successive instruction dispatches and charged to the
+// instruction that was running, so every figure is self time: a node's total
+// doesn't include the nodes it calls.
+//
+// The profiler also tracks how many times the Game's operand stack had to
+// allocate memory while profiling; it should stay at zero once a game has
+// been running for a while.
+class Profiler {
+public:
+    struct OpcodeStats {
+        std::uint64_t count;
+        std::uint64_t ns;
+    };
+    struct NodeStats {
+        std::uint64_t calls;
+        std::uint64_t instructions;
+        std::uint64_t ns;
+    };
+
+    Profiler();
+
+    bool loadLabels(const std::string &filename);
+    std::string symbolize(std::uint32_t address) const;
+    static std::string opcodeName(std::uint16_t opcode);
+    void reset();
+
+    // called by the interpreter
+    void enterNode(std::uint32_t node, std::uint64_t stackAllocations);
+    void leaveNode();
+    void instruction(std::uint32_t node, std::uint16_t opcode) {
+        const Clock::time_point now = Clock::now();
+        closeInterval(now);
+        ++opcodes[opcode].count;
+        ++nodes[node].instructions;
+        lastOpcode = opcode;
+        lastNode = node;
+        intervalOpen = true;
+        intervalStart = now;
+    }
+
+    // whether time is being charged to an instruction
+    bool isTiming() const {
+        return intervalOpen;
+    }
+    const OpcodeStats& getOpcodeStats(std::uint16_t opcode) const {
+        return opcodes[opcode];
+    }
+    const std::unordered_map<std::uint32_t, NodeStats>& getNodeStats() const {
+        return nodes;
+    }
+    std::uint64_t getNodeCalls() const {
+        return nodeCalls;
+    }
+    std::uint64_t getStackAllocations() const {
+        return nodeCalls ? lastStackAllocations - firstStackAllocations : 0;
+    }
+
+    void writeReport(std::ostream &out) const;
+    void writeCSV(std::ostream &out) const;
+    bool dump(const std::string &basename) const;
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void closeInterval(Clock::time_point now) {
+        if (!intervalOpen) return;
+        std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - intervalStart).count();
+        opcodes[lastOpcode].ns += ns;
+        nodes[lastNode].ns += ns;
+        intervalOpen = false;
+    }
+
+    std::array<OpcodeStats, dopLastOpcode + 1> opcodes;
+    std::unordered_map<std::uint32_t, NodeStats> nodes;
+    std::map<std::uint32_t, std::string> labels;
+    std::uint64_t nodeCalls;
+    std::uint64_t firstStackAllocations, lastStackAllocations;
+
+    bool intervalOpen;
+    Clock::time_point intervalStart;
+    std::uint16_t lastOpcode;
+    std::uint32_t lastNode;
+};
+
+// Tells the profiler (if any) a node is running for as long as this is in
+// scope, so the time being measured stops however the node ends, including
+// by an exception.
+class ProfiledNode {
+public:
+    ProfiledNode(Profiler *profiler, std::uint32_t node, std::uint64_t stackAllocations)
+    : profiler(profiler)
+    {
+        if (profiler) profiler->enterNode(node, stackAllocations);
+    }
+    ~ProfiledNode() {
+        if (profiler) profiler->leaveNode();
+    }
+    ProfiledNode(const ProfiledNode &) = delete;
+    ProfiledNode& operator=(const ProfiledNode &) = delete;
+private:
+    Profiler *profiler;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include <istream>
+#include <ostream>
+
+#include "playerror.h"
+#include "random.h"
+
+// Expands the seed with splitmix64, as recommended by xoshiro's authors; this
+// never produces the all-zero state the generator can't leave.
+void RandomGenerator::seed(std::uint64_t seed) {
+    for (int i = 0; i < 4; i += 2) {
+        seed += 0x9E3779B97F4A7C15ull;
+        std::uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        z ^= z >> 31;
+        state[i] = static_cast<std::uint32_t>(z);
+        state[i + 1] = static_cast<std::uint32_t>(z >> 32);
+    }
+}
+
+// Lemire's multiply and shift method; values in the small biased zone at the
+// bottom of each bucket are rejected and redrawn.
+std::uint32_t RandomGenerator::below(std::uint32_t bound) {
+    if (bound == 0) {
+        return next();
+    }
+    std::uint64_t product = static_cast<std::uint64_t>(next()) * bound;
+    std::uint32_t low = static_cast<std::uint32_t>(product);
+    if (low < bound) {
+        const std::uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            product = static_cast<std::uint64_t>(next()) * bound;
+            low = static_cast<std::uint32_t>(product);
+        }
+    }
+    return product >> 32;
+}
+
+
+/* ************************************************************************* *
+ * SERIALIZATION                                                             *
+ * ************************************************************************* */
+
+void RandomGenerator::write(std::ostream &out) const {
+    for (std::uint32_t word : state) {
+        for (int shift = 0; shift < 32; shift += 8) {
+            out.put(static_cast<char>(word >> shift));
+        }
+    }
+}
+
+void RandomGenerator::read(std::istream &in) {
+    std::uint32_t newState[4];
+    for (std::uint32_t &word : newState) {
+        word = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            const int byte = in.get();
+            if (byte == EOF) {
+                throw PlayError("Unexpected end of random generator state.");
+            }
+            word |= static_cast<std::uint32_t>(byte) << shift;
+        }
+    }
+    if ((newState[0] | newState[1] | newState[2] | newState[3]) == 0) {
+        throw PlayError("Invalid random generator state.");
+    }
+    for (int i = 0; i < 4; ++i) {
+        state[i] = newState[i];
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+#include <iosfwd>
+
+// xoshiro128** pseudo-random number generator. Each Game owns one, so
+// sessions running on different threads never share random state and a
+// session started from a known seed always makes the same choices.
+//
+// Also meets the UniformRandomBitGenerator requirements, so it can be passed
+// to std::shuffle and the <random> distributions.
+class RandomGenerator {
+public:
+    typedef std::uint32_t result_type;
+
+    explicit RandomGenerator(std::uint64_t seed = 0) {
+        this->seed(seed);
+    }
+
+    // Any seed (including zero) gives a usable, distinct state.
+    void seed(std::uint64_t seed);
+
+    std::uint32_t next() {
+        const std::uint32_t result = rotl(state[1] * 5, 7) * 9;
+        const std::uint32_t t = state[1] << 9;
+        state[2] ^= state[0];
+        state[3] ^= state[1];
+        state[1] ^= state[2];
+        state[0] ^= state[3];
+        state[2] ^= t;
+        state[3] = rotl(state[3], 11);
+        return result;
+    }
+    // Returns a value from 0 up to (but not including) bound, without the
+    // bias of next() % bound. A bound of zero means the full 32 bit range.
+    std::uint32_t below(std::uint32_t bound);
+
+    result_type operator()() {
+        return next();
+    }
+    static constexpr result_type min() {
+        return 0;
+    }
+    static constexpr result_type max() {
+        return 0xFFFFFFFF;
+    }
+
+    bool operator==(const RandomGenerator &rhs) const {
+        return state[0] == rhs.state[0] && state[1] == rhs.state[1]
+            && state[2] == rhs.state[2] && state[3] == rhs.state[3];
+    }
+    bool operator!=(const RandomGenerator &rhs) const {
+        return !(*this == rhs);
+    }
+
+    // Save game format: the four state words, little-endian.
+    void write(std::ostream &out) const;
+    void read(std::istream &in);
+private:
+    static std::uint32_t rotl(std::uint32_t value, int bits) {
+        return (value << bits) | (value >> (32 - bits));
+    }
+
+    std::uint32_t state[4];
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+
+#include "../playerror.h"
+#include "json.h"
+
+namespace {
+
+class JsonParser {
+public:
+    JsonParser(const std::string &text)
+    : text(text), pos(0)
+    { }
+
+    void parseObject(JsonObject &object);
+private:
+    void skipSpace() {
+        while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos]))) {
+            ++pos;
+        }
+    }
+    void expect(char c) {
+        skipSpace();
+        if (pos >= text.size() || text[pos] != c) {
+            fail(std::string("expected '") + c + "'");
+        }
+        ++pos;
+    }
+    void fail(const std::string &message) {
+        std::stringstream ss;
+        ss << message << " at position " << pos;
+        throw PlayError(ss.str());
+    }
+
+    std::string parseString();
+    void appendCodepoint(std::string &result, unsigned codepoint);
+    JsonValue parseValue();
+
+    const std::string &text;
+    std::string::size_type pos;
+};
+
+void JsonParser::parseObject(JsonObject &object) {
+    expect('{');
+    skipSpace();
+    if (pos < text.size() && text[pos] == '}') {
+        ++pos;
+    } else {
+        while (true) {
+            skipSpace();
+            std::string key = parseString();
+            expect(':');
+            object[key] = parseValue();
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',') {
+                ++pos;
+                continue;
+            }
+            expect('}');
+            break;
+        }
+    }
+    skipSpace();
+    if (pos != text.size()) {
+        fail("unexpected text after object");
+    }
+}
+
+std::string JsonParser::parseString() {
+    if (pos >= text.size() || text[pos] != '"') {
+        fail("expected string");
+    }
+    ++pos;
+
+    std::string result;
+    while (true) {
+        if (pos >= text.size()) {
+            fail("unterminated string");
+        }
+        char c = text[pos++];
+        if (c == '"') {
+            return result;
+        }
+        if (c != '\\') {
+            result += c;
+            continue;
+        }
+
+        if (pos >= text.size()) {
+            fail("unterminated string");
+        }
+        c = text[pos++];
+        switch(c) {
+            case '"':
+            case '\\':
+            case '/':   result += c;    break;
+            case 'b':   result += '\b'; break;
+            case 'f':   result += '\f'; break;
+            case 'n':   result += '\n'; break;
+            case 'r':   result += '\r'; break;
+            case 't':   result += '\t'; break;
+            case 'u': {
+                if (pos + 4 > text.size()) {
+                    fail("bad unicode escape");
+                }
+                char *end;
+                const std::string digits = text.substr(pos, 4);
+                const unsigned codepoint = strtoul(digits.c_str(), &end, 16);
+                if (*end != 0) {
+                    fail("bad unicode escape");
+                }
+                pos += 4;
+                appendCodepoint(result, codepoint);
+                break; }
+            default:
+                fail("bad escape");
+        }
+    }
+}
+
+// Writes a \u escape as UTF-8; surrogate pairs aren't combined, as nothing
+// in the protocol needs characters outside the basic plane.
+void JsonParser::appendCodepoint(std::string &result, unsigned codepoint) {
+    if (codepoint < 0x80) {
+        result += static_cast<char>(codepoint);
+    } else if (codepoint < 0x800) {
+        result += static_cast<char>(0xC0 | (codepoint >> 6));
+        result += static_cast<char>(0x80 | (codepoint & 0x3F));
+    } else {
+        result += static_cast<char>(0xE0 | (codepoint >> 12));
+        result += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        result += static_cast<char>(0x80 | (codepoint & 0x3F));
+    }
+}
+
+JsonValue JsonParser::parseValue() {
+    skipSpace();
+    JsonValue value;
+    if (pos >= text.size()) {
+        fail("expected value");
+    }
+
+    const char c = text[pos];
+    if (c == '"') {
+        value.type = JsonValue::String;
+        value.text = parseString();
+    } else if (c == '-' || isdigit(static_cast<unsigned char>(c))) {
+        const char *start = text.c_str() + pos;
+        char *end;
+        value.type = JsonValue::Number;
+        value.number = strtod(start, &end);
+        pos += end - start;
+    } else if (text.compare(pos, 4, "true") == 0) {
+        value.type = JsonValue::Boolean;
+        value.boolean = true;
+        pos += 4;
+    } else if (text.compare(pos, 5, "false") == 0) {
+        value.type = JsonValue::Boolean;
+        pos += 5;
+    } else if (text.compare(pos, 4, "null") == 0) {
+        pos += 4;
+    } else {
+        fail("expected string, number, boolean or null");
+    }
+    return value;
+}
+
+}
+
+bool parseJsonObject(const std::string &text, JsonObject &object, std::string &error) {
+    object.clear();
+    try {
+        JsonParser(text).parseObject(object);
+    } catch (PlayError &e) {
+        error = e.what();
+        return false;
+    }
+    return true;
+}
+
+bool getJsonInteger(const JsonObject &object, const std::string &name, std::uint64_t max,
+                    std::uint64_t &value, std::string &error) {
+    auto field = object.find(name);
+    if (field == object.end()) {
+        error = "missing " + name;
+        return false;
+    }
+    // NaN fails every comparison, and infinities are out of range
+    const JsonValue &json = field->second;
+    if (json.type != JsonValue::Number || !(json.number >= 0)
+            || json.number > static_cast<double>(max) || json.number != std::floor(json.number)) {
+        error = "bad " + name;
+        return false;
+    }
+    value = static_cast<std::uint64_t>(json.number);
+    return true;
+}
+
+std::string jsonString(const std::string &text) {
+    std::string result = "\"";
+    for (char c : text) {
+        switch(c) {
+            case '"':   result += "\\\"";   break;
+            case '\\':  result += "\\\\";   break;
+            case '\n':  result += "\\n";    break;
+            case '\r':  result += "\\r";    break;
+            case '\t':  result += "\\t";    break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    static const char hexDigits[] = "0123456789abcdef";
+                    result += "\\u00";
+                    result += hexDigits[(c >> 4) & 0xF];
+                    result += hexDigits[c & 0xF];
+                } else {
+                    result += c;
+                }
+        }
+    }
+    result += '"';
+    return result;
+}
@@ -0,0 +1,40 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+// Just enough JSON for the server protocol: each request is one flat object
+// whose values are strings, numbers, booleans or null.
+class JsonValue {
+public:
+    enum Type {
+        Null, Boolean, Number, String
+    };
+
+    JsonValue()
+    : type(Null), number(0), boolean(false)
+    { }
+
+    Type type;
+    std::string text;
+    double number;
+    bool boolean;
+};
+
+typedef std::map<std::string, JsonValue> JsonObject;
+
+// Parses a single flat JSON object. Returns false and sets error if text is
+// not one, including when a value is an array or nested object.
+bool parseJsonObject(const std::string &text, JsonObject &object, std::string &error);
+
+// Reads a whole number from 0 to max out of object. Returns false and sets
+// error if the field is missing or holds anything else.
+bool getJsonInteger(const JsonObject &object, const std::string &name, std::uint64_t max,
+                    std::uint64_t &value, std::string &error);
+
+// Returns text as a quoted JSON string.
+std::string jsonString(const std::string &text);
+
+#endif
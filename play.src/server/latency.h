@@ -0,0 +1,64 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+
+// Request latency histogram with power of two buckets: bucket n counts
+// requests taking from 2^(n-1) up to 2^n microseconds (bucket 0 is under a
+// microsecond). Safe to record into from any number of threads at once.
+class LatencyHistogram {
+public:
+    static const int bucketCount = 32;
+
+    LatencyHistogram() {
+        for (auto &bucket : buckets) {
+            bucket = 0;
+        }
+        total = 0;
+        maxMicros = 0;
+    }
+
+    void record(std::uint64_t micros) {
+        int bucket = 0;
+        while (bucket < bucketCount - 1 && (static_cast<std::uint64_t>(1) << bucket) <= micros) {
+            ++bucket;
+        }
+        ++buckets[bucket];
+        ++total;
+        std::uint64_t oldMax = maxMicros;
+        while (micros > oldMax && !maxMicros.compare_exchange_weak(oldMax, micros)) {
+        }
+    }
+
+    std::uint64_t count() const {
+        return total;
+    }
+    std::uint64_t bucket(int n) const {
+        return buckets[n];
+    }
+    std::uint64_t max() const {
+        return maxMicros;
+    }
+    // The upper bound of the bucket holding the given fraction (0 to 1) of
+    // requests (or the slowest request, if that is less), in microseconds;
+    // zero if nothing has been recorded.
+    std::uint64_t percentile(double fraction) const {
+        const std::uint64_t wanted = fraction * total;
+        std::uint64_t seen = 0;
+        for (int i = 0; i < bucketCount; ++i) {
+            seen += buckets[i];
+            if (seen > wanted || (seen == total && seen)) {
+                return std::min(static_cast<std::uint64_t>(1) << i, max());
+            }
+        }
+        return 0;
+    }
+private:
+    std::atomic<std::uint64_t> buckets[bucketCount];
+    std::atomic<std::uint64_t> total;
+    std::atomic<std::uint64_t> maxMicros;
+};
+
+#endif
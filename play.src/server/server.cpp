@@ -0,0 +1,594 @@
+// Headless game server. Hosts any number of game sessions in one process on
+// a single shared game image and talks to clients (such as a web front end)
+// over a local TCP or Unix socket using line-delimited JSON.
+//
+// USAGE: server [--port N | --socket PATH] [--workers N] [game-file]
+// (the game file defaults to game.bin)
+//
+// Each request is one JSON object on one line; each gets a one line reply
+// echoing its "id" (if any). Commands ("cmd"):
+//   new                     starts a session; optional "seed", and "undo"
+//                           to keep that many turns of undo history
+//   state                   current output and options of "session"
+//   option   "option"       choose an option (as Game::doOption)
+//   use      "item"         use an inventory item (Game::useItem)
+//   equip    "who" "item"   equip an inventory item (Game::equipItem)
+//   unequip  "who" "slot"   remove an equipped item (Game::unequipItem)
+//   action   "who" "action" use an ability outside combat (Game::doAction)
+//   undo                    takes back the last turn (Game::undo)
+//   close                   ends "session"
+//   stats                   request counts and latency histograms
+// Game replies carry "session", "output", "options" and "inCombat";
+// failures carry "ok": false and an "error" message. Game commands given
+// "stream": true also send the output as it's produced, as lines carrying
+// "session" and a "chunk" of output, ahead of the reply.
+//
+// Sessions are spread over a fixed pool of worker threads and each session
+// only ever runs on its own worker, so Games are never shared between
+// threads and need no locking. Connections each get a thread that only
+// parses requests and writes replies.
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../play.h"
+#include "json.h"
+#include "latency.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// limits on each session's undo history
+static const unsigned maxUndoTurns = 1000;
+static const size_t maxUndoBytes = 256 * 1024;
+// longest request line accepted; a connection sending more without a line
+// break is dropped
+static const size_t maxRequestBytes = 64 * 1024;
+
+enum Command {
+    cmdNew, cmdState, cmdOption, cmdUse, cmdEquip, cmdUnequip, cmdAction,
+    cmdUndo, cmdClose, cmdStats, commandCount
+};
+
+static const char *commandNames[commandCount] = {
+    "new", "state", "option", "use", "equip", "unequip", "action", "undo",
+    "close", "stats"
+};
+
+class Connection {
+public:
+    Connection(int fd)
+    : fd(fd)
+    { }
+    ~Connection() {
+        close(fd);
+    }
+    Connection(const Connection &) = delete;
+    Connection& operator=(const Connection &) = delete;
+
+    // Writes one reply line; replies for different sessions may be sent from
+    // different workers at the same time.
+    void send(const std::string &line) {
+        std::lock_guard<std::mutex> lock(writeLock);
+        std::string data = line + '\n';
+        const char *pos = data.c_str();
+        size_t left = data.size();
+        while (left > 0) {
+            ssize_t sent = ::send(fd, pos, left, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return;
+            }
+            pos += sent;
+            left -= sent;
+        }
+    }
+
+    const int fd;
+private:
+    std::mutex writeLock;
+};
+
+struct Request {
+    Command command;
+    JsonObject fields;
+    std::uint64_t session;
+    std::shared_ptr<Connection> connection;
+    Clock::time_point received;
+};
+
+
+/* ************************************************************************* *
+ * REPLIES                                                                   *
+ * ************************************************************************* */
+
+static std::string jsonNumber(double number) {
+    std::stringstream ss;
+    if (number == static_cast<double>(static_cast<long long>(number))) {
+        ss << static_cast<long long>(number);
+    } else {
+        ss << number;
+    }
+    return ss.str();
+}
+
+// Starts a reply object with the request's id; the caller adds the rest of
+// the fields and the closing brace.
+static std::string beginReply(const JsonObject &fields, bool ok) {
+    std::string reply = "{";
+    auto id = fields.find("id");
+    if (id != fields.end()) {
+        if (id->second.type == JsonValue::String) {
+            reply += "\"id\":" + jsonString(id->second.text) + ",";
+        } else if (id->second.type == JsonValue::Number) {
+            reply += "\"id\":" + jsonNumber(id->second.number) + ",";
+        }
+    }
+    reply += ok ? "\"ok\":true" : "\"ok\":false";
+    return reply;
+}
+
+static std::string errorReply(const JsonObject &fields, const std::string &error) {
+    return beginReply(fields, false) + ",\"error\":" + jsonString(error) + "}";
+}
+
+// Names options the same way the curses front end does.
+static std::string optionText(Game &game, const Game::Option &option) {
+    if (option.name == optionNameContinue) {
+        return "Continue";
+    } else if (option.name == optionNameCancel) {
+        return "Cancel";
+    } else if (option.name == optionDoNothing) {
+        return "Do nothing";
+    }
+    std::string text;
+    game.appendNameOf(text, option.name);
+    if (!text.empty()) {
+        text[0] = toupper(text[0]);
+    }
+    return text;
+}
+
+static std::string gameReply(const JsonObject &fields, std::uint64_t session, Game &game) {
+    std::string reply = beginReply(fields, true);
+    reply += ",\"session\":" + std::to_string(session);
+    reply += ",\"output\":" + jsonString(game.getOutput());
+    reply += ",\"options\":[";
+    for (unsigned i = 0; i < game.options.size(); ++i) {
+        if (i > 0) reply += ',';
+        reply += jsonString(optionText(game, game.options[i]));
+    }
+    reply += "],\"inCombat\":";
+    reply += game.isInCombat() ? "true" : "false";
+    reply += "}";
+    return reply;
+}
+
+// The largest values request fields may hold: indices into the game's lists
+// must fit an int and object references an address, while session numbers
+// and seeds may use every whole number a double holds exactly.
+static const std::uint64_t maxIndex = INT_MAX;
+static const std::uint64_t maxAddress = UINT32_MAX;
+static const std::uint64_t maxWholeNumber = static_cast<std::uint64_t>(1) << 53;
+
+static bool getFlag(const JsonObject &fields, const std::string &name) {
+    auto field = fields.find(name);
+    return field != fields.end() && field->second.type == JsonValue::Boolean && field->second.boolean;
+}
+
+// Sends a session's output to the client as it's produced for as long as it
+// exists, if the request asked for streaming.
+class OutputStreamer : public OutputConsumer {
+public:
+    OutputStreamer(Game &game, const Request &request)
+    : game(game), request(request), enabled(getFlag(request.fields, "stream"))
+    {
+        if (enabled) {
+            game.addOutputConsumer(this);
+        }
+    }
+    ~OutputStreamer() {
+        if (enabled) {
+            game.removeOutputConsumer(this);
+        }
+    }
+    OutputStreamer(const OutputStreamer &) = delete;
+    OutputStreamer& operator=(const OutputStreamer &) = delete;
+
+    void writeOutput(const std::string &text) override {
+        std::string line = beginReply(request.fields, true);
+        line += ",\"session\":" + std::to_string(request.session);
+        line += ",\"chunk\":" + jsonString(text) + "}";
+        request.connection->send(line);
+    }
+private:
+    Game &game;
+    const Request &request;
+    bool enabled;
+};
+
+
+/* ************************************************************************* *
+ * SESSION WORKERS                                                           *
+ * ************************************************************************* */
+
+class Server;
+
+class SessionWorker {
+public:
+    SessionWorker(Server &server)
+    : server(server), stopping(false), thread(&SessionWorker::run, this)
+    { }
+    // Finishes any requests already queued, then ends the worker's sessions.
+    ~SessionWorker() {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            stopping = true;
+        }
+        ready.notify_one();
+        thread.join();
+    }
+    SessionWorker(const SessionWorker &) = delete;
+    SessionWorker& operator=(const SessionWorker &) = delete;
+
+    void post(Request &&request) {
+        {
+            std::lock_guard<std::mutex> lock(queueLock);
+            queue.push_back(std::move(request));
+        }
+        ready.notify_one();
+    }
+private:
+    void run();
+    std::string handle(Request &request);
+
+    Server &server;
+    std::mutex queueLock;
+    std::condition_variable ready;
+    std::deque<Request> queue;
+    bool stopping;
+    // only touched by this worker's thread
+    std::unordered_map<std::uint64_t, std::unique_ptr<Game> > sessions;
+    std::thread thread;
+};
+
+class Server {
+public:
+    Server(std::shared_ptr<const GameImage> image, unsigned workerCount)
+    : image(image), nextSession(1), sessionCount(0)
+    {
+        for (unsigned i = 0; i < workerCount; ++i) {
+            workers.push_back(std::unique_ptr<SessionWorker>(new SessionWorker(*this)));
+        }
+    }
+
+    void handleLine(const std::shared_ptr<Connection> &connection, const std::string &line);
+    void finished(const Request &request, const std::string &reply) {
+        request.connection->send(reply);
+        const auto elapsed = Clock::now() - request.received;
+        latency[request.command].record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+
+    const std::shared_ptr<const GameImage> image;
+    std::atomic<std::uint64_t> nextSession;
+    std::atomic<std::uint64_t> sessionCount;
+private:
+    std::string statsReply(const JsonObject &fields) const;
+
+    LatencyHistogram latency[commandCount];
+    // declared last so the workers stop before anything they use goes away
+    std::vector<std::unique_ptr<SessionWorker> > workers;
+};
+
+void SessionWorker::run() {
+    while (true) {
+        Request request;
+        {
+            std::unique_lock<std::mutex> lock(queueLock);
+            ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            request = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        std::string reply;
+        try {
+            reply = handle(request);
+        } catch (std::exception &e) {
+            reply = errorReply(request.fields, e.what());
+        }
+        server.finished(request, reply);
+    }
+}
+
+std::string SessionWorker::handle(Request &request) {
+    const JsonObject &fields = request.fields;
+    if (request.command == cmdNew) {
+        std::unique_ptr<Game> game(new Game);
+        std::string error;
+        std::uint64_t seed;
+        if (fields.count("seed")) {
+            if (!getJsonInteger(fields, "seed", maxWholeNumber, seed, error)) {
+                return errorReply(fields, error);
+            }
+            game->setRandomSeed(seed);
+        }
+        std::uint64_t undoTurns;
+        if (fields.count("undo")) {
+            if (!getJsonInteger(fields, "undo", maxIndex, undoTurns, error)) {
+                return errorReply(fields, error);
+            }
+            game->setUndoLimit(std::min<std::uint64_t>(undoTurns, maxUndoTurns), maxUndoBytes);
+        }
+        {
+            OutputStreamer streamer(*game, request);
+            game->startWithImage(server.image);
+        }
+        Game &gameRef = *game;
+        sessions[request.session] = std::move(game);
+        ++server.sessionCount;
+        return gameReply(fields, request.session, gameRef);
+    }
+
+    auto session = sessions.find(request.session);
+    if (session == sessions.end()) {
+        return errorReply(fields, "no such session");
+    }
+    if (request.command == cmdClose) {
+        sessions.erase(session);
+        --server.sessionCount;
+        return beginReply(fields, true) + ",\"session\":" + std::to_string(request.session) + "}";
+    }
+    Game &game = *session->second;
+    OutputStreamer streamer(game, request);
+
+    std::uint64_t a, b;
+    std::string error;
+    switch(request.command) {
+        case cmdState:
+            break;
+        case cmdOption:
+            if (!getJsonInteger(fields, "option", maxIndex, a, error)) {
+                return errorReply(fields, error);
+            }
+            game.doOption(a);
+            break;
+        case cmdUse:
+            if (!getJsonInteger(fields, "item", maxIndex, a, error)) {
+                return errorReply(fields, error);
+            }
+            game.useItem(a);
+            break;
+        case cmdEquip:
+            if (!getJsonInteger(fields, "who", maxAddress, a, error)
+                    || !getJsonInteger(fields, "item", maxIndex, b, error)) {
+                return errorReply(fields, error);
+            }
+            game.equipItem(a, b);
+            break;
+        case cmdUnequip:
+            if (!getJsonInteger(fields, "who", maxAddress, a, error)
+                    || !getJsonInteger(fields, "slot", maxAddress, b, error)) {
+                return errorReply(fields, error);
+            }
+            game.unequipItem(a, b);
+            break;
+        case cmdAction:
+            if (!getJsonInteger(fields, "who", maxAddress, a, error)
+                    || !getJsonInteger(fields, "action", maxAddress, b, error)) {
+                return errorReply(fields, error);
+            }
+            game.doAction(a, b);
+            break;
+        case cmdUndo:
+            if (!game.undo()) {
+                return errorReply(fields, "nothing to undo");
+            }
+            break;
+        default:
+            return errorReply(fields, "unknown command");
+    }
+    return gameReply(fields, request.session, game);
+}
+
+
+/* ************************************************************************* *
+ * DISPATCHING REQUESTS                                                      *
+ * ************************************************************************* */
+
+void Server::handleLine(const std::shared_ptr<Connection> &connection, const std::string &line) {
+    Request request;
+    request.received = Clock::now();
+    request.connection = connection;
+
+    std::string error;
+    if (!parseJsonObject(line, request.fields, error)) {
+        connection->send(errorReply(request.fields, "bad request: " + error));
+        return;
+    }
+
+    auto command = request.fields.find("cmd");
+    if (command == request.fields.end() || command->second.type != JsonValue::String) {
+        connection->send(errorReply(request.fields, "missing cmd"));
+        return;
+    }
+    const char *const *name = std::find(commandNames, commandNames + commandCount, command->second.text);
+    if (name == commandNames + commandCount) {
+        connection->send(errorReply(request.fields, "unknown command " + command->second.text));
+        return;
+    }
+    request.command = static_cast<Command>(name - commandNames);
+
+    if (request.command == cmdStats) {
+        finished(request, statsReply(request.fields));
+        return;
+    }
+    if (request.command == cmdNew) {
+        request.session = nextSession++;
+    } else if (!getJsonInteger(request.fields, "session", maxWholeNumber, request.session, error)) {
+        connection->send(errorReply(request.fields, error));
+        return;
+    }
+    workers[request.session % workers.size()]->post(std::move(request));
+}
+
+std::string Server::statsReply(const JsonObject &fields) const {
+    std::string reply = beginReply(fields, true);
+    reply += ",\"sessions\":" + std::to_string(sessionCount.load());
+    reply += ",\"workers\":" + std::to_string(workers.size());
+    reply += ",\"latency\":{";
+    for (int i = 0; i < commandCount; ++i) {
+        const LatencyHistogram &histogram = latency[i];
+        if (i > 0) reply += ',';
+        reply += jsonString(commandNames[i]) + ":{";
+        reply += "\"count\":" + std::to_string(histogram.count());
+        reply += ",\"p50_us\":" + std::to_string(histogram.percentile(0.5));
+        reply += ",\"p90_us\":" + std::to_string(histogram.percentile(0.9));
+        reply += ",\"p99_us\":" + std::to_string(histogram.percentile(0.99));
+        reply += ",\"max_us\":" + std::to_string(histogram.max());
+        reply += ",\"buckets\":[";
+        for (int j = 0; j < LatencyHistogram::bucketCount; ++j) {
+            if (j > 0) reply += ',';
+            reply += std::to_string(histogram.bucket(j));
+        }
+        reply += "]}";
+    }
+    reply += "}}";
+    return reply;
+}
+
+
+/* ************************************************************************* *
+ * SOCKETS                                                                   *
+ * ************************************************************************* */
+
+static void serveConnection(Server &server, std::shared_ptr<Connection> connection) {
+    std::string buffer;
+    char data[4096];
+    while (true) {
+        ssize_t received = recv(connection->fd, data, sizeof(data), 0);
+        if (received <= 0) {
+            return;
+        }
+        buffer.append(data, received);
+
+        std::string::size_type start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            std::string line = buffer.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (!line.empty()) {
+                server.handleLine(connection, line);
+            }
+            start = end + 1;
+        }
+        buffer.erase(0, start);
+        if (buffer.size() > maxRequestBytes) {
+            connection->send(errorReply(JsonObject(), "request too long"));
+            return;
+        }
+    }
+}
+
+static int openListener(int port, const std::string &socketPath) {
+    int fd;
+    if (!socketPath.empty()) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            throw PlayError("Socket path too long.");
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            throw PlayError("Could not bind to " + socketPath + ".");
+        }
+    } else {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        const int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+            throw PlayError("Could not bind to port " + std::to_string(port) + ".");
+        }
+    }
+    if (listen(fd, 64) < 0) {
+        throw PlayError("Could not listen for connections.");
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 7878;
+    std::string socketPath, gameFile;
+    unsigned workerCount = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (arg == "--workers" && i + 1 < argc) {
+            workerCount = std::max(1, atoi(argv[++i]));
+        } else if (arg[0] != '-' && gameFile.empty()) {
+            gameFile = arg;
+        } else {
+            std::cerr << "USAGE: server [--port N | --socket PATH] [--workers N] [game-file]\n";
+            return 1;
+        }
+    }
+    if (gameFile.empty()) {
+        gameFile = "game.bin";
+    }
+
+    try {
+        Server server(GameImage::loadFromFile(gameFile), workerCount);
+        const int listener = openListener(port, socketPath);
+        std::cerr << "Serving " << gameFile << " on ";
+        if (socketPath.empty()) {
+            std::cerr << "127.0.0.1:" << port;
+        } else {
+            std::cerr << socketPath;
+        }
+        std::cerr << " with " << workerCount << " workers.\n";
+
+        while (true) {
+            const int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) {
+                continue;
+            }
+            std::shared_ptr<Connection> connection(new Connection(fd));
+            std::thread(serveConnection, std::ref(server), connection).detach();
+        }
+    } catch (PlayError &e) {
+        std::cerr << "Server failed: " << e.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,308 @@
+// Headless combat simulator for balance testing. Runs many fights between
+// the same allies and enemies, spread across worker threads that each drive
+// their own Game on one shared image, and writes aggregate results as CSV.
+//
+// USAGE: simulate [options] <game-file>
+//   --allies a,b,...    characters on the player's side (required)
+//   --enemies a,b,...   characters on the opposing side (required)
+//   --fights N          number of fights to run (default 10000)
+//   --threads N         worker threads (default: one per core)
+//   --seed N            base random seed (default 1)
+//   --max-rounds N      fights longer than this are draws (default 100)
+//   --labels FILE       assembler label listing (default dbg_labels.txt)
+//   --no-header         leave out the CSV header line
+//
+// Characters may be given by name (as listed in the labels file) or by
+// address. Allies use their ai node if they have one; otherwise they pick
+// one of their combat actions (and a target, if it needs one) at random.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../play.h"
+
+struct SimulationOptions {
+    std::string gameFile;
+    std::string labelFile = "dbg_labels.txt";
+    std::vector<std::string> allyNames, enemyNames;
+    unsigned fights = 10000;
+    unsigned threads = 0;
+    unsigned maxRounds = 100;
+    std::uint64_t seed = 1;
+    bool header = true;
+};
+
+struct SimulationTotals {
+    unsigned fights = 0;
+    unsigned allyWins = 0, enemyWins = 0, draws = 0;
+    std::uint64_t rounds = 0;
+    std::uint64_t damageByAllies = 0, damageByEnemies = 0;
+
+    void add(const SimulationTotals &other) {
+        fights += other.fights;
+        allyWins += other.allyWins;
+        enemyWins += other.enemyWins;
+        draws += other.draws;
+        rounds += other.rounds;
+        damageByAllies += other.damageByAllies;
+        damageByEnemies += other.damageByEnemies;
+    }
+};
+
+
+/* ************************************************************************* *
+ * COMMAND LINE                                                              *
+ * ************************************************************************* */
+
+static std::vector<std::string> splitList(const std::string &text) {
+    std::vector<std::string> result;
+    std::stringstream ss(text);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            result.push_back(item);
+        }
+    }
+    return result;
+}
+
+static bool parseOptions(int argc, char *argv[], SimulationOptions &options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--allies" && hasValue) {
+            options.allyNames = splitList(argv[++i]);
+        } else if (arg == "--enemies" && hasValue) {
+            options.enemyNames = splitList(argv[++i]);
+        } else if (arg == "--fights" && hasValue) {
+            options.fights = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--threads" && hasValue) {
+            options.threads = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--seed" && hasValue) {
+            options.seed = strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "--max-rounds" && hasValue) {
+            options.maxRounds = strtoul(argv[++i], nullptr, 0);
+        } else if (arg == "--labels" && hasValue) {
+            options.labelFile = argv[++i];
+        } else if (arg == "--no-header") {
+            options.header = false;
+        } else if (arg[0] != '-' && options.gameFile.empty()) {
+            options.gameFile = arg;
+        } else {
+            std::cerr << "Unknown or incomplete option " << arg << ".\n";
+            return false;
+        }
+    }
+
+    if (options.gameFile.empty() || options.allyNames.empty() || options.enemyNames.empty()) {
+        std::cerr << "USAGE: simulate --allies a,b,... --enemies a,b,... [--fights N]\n";
+        std::cerr << "           [--threads N] [--seed N] [--max-rounds N] [--labels FILE]\n";
+        std::cerr << "           [--no-header] <game-file>\n";
+        return false;
+    }
+    if (options.threads == 0) {
+        options.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return true;
+}
+
+// Reads the label listing written by the assembler; each line after the
+// first is "0x<address>: <name>".
+static std::map<std::string, std::uint32_t> loadLabels(const std::string &filename) {
+    std::map<std::string, std::uint32_t> labels;
+    std::ifstream in(filename);
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::string::size_type colon = line.find(": ");
+        if (colon == std::string::npos) {
+            continue;
+        }
+        // lines without a hex address are skipped
+        const std::string number = line.substr(0, colon);
+        char *end;
+        const unsigned long address = strtoul(number.c_str(), &end, 16);
+        if (end == number.c_str() || *end != 0 || address > 0xFFFFFFFFUL) {
+            continue;
+        }
+        labels[line.substr(colon + 2)] = address;
+    }
+    return labels;
+}
+
+// Allies must belong to the player's faction (zero) and enemies to any
+// other, as that is how combat tells the sides apart.
+static std::vector<std::uint32_t> resolveCharacters(const std::vector<std::string> &names,
+                                                    const std::map<std::string, std::uint32_t> &labels,
+                                                    const GameImage &image, bool allies) {
+    std::vector<std::uint32_t> result;
+    for (const std::string &name : names) {
+        std::uint32_t address;
+        auto label = labels.find(name);
+        if (label != labels.end()) {
+            address = label->second;
+        } else {
+            char *end;
+            address = strtoul(name.c_str(), &end, 0);
+            if (*end != 0) {
+                throw PlayError("Unknown character " + name + ".");
+            }
+        }
+        if (image.findObjectSlot(address) < 0) {
+            throw PlayError("Character " + name + " is not an object.");
+        }
+        if ((image.getObjectProperty(address, propFaction) == 0) != allies) {
+            throw PlayError("Character " + name + " is on the wrong side.");
+        }
+        result.push_back(address);
+    }
+    return result;
+}
+
+
+/* ************************************************************************* *
+ * RUNNING FIGHTS                                                            *
+ * ************************************************************************* */
+
+// Chooses for an ally without an ai node: any option other than doing
+// nothing or cancelling target selection if there is one, otherwise
+// whichever of those is offered.
+static int chooseOption(Game &game) {
+    std::vector<int> choices;
+    int fallback = -1;
+    for (unsigned i = 0; i < game.options.size(); ++i) {
+        const std::uint32_t dest = game.options[i].dest;
+        if (dest == 0 || dest == static_cast<std::uint32_t>(optionDoNothing)) {
+            fallback = i;
+        } else {
+            choices.push_back(i);
+        }
+    }
+    if (choices.empty()) {
+        return fallback;
+    }
+    return choices[game.getRandom().below(choices.size())];
+}
+
+// Fight n is seeded with seed + n, so results don't depend on how fights
+// are divided between threads.
+static void runFights(std::shared_ptr<const GameImage> image, const SimulationOptions &options,
+                      const std::vector<std::uint32_t> &allies, const std::vector<std::uint32_t> &enemies,
+                      std::atomic<unsigned> &nextFight, SimulationTotals &totals) {
+    Game game;
+    game.startWithImage(image);
+    game.setAutoCombat(true, options.maxRounds);
+
+    while (true) {
+        const unsigned fight = nextFight++;
+        if (fight >= options.fights) {
+            break;
+        }
+
+        game.getRandom().seed(options.seed + fight);
+        game.startCombat(allies, enemies);
+        while (game.isInCombat()) {
+            const int choice = chooseOption(game);
+            if (choice < 0) {
+                throw PlayError("Ally has no options in combat.");
+            }
+            game.doOption(choice);
+        }
+
+        const Game::CombatStats &stats = game.getCombatStats();
+        ++totals.fights;
+        switch (game.combatStatus()) {
+            case 1:     ++totals.allyWins;  break;
+            case -1:    ++totals.enemyWins; break;
+            default:    ++totals.draws;     break;
+        }
+        totals.rounds += stats.rounds;
+        totals.damageByAllies += stats.damageByAllies;
+        totals.damageByEnemies += stats.damageByEnemies;
+    }
+}
+
+static std::string joinNames(const std::vector<std::string> &names) {
+    std::string result;
+    for (const std::string &name : names) {
+        if (!result.empty()) result += ' ';
+        result += name;
+    }
+    return result;
+}
+
+static void writeCSV(std::ostream &out, const SimulationOptions &options,
+                     const SimulationTotals &totals, double seconds) {
+    if (options.header) {
+        out << "allies,enemies,fights,ally_wins,enemy_wins,draws,ally_win_rate,";
+        out << "avg_rounds,avg_ally_damage,avg_enemy_damage,threads,seconds\n";
+    }
+    const double fights = totals.fights ? totals.fights : 1;
+    out << joinNames(options.allyNames) << ',' << joinNames(options.enemyNames) << ',';
+    out << totals.fights << ',' << totals.allyWins << ',' << totals.enemyWins << ',';
+    out << totals.draws << ',' << std::fixed << std::setprecision(4);
+    out << totals.allyWins / fights << ',' << totals.rounds / fights << ',';
+    out << totals.damageByAllies / fights << ',' << totals.damageByEnemies / fights << ',';
+    out << options.threads << ',' << std::setprecision(3) << seconds << '\n';
+}
+
+int main(int argc, char *argv[]) {
+    SimulationOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        return 1;
+    }
+
+    try {
+        auto image = GameImage::loadFromFile(options.gameFile);
+        const auto labels = loadLabels(options.labelFile);
+        const auto allies = resolveCharacters(options.allyNames, labels, *image, true);
+        const auto enemies = resolveCharacters(options.enemyNames, labels, *image, false);
+
+        std::atomic<unsigned> nextFight(0);
+        std::vector<SimulationTotals> workerTotals(options.threads);
+        std::vector<std::thread> workers;
+        std::mutex errorLock;
+        std::string error;
+
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned i = 0; i < options.threads; ++i) {
+            workers.push_back(std::thread([&, i]() {
+                try {
+                    runFights(image, options, allies, enemies, nextFight, workerTotals[i]);
+                } catch (PlayError &e) {
+                    std::lock_guard<std::mutex> lock(errorLock);
+                    error = e.what();
+                    nextFight = options.fights;
+                }
+            }));
+        }
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (!error.empty()) {
+            throw PlayError(error);
+        }
+
+        SimulationTotals totals;
+        for (const SimulationTotals &worker : workerTotals) {
+            totals.add(worker);
+        }
+        writeCSV(std::cout, options, totals, elapsed.count());
+    } catch (PlayError &e) {
+        std::cerr << "Simulation failed: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
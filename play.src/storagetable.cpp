@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <istream>
+#include <ostream>
+
+#include "playerror.h"
+#include "storagetable.h"
+#include "varint.h"
+
+StorageTable::StorageTable() {
+    clear();
+}
+
+void StorageTable::clear() {
+    slots.assign(initialSize, Slot{0, 0});
+    count = 0;
+    shift = 32;
+    for (size_t size = initialSize; size > 1; size /= 2) {
+        --shift;
+    }
+}
+
+void StorageTable::set(std::uint32_t key, std::uint32_t value) {
+    size_t index = findSlot(key);
+    if (slots[index].value != 0) {
+        if (value) {
+            slots[index].value = value;
+        } else {
+            removeSlot(index);
+        }
+        return;
+    }
+
+    if (value == 0) {
+        return;
+    }
+    // keep the table no more than half full so probe runs stay short
+    if ((count + 1) * 2 > slots.size()) {
+        resize(slots.size() * 2);
+        index = findSlot(key);
+    }
+    slots[index].key = key;
+    slots[index].value = value;
+    ++count;
+}
+
+// Empties a slot, then moves later entries of the same probe run back into
+// the gap so that lookups never need tombstones.
+void StorageTable::removeSlot(size_t index) {
+    const size_t mask = slots.size() - 1;
+    size_t next = index;
+    while (true) {
+        next = (next + 1) & mask;
+        if (slots[next].value == 0) {
+            break;
+        }
+        // an entry may fill the gap only if its home slot doesn't lie
+        // (cyclically) between the gap and its current position
+        size_t home = slotFor(slots[next].key);
+        if (((next - home) & mask) >= ((next - index) & mask)) {
+            slots[index] = slots[next];
+            index = next;
+        }
+    }
+    slots[index] = Slot{0, 0};
+    --count;
+}
+
+void StorageTable::resize(size_t newSize) {
+    std::vector<Slot> oldSlots(newSize, Slot{0, 0});
+    oldSlots.swap(slots);
+    --shift;
+    for (const Slot &slot : oldSlots) {
+        if (slot.value) {
+            slots[findSlot(slot.key)] = slot;
+        }
+    }
+}
+
+std::vector<std::pair<std::uint32_t, std::uint32_t> > StorageTable::entries() const {
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > result;
+    result.reserve(count);
+    for (const Slot &slot : slots) {
+        if (slot.value) {
+            result.push_back(std::make_pair(slot.key, slot.value));
+        }
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+
+/* ************************************************************************* *
+ * SERIALIZATION                                                             *
+ * ************************************************************************* */
+
+void StorageTable::write(std::ostream &out) const {
+    writeVarint(out, count);
+    std::uint32_t lastKey = 0;
+    for (const auto &entry : entries()) {
+        writeVarint(out, entry.first - lastKey);
+        writeVarint(out, entry.second);
+        lastKey = entry.first;
+    }
+}
+
+void StorageTable::read(std::istream &in) {
+    clear();
+    std::uint32_t entryCount = readVarint(in);
+    std::uint32_t key = 0;
+    for (std::uint32_t i = 0; i < entryCount; ++i) {
+        key += readVarint(in);
+        set(key, readVarint(in));
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef STORAGETABLE_H
+#define STORAGETABLE_H
+
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+// Global script storage: a map from 32-bit keys to 32-bit values kept in a
+// flat, open addressed hash table with linear probing. Scripts treat a value
+// of zero as "not set", so a stored zero removes the key and a slot with a
+// zero value is empty; this keeps each slot to just a key and a value.
+class StorageTable {
+public:
+    StorageTable();
+
+    std::uint32_t get(std::uint32_t key) const {
+        return slots[findSlot(key)].value;
+    }
+    void set(std::uint32_t key, std::uint32_t value);
+    void clear();
+    size_t size() const {
+        return count;
+    }
+
+    // Returns the (key, value) pairs in the table ordered by key.
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > entries() const;
+
+    // Save game format: the entry count followed by each entry in key order
+    // as the difference from the previous key and the value, all written as
+    // LEB128 varints. Typical flags take two or three bytes each.
+    void write(std::ostream &out) const;
+    void read(std::istream &in);
+private:
+    struct Slot {
+        std::uint32_t key;
+        std::uint32_t value;
+    };
+
+    size_t slotFor(std::uint32_t key) const {
+        return (key * 0x9E3779B1u) >> shift;
+    }
+    // Returns the slot holding key or, if there isn't one, the empty slot
+    // where it would be inserted.
+    size_t findSlot(std::uint32_t key) const {
+        size_t mask = slots.size() - 1;
+        size_t index = slotFor(key);
+        while (slots[index].value != 0 && slots[index].key != key) {
+            index = (index + 1) & mask;
+        }
+        return index;
+    }
+    void removeSlot(size_t index);
+    void resize(size_t newSize);
+
+    static const size_t initialSize = 64;
+    std::vector<Slot> slots;
+    size_t count;
+    unsigned shift;
+};
+
+#endif
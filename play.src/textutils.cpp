@@ -20,16 +20,14 @@ std::string toUpperFirst(std::string text) {
 }
 
 std::string trim(std::string text) {
-    if (text.empty()) return text;
+    size_t end = text.size();
+    while (end > 0 && isspace(text[end - 1])) --end;
+    text.resize(end);
 
     size_t pos = 0;
-    while (isspace(text[pos])) ++pos;
+    while (pos < end && isspace(text[pos])) ++pos;
     if (pos) text.erase(0, pos);
 
-    pos = text.size() - 1;
-    while (isspace(text[pos])) --pos;
-    if (pos) text.resize(pos + 1);
-
     return text;
 }
 
@@ -83,26 +81,42 @@ std::vector<std::string> wrapString(const std::string &text, unsigned width) {
     return results;
 }
 
-std::string& tidyString(std::string &text) {
-
-    size_t cur = 1;
-
-    while (cur < text.size()) {
-        if (text[cur] == '\t') text[cur] = ' ';
-        if (text[cur] == '\r') text[cur] = '\n';
-        
-        if (isspace(text[cur]) && text[cur] == text[cur - 1]) {
-            text.erase(cur, 1);
-        } else if (text[cur - 1] == '\n' && isspace(text[cur])) {
-            text.erase(cur, 1);
-        } else if (text[cur] == '\n' && isspace(text[cur - 1])) {
-            text.erase(cur - 1, 1);
-            --cur;
-        } else {
-            ++cur;
+// Adds c to the tidied text in out[0, length) and returns the new length.
+// Tabs become spaces and carriage returns newlines; repeats of a whitespace
+// character and whitespace following a newline are dropped, and a newline
+// removes any whitespace before it. Each character is added and removed at
+// most once, so tidying a whole string this way takes linear time.
+static size_t tidyAppend(char *out, size_t length, char c) {
+    if (c == '\t') c = ' ';
+    if (c == '\r') c = '\n';
+
+    const bool space = isspace(static_cast<unsigned char>(c));
+    while (length > 0) {
+        const char prev = out[length - 1];
+        if (space && (c == prev || prev == '\n')) {
+            return length;
         }
+        if (c != '\n' || !isspace(static_cast<unsigned char>(prev))) {
+            break;
+        }
+        --length;
+    }
+    out[length] = c;
+    return length + 1;
+}
+
+// Tidies text in place; the first character is always kept as it is.
+std::string& tidyString(std::string &text) {
+    if (text.empty()) {
+        return text;
     }
 
+    char *data = &text[0];
+    const size_t size = text.size();
+    size_t length = 1;
+    for (size_t pos = 1; pos < size; ++pos) {
+        length = tidyAppend(data, length, data[pos]);
+    }
+    text.resize(length);
     return text;
 }
-
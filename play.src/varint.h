@@ -0,0 +1,48 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+
+#include "playerror.h"
+
+// Helpers for the binary save formats. Numbers are written as LEB128
+// varints (seven bits per byte, low bits first), so the small values that
+// make up most game state take a single byte. Signed values are zigzag
+// encoded first so small negative numbers stay small too.
+
+inline void writeVarint(std::ostream &out, std::uint32_t value) {
+    while (value >= 0x80) {
+        out.put(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.put(static_cast<char>(value));
+}
+
+inline std::uint32_t readVarint(std::istream &in) {
+    std::uint32_t value = 0;
+    for (int bits = 0; bits < 35; bits += 7) {
+        int byte = in.get();
+        if (byte == EOF) {
+            throw PlayError("Unexpected end of saved data.");
+        }
+        value |= static_cast<std::uint32_t>(byte & 0x7F) << bits;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw PlayError("Malformed value in saved data.");
+}
+
+inline void writeSignedVarint(std::ostream &out, int value) {
+    const std::uint32_t bits = static_cast<std::uint32_t>(value);
+    writeVarint(out, (bits << 1) ^ (value < 0 ? 0xFFFFFFFF : 0));
+}
+
+inline int readSignedVarint(std::istream &in) {
+    const std::uint32_t bits = readVarint(in);
+    return static_cast<int>((bits >> 1) ^ (0 - (bits & 1)));
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef WEIGHTEDSAMPLER_H
+#define WEIGHTEDSAMPLER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "playerror.h"
+
+// Picks one of a set of values with probability proportional to its weight.
+// Values are kept with their running (cumulative) weight, so a pick is a
+// binary search for the roll: a roll of r selects the same value as the r-th
+// entry of a deck holding each value weight times in the order they were
+// added, without building that deck.
+class WeightedSampler {
+public:
+    void clear() {
+        entries.clear();
+        total = 0;
+    }
+    // values with a zero or negative weight are never picked
+    void add(std::uint32_t value, int weight) {
+        if (weight <= 0) return;
+        total += weight;
+        entries.push_back(Entry{total, value});
+    }
+    std::uint64_t totalWeight() const {
+        return total;
+    }
+
+    // roll must be less than totalWeight()
+    std::uint32_t pick(std::uint64_t roll) const {
+        auto pos = std::upper_bound(entries.begin(), entries.end(), roll,
+            [](std::uint64_t roll, const Entry &entry) {
+                return roll < entry.cumulative;
+            });
+        if (pos == entries.end()) {
+            throw PlayError("Tried to pick from an empty weighted set");
+        }
+        return pos->value;
+    }
+private:
+    struct Entry {
+        std::uint64_t cumulative;
+        std::uint32_t value;
+    };
+
+    std::vector<Entry> entries;
+    std::uint64_t total = 0;
+};
+
+#endif
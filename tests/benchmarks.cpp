@@ -0,0 +1,533 @@
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../play.src/play.h"
+#include "../play.src/profiler.h"
+#include "../play.src/storagetable.h"
+
+// Keeps the optimizer from discarding benchmark results.
+static volatile std::uint32_t benchmarkSink;
+
+template<class F>
+static void runBenchmark(const std::string &name, unsigned iterations, F func) {
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i) {
+        func();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    std::cout << std::left << std::setw(40) << name;
+    std::cout << std::right << std::setw(12) << std::fixed << std::setprecision(1);
+    std::cout << (ns / iterations) << " ns/iteration\n";
+}
+
+
+/* ************************************************************************* *
+ * OBJECT PROPERTY LOOKUP                                                    *
+ * ************************************************************************* */
+
+static void benchPropertyLookup(const GameImage &image) {
+    const auto &objects = image.getObjectList();
+    const unsigned iterations = 2000;
+    std::cout << "\nProperty lookup (" << objects.size() << " objects x ";
+    std::cout << propCount << " properties per iteration)\n";
+
+    runBenchmark("getObjectProperty (linear scan)", iterations, [&image, &objects]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            for (int propId = 1; propId <= propCount; ++propId) {
+                total += image.scanObjectProperty(objRef, propId);
+            }
+        }
+        benchmarkSink = total;
+    });
+    runBenchmark("getObjectProperty (indexed)", iterations, [&image, &objects]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            for (int propId = 1; propId <= propCount; ++propId) {
+                total += image.getObjectProperty(objRef, propId);
+            }
+        }
+        benchmarkSink = total;
+    });
+    runBenchmark("objectHasProperty (linear scan)", iterations, [&image, &objects]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            for (int propId = 1; propId <= propCount; ++propId) {
+                total += image.scanObjectHasProperty(objRef, propId);
+            }
+        }
+        benchmarkSink = total;
+    });
+    runBenchmark("objectHasProperty (indexed)", iterations, [&image, &objects]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            for (int propId = 1; propId <= propCount; ++propId) {
+                total += image.objectHasProperty(objRef, propId);
+            }
+        }
+        benchmarkSink = total;
+    });
+}
+
+
+/* ************************************************************************* *
+ * INTERPRETER DISPATCH                                                      *
+ * ************************************************************************* */
+
+// Builds a minimal game whose start scene runs a tight countdown loop:
+//      push N
+//  loop:
+//      [push 7 push 1 push callee call pop]    (if withCall)
+//      decrement stk-dup push loop jump-true
+//      end
+//  callee:
+//      push _0 fetch end
+static std::vector<std::uint8_t> makeLoopImage(std::uint32_t loopCount, bool withCall) {
+    std::vector<std::uint8_t> image(headerSize, 0);
+    auto putWord = [&image](std::uint32_t pos, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            image[pos + i] = (value >> (i * 8)) & 0xFF;
+        }
+    };
+    auto appendWord = [&image, &putWord](std::uint32_t value) {
+        image.resize(image.size() + 4);
+        putWord(image.size() - 4, value);
+    };
+    auto appendPush = [&image, &appendWord](std::uint32_t value) {
+        image.push_back(opPush);
+        appendWord(value);
+    };
+    image[0] = 'G'; image[1] = 'R'; image[2] = 'P'; image[3] = 'G';
+
+    putWord(headerSkillTable, image.size());
+    image.push_back(0);         // no skills
+    putWord(headerDamageTypes, image.size());
+    image.push_back(0);         // no damage types
+
+    const std::uint32_t scene = image.size();
+    const std::uint32_t node = scene + 3 + 2 * objPropSize;
+    putWord(headerStartNode, scene);
+    image.push_back(idObject);
+    image.push_back(2);
+    image.push_back(0);
+    const std::uint16_t props[2][2] = { { propClass, pidInteger },
+                                        { propBody, pidReference } };
+    const std::uint32_t values[2] = { ocScene, node };
+    for (int i = 0; i < 2; ++i) {
+        image.push_back(props[i][0] & 0xFF);
+        image.push_back(props[i][0] >> 8);
+        image.push_back(props[i][1] & 0xFF);
+        image.push_back(props[i][1] >> 8);
+        appendWord(values[i]);
+    }
+
+    image.push_back(idNode);
+    appendPush(loopCount);
+    const std::uint32_t loopStart = image.size();
+    std::uint32_t calleeRef = 0;
+    if (withCall) {
+        appendPush(7);
+        appendPush(1);
+        calleeRef = image.size() + 1;
+        appendPush(0);
+        image.push_back(opCallNode);
+        image.push_back(opPop);
+    }
+    image.push_back(opDecrement);
+    image.push_back(opStackDup);
+    appendPush(loopStart);
+    image.push_back(opJumpTrue);
+    image.push_back(opEnd);
+
+    if (withCall) {
+        putWord(calleeRef, image.size());
+        image.push_back(idNode);
+        appendPush(storageFirstTemp);
+        image.push_back(opFetch);
+        image.push_back(opEnd);
+    }
+
+    putWord(headerTitle, image.size());
+    image.push_back(idString);
+    for (char c : std::string("loop")) image.push_back(c);
+    image.push_back(0);
+    putWord(headerVersion, image.size() - 6);
+    putWord(headerByline, image.size() - 6);
+    return image;
+}
+
+// Plays the image's start scene, failing if the interpreter gave up.
+static Game::DispatchStats runLoop(std::shared_ptr<const GameImage> image, Profiler *profiler) {
+    Game game;
+    game.setProfiler(profiler);
+    game.startWithImage(image);
+    const std::string output = game.getOutput();
+    if (output.find("invalid state") != std::string::npos) {
+        throw PlayError(output);
+    }
+    return game.getDispatchStats();
+}
+
+static void benchLoop(const std::string &name, std::uint32_t loopCount, bool withCall, bool fuse) {
+    const unsigned iterations = 10;
+    auto bytes = makeLoopImage(loopCount, withCall);
+    auto image = GameImage::fromMemory(bytes.data(), bytes.size(), fuse);
+
+    // instructions are only counted while profiling, so count them in a run
+    // of their own and time the others without a profiler
+    Profiler profiler;
+    const std::uint64_t instructions = runLoop(image, &profiler).instructions;
+
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i) {
+        runLoop(image, nullptr);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::left << std::setw(40) << name;
+    std::cout << std::right << std::setw(12) << std::fixed << std::setprecision(1);
+    std::cout << (instructions * iterations / seconds / 1e6) << " Mops/second\n";
+}
+
+static void benchDispatch() {
+    std::cout << "\nInterpreter dispatch (";
+#ifdef GTRPGE_THREADED_DISPATCH
+    std::cout << "threaded";
+#else
+    std::cout << "switch";
+#endif
+    std::cout << " build)\n";
+
+    benchLoop("tight loop", 1000000, false, true);
+    benchLoop("tight loop (unfused)", 1000000, false, false);
+    benchLoop("loop calling a node", 200000, true, true);
+    benchLoop("loop calling a node (unfused)", 200000, true, false);
+}
+
+
+/* ************************************************************************* *
+ * SUPERINSTRUCTIONS                                                         *
+ * ************************************************************************* */
+
+// Plays the game by picking options at random and returns the interpreter's
+// counts.
+static Game::DispatchStats countDispatches(std::shared_ptr<const GameImage> image, int steps) {
+    Profiler profiler;
+    Game game;
+    game.setProfiler(&profiler);
+    game.setRandomSeed(1);
+    game.startWithImage(image);
+    RandomGenerator chooser(1);
+    for (int i = 0; i < steps && !game.options.empty(); ++i) {
+        game.doOption(chooser.below(game.options.size()));
+    }
+    return game.getDispatchStats();
+}
+
+// Reports how many dispatches the same random playthrough needs with and
+// without superinstructions.
+static void reportDispatchCounts(const std::string &gamefile) {
+    const int steps = 5000;
+    const Game::DispatchStats fused = countDispatches(GameImage::loadFromFile(gamefile), steps);
+    const Game::DispatchStats unfused = countDispatches(GameImage::loadFromFile(gamefile, false), steps);
+
+    std::cout << "\nDispatch counts (" << steps << " random options)\n";
+    std::cout << std::left << std::setw(40) << "without superinstructions";
+    std::cout << std::right << std::setw(12) << unfused.dispatches << " dispatches\n";
+    std::cout << std::left << std::setw(40) << "with superinstructions";
+    std::cout << std::right << std::setw(12) << fused.dispatches << " dispatches\n";
+    std::cout << std::left << std::setw(40) << "reduction";
+    std::cout << std::right << std::setw(12) << std::fixed << std::setprecision(1);
+    std::cout << (100.0 - 100.0 * fused.dispatches / unfused.dispatches) << " %\n";
+}
+
+
+/* ************************************************************************* *
+ * GLOBAL STORAGE                                                            *
+ * ************************************************************************* */
+
+// Looks up each of several thousand sparse keys (like the label addresses
+// scripts use as flags) in the old std::map storage and in StorageTable.
+static void benchStorage() {
+    const unsigned keyCount = 4000;
+    std::mt19937 rng(1);
+    std::vector<std::uint32_t> keys;
+    std::map<std::uint32_t, std::uint32_t> map;
+    StorageTable table;
+    for (unsigned i = 0; i < keyCount; ++i) {
+        std::uint32_t key = rng() & 0x00FFFFFF;
+        keys.push_back(key);
+        map[key] = 1;
+        table.set(key, 1);
+    }
+
+    std::cout << "\nGlobal storage (" << keyCount << " keys per iteration)\n";
+    runBenchmark("std::map count + find", 500, [&keys, &map]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t key : keys) {
+            if (map.count(key)) {
+                total += map.find(key)->second;
+            }
+        }
+        benchmarkSink = total;
+    });
+    runBenchmark("StorageTable::get", 500, [&keys, &table]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t key : keys) {
+            total += table.get(key);
+        }
+        benchmarkSink = total;
+    });
+}
+
+
+/* ************************************************************************* *
+ * INVENTORY                                                                 *
+ * ************************************************************************* */
+
+// Picks up 1,000 distinct items in random order, as a long looting-heavy
+// game might, then looks each one up; the old inventory re-sorted a vector
+// by comparing names after every new item and searched it linearly.
+static void benchInventory() {
+    const unsigned itemCount = 1000;
+    std::vector<std::string> names;
+    for (unsigned i = 0; i < itemCount; ++i) {
+        std::stringstream ss;
+        ss << "item " << std::setw(4) << std::setfill('0') << ((i * 7919) % itemCount);
+        names.push_back(ss.str());
+    }
+    // collation keys as GameImage::getNameOrder would give them
+    std::vector<unsigned> byName(itemCount);
+    for (unsigned i = 0; i < itemCount; ++i) {
+        byName[i] = i;
+    }
+    std::sort(byName.begin(), byName.end(), [&names](unsigned a, unsigned b) {
+        return names[a] < names[b];
+    });
+    std::vector<std::uint32_t> keys(itemCount);
+    for (unsigned i = 0; i < itemCount; ++i) {
+        keys[byName[i]] = i;
+    }
+    std::vector<std::uint32_t> order(itemCount);
+    for (unsigned i = 0; i < itemCount; ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(3));
+
+    std::cout << "\nInventory (" << itemCount << " distinct items added and found per iteration)\n";
+    runBenchmark("sorted vector (re-sort on add)", 20, [&names, &order]() {
+        std::vector<CarriedItem> inventory;
+        for (std::uint32_t item : order) {
+            inventory.push_back(CarriedItem(1, item));
+            std::sort(inventory.begin(), inventory.end(), [&names](const CarriedItem &a, const CarriedItem &b) {
+                return strcmp(names[a.itemIdent].c_str(), names[b.itemIdent].c_str()) < 0;
+            });
+        }
+        std::uint32_t total = 0;
+        for (std::uint32_t item : order) {
+            for (const CarriedItem &ci : inventory) {
+                if (ci.itemIdent == item) {
+                    total += ci.qty;
+                    break;
+                }
+            }
+        }
+        benchmarkSink = total;
+    });
+    runBenchmark("ItemList", 20, [&keys, &order]() {
+        ItemList inventory;
+        for (std::uint32_t item : order) {
+            inventory.insert(CarriedItem(1, item), keys[item]);
+        }
+        std::uint32_t total = 0;
+        for (std::uint32_t item : order) {
+            total += inventory[inventory.find(item)].qty;
+        }
+        benchmarkSink = total;
+    });
+}
+
+/* ************************************************************************* *
+ * SNAPSHOTS                                                                 *
+ * ************************************************************************* */
+
+// Times saving and restoring the full game state partway through a game,
+// as a server checkpointing after every turn would.
+static void benchSnapshots(std::shared_ptr<const GameImage> image) {
+    Game game;
+    game.setRandomSeed(1);
+    game.startWithImage(image);
+    RandomGenerator chooser(1);
+    for (int i = 0; i < 200 && !game.options.empty(); ++i) {
+        game.doOption(chooser.below(game.options.size()));
+    }
+
+    std::stringstream snapshot;
+    game.saveState(snapshot);
+    const std::string data = snapshot.str();
+    std::cout << "\nSnapshots (" << data.size() << " bytes)\n";
+
+    std::stringstream out;
+    runBenchmark("Game::saveState", 20000, [&game, &out]() {
+        out.str(std::string());
+        game.saveState(out);
+        benchmarkSink = out.tellp();
+    });
+    Game restored;
+    restored.useImage(image);
+    std::stringstream in;
+    runBenchmark("Game::restoreState", 20000, [&restored, &in, &data]() {
+        in.clear();
+        in.str(data);
+        restored.restoreState(in);
+        benchmarkSink = restored.options.size();
+    });
+
+    // a full undo history costs this much in all, against a full snapshot
+    // for every turn
+    const unsigned turns = 100;
+    Game journaled;
+    journaled.setRandomSeed(1);
+    journaled.startWithImage(image);
+    journaled.setUndoLimit(turns, 1 << 24);
+    for (unsigned i = 0; i < turns + 1 && !journaled.options.empty(); ++i) {
+        journaled.doOption(chooser.below(journaled.options.size()));
+    }
+    std::cout << std::left << std::setw(40) << "undo history";
+    std::cout << std::right << std::setw(12) << journaled.undoMemoryUsed();
+    std::cout << " bytes for " << journaled.undoDepth() - 1 << " turns\n";
+    runBenchmark("Game::undo", journaled.undoDepth(), [&journaled]() {
+        journaled.undo();
+    });
+}
+
+
+/* ************************************************************************* *
+ * TEXT TIDYING                                                              *
+ * ************************************************************************* */
+
+// tidyString as it was, erasing one character at a time.
+static std::string& eraseTidyString(std::string &text) {
+    size_t cur = 1;
+    while (cur < text.size()) {
+        if (text[cur] == '\t') text[cur] = ' ';
+        if (text[cur] == '\r') text[cur] = '\n';
+        if (isspace(text[cur]) && text[cur] == text[cur - 1]) {
+            text.erase(cur, 1);
+        } else if (text[cur - 1] == '\n' && isspace(text[cur])) {
+            text.erase(cur, 1);
+        } else if (text[cur] == '\n' && isspace(text[cur - 1])) {
+            text.erase(cur - 1, 1);
+            --cur;
+        } else {
+            ++cur;
+        }
+    }
+    return text;
+}
+
+// Tidies scene output of several kilobytes with the kind of doubled spaces
+// and blank lines that say() calls leave behind.
+static void benchTidyString() {
+    const std::string paragraph = "You are standing  in a   clearing.\n\n  "
+                                  "A path leads north. \n \n\tThe trees  sway. \r\n";
+    std::string text;
+    while (text.size() < 16 * 1024) {
+        text += paragraph;
+    }
+
+    std::cout << "\nTidying output (" << text.size() << " bytes per iteration)\n";
+    runBenchmark("tidyString (erase loop)", 200, [&text]() {
+        std::string copy = text;
+        benchmarkSink = eraseTidyString(copy).size();
+    });
+    runBenchmark("tidyString (single pass)", 200, [&text]() {
+        std::string copy = text;
+        benchmarkSink = tidyString(copy).size();
+    });
+}
+
+
+
+/* ************************************************************************* *
+ * OBJECT NAMES                                                              *
+ * ************************************************************************* */
+
+// getNameOf as it was, composing each name in a stringstream.
+static std::string streamNameOf(const GameImage &image, std::uint32_t objRef) {
+    std::stringstream ss;
+    const std::uint32_t name = image.getObjectProperty(objRef, propName);
+    if (name == 0) {
+        ss << "[ObjectDef@" << std::hex << std::uppercase << objRef << "]";
+    } else {
+        const std::uint32_t article = image.getObjectProperty(objRef, propArticle);
+        if (article) {
+            ss << image.getString(article);
+        }
+        ss << image.getString(name);
+    }
+    return ss.str();
+}
+
+static void benchObjectNames(std::shared_ptr<const GameImage> image) {
+    const auto &objects = image->getObjectList();
+    Game game;
+    game.startWithImage(image);
+
+    std::cout << "\nObject names (" << objects.size() << " objects per iteration)\n";
+    runBenchmark("getNameOf (stringstream)", 2000, [&image, &objects]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            total += toUpperFirst(streamNameOf(*image, objRef)).size();
+        }
+        benchmarkSink = total;
+    });
+    runBenchmark("getNameOf (cached)", 2000, [&game, &objects]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            total += toUpperFirst(game.getNameOf(objRef)).size();
+        }
+        benchmarkSink = total;
+    });
+    std::string text;
+    runBenchmark("appendNameOf (reused buffer)", 2000, [&game, &objects, &text]() {
+        std::uint32_t total = 0;
+        for (std::uint32_t objRef : objects) {
+            text.clear();
+            game.appendNameOf(text, objRef);
+            total += text.size();
+        }
+        benchmarkSink = total;
+    });
+}
+
+int main(int argc, char *argv[]) {
+    const std::string gamefile = argc > 1 ? argv[1] : "game.bin";
+    try {
+        auto image = GameImage::loadFromFile(gamefile);
+        benchPropertyLookup(*image);
+        benchDispatch();
+        reportDispatchCounts(gamefile);
+        benchStorage();
+        benchInventory();
+        benchSnapshots(image);
+        benchTidyString();
+        benchObjectNames(image);
+    } catch (PlayError &e) {
+        std::cerr << "Benchmark failed: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -1,8 +1,116 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <random>
+#include <sstream>
+
 #include "../play.src/play.h"
+#include "../play.src/profiler.h"
+#include "../play.src/random.h"
+#include "../play.src/storagetable.h"
+#include "../play.src/weightedsampler.h"
+#include "../play.src/server/json.h"
+#include "../play.src/server/latency.h"
+
 
+// A copy of game.bin with extra scenes added to the end, for running bytecode
+// the demo game doesn't contain. Objects past the image's object table are
+// found by scanning, so the added scenes work like any other.
+class PatchedGame {
+public:
+    PatchedGame() {
+        std::ifstream in("game.bin", std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    PatchedGame& push(std::uint32_t value) {
+        code.push_back(opPush);
+        putWord(code, value);
+        return *this;
+    }
+    PatchedGame& op(int opcode) {
+        code.push_back(opcode);
+        return *this;
+    }
+    PatchedGame& opGlobal(int opcode, std::uint16_t slot) {
+        code.push_back(opcode);
+        code.push_back(slot & 0xFF);
+        code.push_back(slot >> 8);
+        return *this;
+    }
+    // Ends the code given so far as a node; returns the node's address.
+    std::uint32_t addNode() {
+        const std::uint32_t node = bytes.size();
+        bytes.push_back(idNode);
+        bytes.insert(bytes.end(), code.begin(), code.end());
+        bytes.push_back(opEnd);
+        code.clear();
+        return node;
+    }
+    // Ends the code given so far as the body of a new scene; returns the
+    // scene's address.
+    std::uint32_t addScene() {
+        const std::uint32_t body = addNode();
+        return addObject({ {propClass, ocScene}, {propBody, body} });
+    }
+    std::uint32_t addObject(const std::vector<std::pair<std::uint16_t, std::uint32_t> > &properties) {
+        const std::uint32_t object = bytes.size();
+        bytes.push_back(idObject);
+        bytes.push_back(properties.size() & 0xFF);
+        bytes.push_back(properties.size() >> 8);
+        for (const auto &property : properties) {
+            bytes.push_back(property.first & 0xFF);
+            bytes.push_back(property.first >> 8);
+            bytes.push_back(0);
+            bytes.push_back(0);
+            putWord(bytes, property.second);
+        }
+        return object;
+    }
+    std::uint32_t addString(const std::string &text) {
+        const std::uint32_t string = bytes.size();
+        bytes.push_back(idString);
+        bytes.insert(bytes.end(), text.begin(), text.end());
+        bytes.push_back(0);
+        return string;
+    }
+    // The entries must be in key order, as the game's maps are sorted.
+    std::uint32_t addMap(const std::vector<std::pair<std::uint32_t, std::uint32_t> > &entries) {
+        const std::uint32_t map = bytes.size();
+        bytes.push_back(idMap);
+        putWord(bytes, entries.size());
+        for (const auto &entry : entries) {
+            putWord(bytes, entry.first);
+            putWord(bytes, entry.second);
+        }
+        return map;
+    }
+    std::shared_ptr<const GameImage> image() const {
+        return GameImage::fromMemory(bytes.data(), bytes.size());
+    }
+private:
+    static void putWord(std::vector<std::uint8_t> &to, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            to.push_back((value >> (i * 8)) & 0xFF);
+        }
+    }
+    std::vector<std::uint8_t> bytes, code;
+};
+
+// Plays a scene as though it were an option the player picked.
+static void runScene(Game &game, std::uint32_t scene) {
+    game.options.assign(1, Game::Option(optionNameContinue, scene));
+    game.doOption(0);
+    REQUIRE(game.getOutput().find("invalid state") == std::string::npos);
+}
 
 TEST_CASE("Reading data from game memory", "[Game::read]") {
     uint8_t binData[] = {
@@ -15,3 +123,1285 @@ TEST_CASE("Reading data from game memory", "[Game::read]") {
     REQUIRE(game.readShort(1) == 0x0302);
     REQUIRE(game.readWord(0) == 0x04030201);
 }
+
+TEST_CASE("Reading past the end of game memory", "[Game::read]") {
+    uint8_t binData[] = {
+        0x01, 0x02, 0x03, 0x04
+    };
+    Game game;
+    game.setDataAs(binData, 4);
+
+    REQUIRE_THROWS_AS(game.readByte(4), PlayError);
+    REQUIRE_THROWS_AS(game.readShort(3), PlayError);
+    REQUIRE_THROWS_AS(game.readWord(1), PlayError);
+}
+
+TEST_CASE("Loading a missing game file", "[Game::loadDataFromFile]") {
+    Game game;
+    REQUIRE_THROWS_AS(game.loadDataFromFile("no-such-file.bin"), PlayError);
+}
+
+TEST_CASE("Sessions share one loaded image", "[GameImage]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game first, second;
+    first.startWithImage(image);
+    second.startWithImage(image);
+
+    REQUIRE(first.getImage() == second.getImage());
+    REQUIRE(first.getSkillCount() == image->getSkillCount());
+    REQUIRE(first.getOutput() == second.getOutput());
+}
+
+TEST_CASE("Indexed property lookups match the property records", "[GameImage]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    REQUIRE_FALSE(image->getObjectList().empty());
+
+    for (std::uint32_t objRef : image->getObjectList()) {
+        for (int propId = 0; propId <= propCount + 1; ++propId) {
+            REQUIRE(image->getObjectProperty(objRef, propId) == image->scanObjectProperty(objRef, propId));
+            REQUIRE(image->objectHasProperty(objRef, propId) == image->scanObjectHasProperty(objRef, propId));
+        }
+    }
+    REQUIRE_THROWS_AS(image->getObjectProperty(headerSize, propName), PlayError);
+}
+
+TEST_CASE("Cached object names match composing them", "[GameImage::findObjectName]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.startWithImage(image);
+
+    unsigned cached = 0;
+    for (std::uint32_t objRef : image->getObjectList()) {
+        const std::string composed = image->composeObjectName(objRef);
+        const std::string *name = image->findObjectName(objRef);
+        if (name) {
+            REQUIRE(*name == composed);
+            ++cached;
+        }
+        REQUIRE(game.getNameOf(objRef) == composed);
+
+        std::string text = "> ";
+        game.appendNameOf(text, objRef);
+        REQUIRE(text == "> " + composed);
+    }
+    REQUIRE(cached > 0);
+    REQUIRE(image->findObjectName(headerSize) == nullptr);
+}
+
+TEST_CASE("Capitalizing text as it is output", "[OutputSink]") {
+    const char *samples[] = { "a rusty sword", "the  old\tman", "x", " leading space", "" };
+    for (const char *sample : samples) {
+        OutputSink asIs, upperFirst, title;
+        asIs.append(sample, strlen(sample), caseAsIs);
+        upperFirst.append(sample, strlen(sample), caseUpperFirst);
+        title.append(sample, strlen(sample), caseTitle);
+        std::string expected = sample;
+        REQUIRE(asIs.str() == trim(tidyString(expected)));
+        expected = toUpperFirst(sample);
+        REQUIRE(upperFirst.str() == trim(tidyString(expected)));
+        expected = toTitleCase(sample);
+        REQUIRE(title.str() == trim(tidyString(expected)));
+    }
+}
+
+static std::vector<uint8_t> makeMapImage(std::uint32_t flags, const std::vector<std::uint32_t> &keys) {
+    std::vector<uint8_t> image(headerSize, 0);
+    auto putWord = [&image](std::uint32_t pos, std::uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            image[pos + i] = (value >> (i * 8)) & 0xFF;
+        }
+    };
+    image[0] = 'G'; image[1] = 'R'; image[2] = 'P'; image[3] = 'G';
+    putWord(headerSkillTable, headerSize);
+    putWord(headerDamageTypes, headerSize + 1);
+    putWord(headerFlags, flags);
+    image.push_back(0);         // no skills
+    image.push_back(0);         // no damage types
+    image.push_back(idMap);
+    image.resize(image.size() + 4 + keys.size() * gmapEntrySize);
+    putWord(headerSize + 2 + gmapCount, keys.size());
+    for (unsigned i = 0; i < keys.size(); ++i) {
+        putWord(headerSize + 2 + gmapHeader + i * gmapEntrySize, keys[i]);
+        putWord(headerSize + 2 + gmapHeader + i * gmapEntrySize + 4, keys[i] * 10);
+    }
+    return image;
+}
+
+TEST_CASE("Looking up map values", "[GameImage::getFromMap]") {
+    const std::uint32_t mapAddress = headerSize + 2;
+    auto sorted = makeMapImage(hflSortedMaps, { 2, 5, 9, 0x80000000 });
+    auto legacy = makeMapImage(0, { 9, 0x80000000, 2, 5 });
+
+    for (auto &bytes : { sorted, legacy }) {
+        auto image = GameImage::fromMemory(bytes.data(), bytes.size());
+        for (std::uint32_t key : { 2u, 5u, 9u, 0x80000000u }) {
+            REQUIRE(image->mapHasValue(mapAddress, key));
+            REQUIRE(image->getFromMap(mapAddress, key) == key * 10);
+        }
+        for (std::uint32_t key : { 0u, 3u, 10u, 0xFFFFFFFFu }) {
+            REQUIRE_FALSE(image->mapHasValue(mapAddress, key));
+            REQUIRE(image->getFromMap(mapAddress, key) == 0);
+        }
+    }
+    REQUIRE(GameImage::fromMemory(sorted.data(), sorted.size())->hasSortedMaps());
+    REQUIRE_FALSE(GameImage::fromMemory(legacy.data(), legacy.size())->hasSortedMaps());
+}
+
+TEST_CASE("Decoding node bytecode", "[GameImage::decodeAt]") {
+    uint8_t binData[] = {
+        idNode, opPush, 0x06, 0x00, 0x00, 0x00, opJump, opEnd,
+        idNode, opPop, opPush, 0x01, 0x02
+    };
+    auto image = GameImage::fromMemory(binData, sizeof(binData));
+
+    const DecodedCode *first = image->decodeAt(1);
+    REQUIRE(image->decodeAt(1) == first);
+    REQUIRE(first->code.size() == 4);
+    REQUIRE(first->code[0].operand == 6);
+    REQUIRE(first->code[1].opcode == opJump);
+    REQUIRE(first->code[1].address == 6);
+    REQUIRE(first->code[3].opcode == idNode);
+    REQUIRE(first->indexOf(6) == 1);
+    REQUIRE(first->indexOf(7) == 2);
+    REQUIRE(first->indexOf(2) == -1);
+    REQUIRE(first->indexOf(9) == -1);
+
+    // the last node ends in a truncated push
+    const DecodedCode *second = image->decodeAt(9);
+    REQUIRE(second->code.size() == 2);
+    REQUIRE(second->code[1].opcode == dopTruncated);
+    REQUIRE(second->code[1].address == 10);
+}
+
+TEST_CASE("Decoding global variable instructions", "[GameImage::decodeAt]") {
+    uint8_t binData[] = {
+        idNode, opFetchGlobal, 0x02, 0x01, opStoreGlobal, 0x03, 0x00, opEnd,
+        idNode, opStoreGlobal, 0x01
+    };
+    auto image = GameImage::fromMemory(binData, sizeof(binData));
+
+    const DecodedCode *code = image->decodeAt(1);
+    REQUIRE(code->code[0].opcode == opFetchGlobal);
+    REQUIRE(code->code[0].operand == 0x0102);
+    REQUIRE(code->code[1].operand == 3);
+    REQUIRE(code->indexOf(7) == 2);
+
+    const DecodedCode *truncated = image->decodeAt(9);
+    REQUIRE(truncated->code.size() == 1);
+    REQUIRE(truncated->code[0].opcode == dopTruncated);
+}
+
+TEST_CASE("Global variable slots", "[GameImage::findGlobal]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    REQUIRE(image->getGlobalCount() > 0);
+
+    const std::uint32_t table = image->readWord(headerGlobals);
+    REQUIRE(image->readByte(table) == idGlobals);
+    REQUIRE(image->readWord(table + 1) == image->getGlobalCount());
+    for (unsigned i = 0; i < image->getGlobalCount(); ++i) {
+        const std::uint32_t key = image->readWord(table + 5 + i * 4);
+        REQUIRE(image->findGlobal(key) == static_cast<int>(i));
+        REQUIRE(image->findGlobal(key + 1) != static_cast<int>(i));
+    }
+
+    // files without a globals table keep everything in storage
+    uint8_t binData[headerSize] = { 0 };
+    REQUIRE(GameImage::fromMemory(binData, sizeof(binData))->getGlobalCount() == 0);
+}
+
+TEST_CASE("Global slots and storage keys share values", "[Game::storeGlobal]") {
+    auto plain = GameImage::loadFromFile("game.bin");
+    REQUIRE(plain->getGlobalCount() > 0);
+    const std::uint16_t slot = plain->getGlobalCount() - 1;
+    const std::uint32_t key = plain->readWord(plain->readWord(headerGlobals) + 5 + slot * 4);
+
+    PatchedGame patched;
+    const std::uint32_t comma = patched.addString(",");
+    patched.push(key).push(77).op(opStore);
+    const std::uint32_t storeByKey = patched.addScene();
+    patched.push(88).opGlobal(opStoreGlobal, slot);
+    const std::uint32_t storeBySlot = patched.addScene();
+    patched.opGlobal(opFetchGlobal, slot).op(opSayNumber).push(comma).op(opSay);
+    patched.push(key).op(opFetch).op(opSayNumber).push(comma).op(opSay);
+    const std::uint32_t show = patched.addScene();
+    auto image = patched.image();
+
+    Game game;
+    game.startWithImage(image);
+    game.setUndoLimit(100, 1 << 20);
+    runScene(game, storeByKey);
+    runScene(game, show);
+    REQUIRE(game.getOutput().find("77,77,") != std::string::npos);
+    runScene(game, storeBySlot);
+    runScene(game, show);
+    REQUIRE(game.getOutput().find("88,88,") != std::string::npos);
+
+    // saving and restoring keeps the shared value
+    std::stringstream saved;
+    game.saveState(saved);
+    Game restored;
+    restored.useImage(image);
+    restored.restoreState(saved);
+    runScene(restored, show);
+    REQUIRE(restored.getOutput().find("88,88,") != std::string::npos);
+
+    // undoing the slot store puts back the value stored by key
+    REQUIRE(game.undo());
+    REQUIRE(game.undo());
+    runScene(game, show);
+    REQUIRE(game.getOutput().find("77,77,") != std::string::npos);
+}
+
+TEST_CASE("Fusing common instruction sequences", "[GameImage::decodeAt]") {
+    uint8_t binData[] = {
+        idNode,
+        opPush, 0x01, 0x00, 0x00, 0x00,     // 1: push 1
+        opPush, 0x02, 0x00, 0x00, 0x00,     // 6: push 2
+        opAddOption,                        // 11
+        opPush, 0x01, 0x00, 0x00, 0x00,     // 12: push 1
+        opFetch,                            // 17
+        opPush, 0x06, 0x00, 0x00, 0x00,     // 18: push 6
+        opJumpTrue,                         // 23
+        opPush, 0x00, 0x01, 0x00, 0x00,     // 24: push 256
+        opJump,                             // 29
+        opEnd                               // 30
+    };
+    auto image = GameImage::fromMemory(binData, sizeof(binData));
+    const DecodedCode *code = image->decodeAt(1);
+    const std::vector<DecodedInstruction> &insns = code->code;
+
+    REQUIRE(insns[0].opcode == dopPushPushAddOption);
+    REQUIRE(insns[0].length == 3);
+    REQUIRE(insns[0].operand == 1);
+    REQUIRE(insns[0].operand2 == 2);
+    // the covered instructions remain for jumps that land on them
+    REQUIRE(insns[1].opcode == opPush);
+    REQUIRE(insns[2].opcode == opAddOption);
+
+    REQUIRE(insns[3].opcode == dopPushFetch);
+    REQUIRE(insns[5].opcode == dopPushJumpTrue);
+    REQUIRE(insns[5].target == 1);
+    REQUIRE(insns[7].opcode == dopPushJump);
+    REQUIRE(insns[7].target == -1);
+    REQUIRE(insns[9].opcode == opEnd);
+}
+
+TEST_CASE("Profiling node execution", "[Profiler]") {
+    Profiler profiler;
+    Game game;
+    game.setProfiler(&profiler);
+    game.loadDataFromFile("game.bin");
+
+    std::uint64_t opcodeCount = 0;
+    for (std::uint16_t opcode = 0; opcode <= dopLastOpcode; ++opcode) {
+        opcodeCount += profiler.getOpcodeStats(opcode).count;
+    }
+    REQUIRE(opcodeCount == game.getDispatchStats().dispatches);
+
+    std::uint64_t nodeCount = 0;
+    for (const auto &node : profiler.getNodeStats()) {
+        REQUIRE(node.second.calls > 0);
+        nodeCount += node.second.instructions;
+    }
+    REQUIRE(nodeCount == opcodeCount);
+
+    REQUIRE(Profiler::opcodeName(opPush) == "push");
+    REQUIRE(Profiler::opcodeName(dopPushSay) == "push+say");
+    REQUIRE(Profiler::opcodeName(0xF0) == "0xf0");
+}
+
+TEST_CASE("Profiling a node that fails", "[Profiler]") {
+    PatchedGame patched;
+    patched.push(1).op(0xF0);
+    const std::uint32_t failing = patched.addNode();
+    patched.push(0).push(failing).op(opCallNode);
+    const std::uint32_t caller = patched.addScene();
+
+    Profiler profiler;
+    Game game;
+    game.startWithImage(patched.image());
+    game.setProfiler(&profiler);
+    game.options.assign(1, Game::Option(optionNameContinue, caller));
+    game.doOption(0);
+    REQUIRE(game.getOutput().find("invalid state") != std::string::npos);
+
+    // both nodes were left by the exception, so nothing is still being timed
+    REQUIRE(profiler.getNodeStats().at(failing).calls == 1);
+    REQUIRE_FALSE(profiler.isTiming());
+}
+
+TEST_CASE("Running without superinstructions", "[Profiler]") {
+    Profiler fusedProfiler, unfusedProfiler;
+    Game fused, unfused, unprofiled;
+    fused.setProfiler(&fusedProfiler);
+    unfused.setProfiler(&unfusedProfiler);
+    fused.setRandomSeed(5);
+    unfused.setRandomSeed(5);
+    unprofiled.setRandomSeed(5);
+    fused.startWithImage(GameImage::loadFromFile("game.bin"));
+    unfused.startWithImage(GameImage::loadFromFile("game.bin", false));
+    unprofiled.startWithImage(fused.getImage());
+    REQUIRE(unfused.getOutput() == fused.getOutput());
+    unprofiled.getOutput();
+
+    RandomGenerator chooser(5);
+    for (int i = 0; i < 300 && !fused.options.empty(); ++i) {
+        const unsigned choice = chooser.below(fused.options.size());
+        fused.doOption(choice);
+        unfused.doOption(choice);
+        unprofiled.doOption(choice);
+        REQUIRE(unfused.getOutput() == fused.getOutput());
+        unprofiled.getOutput();
+    }
+
+    const Game::DispatchStats &withFusion = fused.getDispatchStats();
+    const Game::DispatchStats &withoutFusion = unfused.getDispatchStats();
+    REQUIRE(withoutFusion.dispatches == withoutFusion.instructions);
+    REQUIRE(withoutFusion.instructions == withFusion.instructions);
+    REQUIRE(withFusion.dispatches < withoutFusion.dispatches);
+    // nothing is counted without a profiler
+    REQUIRE(unprofiled.getDispatchStats().dispatches == 0);
+}
+
+TEST_CASE("Loading profiler labels", "[Profiler]") {
+    const char *filename = "tests/profiler_labels.txt";
+    {
+        std::ofstream out(filename);
+        out << "LABELS (5):\n";
+        out << "0x00000010: start\n";
+        out << "zzz: not_an_address\n";
+        out << "0x20junk: trailing_junk\n";
+        out << ": no_address\n";
+        out << "0x1ffffffff: too_big\n";
+        out << "0x00000030: combat\n";
+    }
+    Profiler profiler;
+    REQUIRE(profiler.loadLabels(filename));
+    std::remove(filename);
+
+    REQUIRE(profiler.symbolize(0x10) == "start");
+    REQUIRE(profiler.symbolize(0x30) == "combat");
+    REQUIRE(profiler.symbolize(0x20) == "0x00000020");
+    REQUIRE(profiler.symbolize(0) == "0x00000000");
+    REQUIRE(profiler.symbolize(0xFFFFFFFF) == "0xffffffff");
+    REQUIRE_FALSE(profiler.loadLabels("tests/no_such_labels.txt"));
+}
+
+TEST_CASE("Operand stack frames", "[OperandStack]") {
+    OperandStack stack;
+    stack.push(1);
+    stack.push(2);
+    {
+        OperandStackFrame frame(stack);
+        REQUIRE(stack.isEmpty());
+        REQUIRE_THROWS_AS(stack.pop(), PlayError);
+        stack.push(3);
+        REQUIRE(stack.size() == 1);
+        REQUIRE(stack.peek() == 3);
+        REQUIRE_THROWS_AS(stack.peek(1), PlayError);
+    }
+    REQUIRE(stack.size() == 2);
+    REQUIRE(stack.pop() == 2);
+
+    stack.setLimits(OperandStack::initialSize * 2, 2);
+    {
+        OperandStackFrame first(stack);
+        OperandStackFrame second(stack);
+        REQUIRE_THROWS_AS(OperandStackFrame(stack), PlayError);
+    }
+    for (unsigned i = 1; i < OperandStack::initialSize; ++i) {
+        stack.push(i);
+    }
+    REQUIRE(stack.allocationCount() == 0);
+    for (unsigned i = 0; i < OperandStack::initialSize; ++i) {
+        stack.push(i);
+    }
+    REQUIRE(stack.allocationCount() == 1);
+    REQUIRE_THROWS_AS(stack.push(0), PlayError);
+}
+
+TEST_CASE("Node calls reuse the operand stack", "[OperandStack]") {
+    Profiler profiler;
+    Game game;
+    game.loadDataFromFile("game.bin");
+    game.setProfiler(&profiler);
+    for (int i = 0; i < 200 && !game.options.empty(); ++i) {
+        game.doOption(i % game.options.size());
+    }
+    REQUIRE(profiler.getNodeCalls() > 0);
+    REQUIRE(profiler.getStackAllocations() == 0);
+}
+
+TEST_CASE("Called nodes get their own temps", "[Game::doNode]") {
+    const std::uint32_t temp0 = storageFirstTemp, temp1 = storageFirstTemp - 1;
+    const std::uint32_t temp2 = storageFirstTemp - 2, temp4 = storageFirstTemp - 4;
+    PatchedGame patched;
+    const std::uint32_t comma = patched.addString(",");
+    auto sayTemp = [&patched, comma](std::uint32_t temp) {
+        patched.push(temp).op(opFetch).op(opSayNumber).push(comma).op(opSay);
+    };
+
+    // the callee shows two of its temps, then adds 100 to its argument in
+    // temp0, sets temp1 and returns temp0
+    sayTemp(temp1);
+    sayTemp(temp4);
+    patched.push(temp0).push(temp0).op(opFetch).push(100).op(opAdd).op(opStore);
+    patched.push(temp1).push(55).op(opStore);
+    patched.push(temp0).op(opFetch);
+    const std::uint32_t callee = patched.addNode();
+
+    // the caller sets its own temps around calling it
+    patched.push(temp0).push(7).op(opStore);
+    patched.push(temp2).push(9).op(opStore);
+    patched.push(temp4).push(42).op(opStore);
+    patched.push(5).push(1).push(callee).op(opCallNode);
+    patched.op(opSayNumber).push(comma).op(opSay);
+    sayTemp(temp0);
+    sayTemp(temp1);
+    sayTemp(temp2);
+    sayTemp(temp4);
+    const std::uint32_t caller = patched.addScene();
+
+    // a later scene sees what the first left in its temps, and calls the
+    // callee with no argument
+    for (unsigned i = 0; i < storageTempCount; ++i) {
+        sayTemp(storageFirstTemp - i);
+    }
+    patched.push(0).push(callee).op(opCallNode).op(opSayNumber);
+    const std::uint32_t after = patched.addScene();
+
+    Game game;
+    game.startWithImage(patched.image());
+    runScene(game, caller);
+    // the callee starts with only its argument and the caller's temps survive
+    REQUIRE(game.getOutput().find("0,0,105,7,0,9,42,") != std::string::npos);
+
+    // clearing after the scene zeroed the caller's temps, and the next call
+    // starts from zeros again rather than what the last one left
+    runScene(game, after);
+    REQUIRE(game.getOutput().find("0,0,0,0,0,0,0,0,0,0,0,0,100") != std::string::npos);
+}
+
+TEST_CASE("Storage table matches a std::map", "[StorageTable]") {
+    StorageTable table;
+    std::map<std::uint32_t, std::uint32_t> reference;
+    std::mt19937 rng(13);
+
+    // a small key range forces long probe runs and many removals
+    for (int i = 0; i < 20000; ++i) {
+        std::uint32_t key = rng() % 512;
+        if (i % 7 == 0) key = rng();
+        std::uint32_t value = rng() % 3 == 0 ? 0 : rng();
+        table.set(key, value);
+        if (value) {
+            reference[key] = value;
+        } else {
+            reference.erase(key);
+        }
+        REQUIRE(table.get(key) == value);
+    }
+
+    REQUIRE(table.size() == reference.size());
+    for (std::uint32_t key = 0; key < 512; ++key) {
+        auto entry = reference.find(key);
+        REQUIRE(table.get(key) == (entry == reference.end() ? 0 : entry->second));
+    }
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > expected(reference.begin(), reference.end());
+    REQUIRE(table.entries() == expected);
+}
+
+TEST_CASE("Storage table serialization", "[StorageTable]") {
+    StorageTable table;
+    table.set(0x1234, 1);
+    table.set(0x1240, 97);
+    table.set(0xFFFFFFF0, 0x80000000);
+
+    std::stringstream data;
+    table.write(data);
+    // count, then three deltas and values
+    REQUIRE(data.str().size() == 1 + 2 + 1 + 1 + 1 + 5 + 5);
+
+    StorageTable restored;
+    restored.set(5, 5);
+    restored.read(data);
+    REQUIRE(restored.size() == 3);
+    REQUIRE(restored.get(5) == 0);
+    REQUIRE(restored.entries() == table.entries());
+
+    std::stringstream truncated(data.str().substr(0, 4));
+    REQUIRE_THROWS_AS(restored.read(truncated), PlayError);
+}
+
+TEST_CASE("Item list stays in name order", "[ItemList]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    std::vector<std::uint32_t> named;
+    for (std::uint32_t objRef : image->getObjectList()) {
+        if (image->getNameOrder(objRef) >= 0) {
+            named.push_back(objRef);
+        }
+    }
+    REQUIRE(named.size() > 1);
+    auto nameOf = [&image](std::uint32_t objRef) {
+        return std::string(image->getString(image->getObjectProperty(objRef, propName)));
+    };
+    for (std::uint32_t a : named) {
+        for (std::uint32_t b : named) {
+            REQUIRE((image->getNameOrder(a) < image->getNameOrder(b)) == (nameOf(a) < nameOf(b)));
+        }
+    }
+
+    // the old inventory: a vector searched linearly and placed by name
+    ItemList list;
+    std::vector<CarriedItem> reference;
+    std::mt19937 rng(7);
+    for (int i = 0; i < 5000; ++i) {
+        const std::uint32_t itemIdent = named[rng() % named.size()];
+        auto item = std::find_if(reference.begin(), reference.end(), [itemIdent](const CarriedItem &ci) {
+            return ci.itemIdent == itemIdent;
+        });
+        const int index = list.find(itemIdent);
+        REQUIRE(index == (item == reference.end() ? -1 : item - reference.begin()));
+
+        if (item == reference.end()) {
+            auto pos = std::upper_bound(reference.begin(), reference.end(), nameOf(itemIdent),
+                                        [&nameOf](const std::string &name, const CarriedItem &ci) {
+                return name < nameOf(ci.itemIdent);
+            });
+            const unsigned position = pos - reference.begin();
+            reference.insert(pos, CarriedItem(1, itemIdent));
+            REQUIRE(list.insert(CarriedItem(1, itemIdent), image->getNameOrder(itemIdent)) == position);
+        } else if (rng() % 2) {
+            reference.erase(item);
+            list.erase(index);
+        } else {
+            ++item->qty;
+            list.setQty(index, list[index].qty + 1);
+        }
+
+        REQUIRE(list.size() == reference.size());
+        for (unsigned j = 0; j < reference.size(); ++j) {
+            REQUIRE(list[j].itemIdent == reference[j].itemIdent);
+            REQUIRE(list[j].qty == reference[j].qty);
+            REQUIRE(list.find(reference[j].itemIdent) == static_cast<int>(j));
+        }
+    }
+
+    // items sharing a key (as unnamed ones do) keep the order they came in,
+    // and ones put back where they were removed from keep their place
+    ItemList shared;
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > sharedReference;  // ident, key
+    const std::uint32_t sharedKeys[] = { 0, 1, 0xFFFFFFFF };
+    for (int i = 0; i < 3000; ++i) {
+        const std::uint32_t itemIdent = rng() % 200;
+        const int index = shared.find(itemIdent);
+        if (index < 0) {
+            const std::uint32_t key = sharedKeys[itemIdent % 3];
+            auto pos = std::upper_bound(sharedReference.begin(), sharedReference.end(), key,
+                                        [](std::uint32_t k, const std::pair<std::uint32_t, std::uint32_t> &entry) {
+                return k < entry.second;
+            });
+            const unsigned position = pos - sharedReference.begin();
+            sharedReference.insert(pos, std::make_pair(itemIdent, key));
+            REQUIRE(shared.insert(CarriedItem(1, itemIdent), key) == position);
+        } else {
+            const auto removed = sharedReference[index];
+            sharedReference.erase(sharedReference.begin() + index);
+            shared.erase(index);
+            if (rng() % 2) {
+                sharedReference.insert(sharedReference.begin() + index, removed);
+                shared.insertAt(index, CarriedItem(1, removed.first), removed.second);
+            }
+        }
+
+        REQUIRE(shared.size() == sharedReference.size());
+        for (unsigned j = 0; j < sharedReference.size(); ++j) {
+            REQUIRE(shared[j].itemIdent == sharedReference[j].first);
+            REQUIRE(shared.find(sharedReference[j].first) == static_cast<int>(j));
+        }
+    }
+    REQUIRE_FALSE(sharedReference.empty());
+    shared.clear();
+    REQUIRE(shared.find(sharedReference[0].first) == -1);
+
+    // an item can also be put back ahead of others sharing its key
+    for (std::uint32_t itemIdent = 1; itemIdent <= 100; ++itemIdent) {
+        REQUIRE(shared.insert(CarriedItem(1, itemIdent), 0xFFFFFFFF) == itemIdent - 1);
+    }
+    shared.erase(shared.find(50));
+    shared.insertAt(0, CarriedItem(1, 50), 0xFFFFFFFF);
+    REQUIRE(shared.find(50) == 0);
+    REQUIRE(shared.find(49) == 49);
+    REQUIRE(shared.find(51) == 50);
+    REQUIRE(shared.insert(CarriedItem(1, 101), 0xFFFFFFFF) == 100);
+
+    // putting an item back anywhere but between lower and higher keys fails
+    ItemList ordered;
+    ordered.insert(CarriedItem(1, 1), 5);
+    ordered.insert(CarriedItem(1, 2), 10);
+    REQUIRE_THROWS_AS(ordered.insertAt(0, CarriedItem(1, 3), 7), PlayError);
+    REQUIRE_THROWS_AS(ordered.insertAt(2, CarriedItem(1, 3), 7), PlayError);
+    REQUIRE_THROWS_AS(ordered.insertAt(3, CarriedItem(1, 3), 12), PlayError);
+    REQUIRE(ordered.size() == 2);
+    REQUIRE(ordered.find(3) == -1);
+    ordered.insertAt(1, CarriedItem(1, 3), 7);
+    REQUIRE(ordered.find(3) == 1);
+    REQUIRE(ordered.find(2) == 2);
+}
+
+TEST_CASE("Weighted picks match the expanded deck", "[WeightedSampler]") {
+    std::mt19937 rng(15);
+    std::uniform_int_distribution<int> weightDist(-2, 40);
+    for (int round = 0; round < 50; ++round) {
+        WeightedSampler sampler;
+        std::vector<std::uint32_t> deck;
+        for (std::uint32_t item = 1; item <= 20; ++item) {
+            const int weight = weightDist(rng);
+            sampler.add(item, weight);
+            for (int j = 0; j < weight; ++j) {
+                deck.push_back(item);
+            }
+        }
+
+        REQUIRE(sampler.totalWeight() == deck.size());
+        for (std::uint64_t roll = 0; roll < deck.size(); ++roll) {
+            REQUIRE(sampler.pick(roll) == deck[roll]);
+        }
+    }
+}
+
+TEST_CASE("Weighted picks follow the weights", "[WeightedSampler]") {
+    const int weights[] = { 1, 5, 0, 20, 1000, 74 };
+    const int itemCount = sizeof(weights) / sizeof(weights[0]);
+    WeightedSampler sampler;
+    for (int i = 0; i < itemCount; ++i) {
+        sampler.add(i, weights[i]);
+    }
+
+    const int draws = 200000;
+    std::vector<int> seen(itemCount);
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<std::uint64_t> rollDist(0, sampler.totalWeight() - 1);
+    for (int i = 0; i < draws; ++i) {
+        ++seen[sampler.pick(rollDist(rng))];
+    }
+
+    // chi-squared over the five items that can be picked (4 degrees of
+    // freedom); 18.47 is the 0.1% critical value
+    double chiSquared = 0.0;
+    for (int i = 0; i < itemCount; ++i) {
+        const double expected = static_cast<double>(draws) * weights[i] / sampler.totalWeight();
+        if (expected == 0.0) {
+            REQUIRE(seen[i] == 0);
+            continue;
+        }
+        chiSquared += (seen[i] - expected) * (seen[i] - expected) / expected;
+    }
+    REQUIRE(chiSquared < 18.47);
+
+    WeightedSampler empty;
+    empty.add(1, 0);
+    REQUIRE(empty.totalWeight() == 0);
+    REQUIRE_THROWS_AS(empty.pick(0), PlayError);
+}
+
+TEST_CASE("Random generator matches the xoshiro128** reference", "[RandomGenerator]") {
+    const char stateBytes[] = {
+        1, 0, 0, 0,  2, 0, 0, 0,  3, 0, 0, 0,  4, 0, 0, 0
+    };
+    std::stringstream state(std::string(stateBytes, sizeof(stateBytes)));
+    RandomGenerator rng;
+    rng.read(state);
+
+    REQUIRE(rng.next() == 11520);
+    REQUIRE(rng.next() == 0);
+    REQUIRE(rng.next() == 5927040);
+    REQUIRE(rng.next() == 70819200);
+
+    std::stringstream zeroState(std::string(16, '\0'));
+    REQUIRE_THROWS_AS(rng.read(zeroState), PlayError);
+    std::stringstream truncated(std::string(stateBytes, 10));
+    REQUIRE_THROWS_AS(rng.read(truncated), PlayError);
+}
+
+TEST_CASE("Random generator state round trips", "[RandomGenerator]") {
+    RandomGenerator rng(42);
+    for (int i = 0; i < 10; ++i) {
+        rng.next();
+    }
+    std::stringstream state;
+    rng.write(state);
+    REQUIRE(state.str().size() == 16);
+
+    RandomGenerator restored(7);
+    REQUIRE(restored != rng);
+    restored.read(state);
+    REQUIRE(restored == rng);
+    for (int i = 0; i < 10; ++i) {
+        REQUIRE(restored.next() == rng.next());
+    }
+
+    REQUIRE(RandomGenerator(1) == RandomGenerator(1));
+    REQUIRE(RandomGenerator(1) != RandomGenerator(2));
+}
+
+TEST_CASE("Bounded random values", "[RandomGenerator]") {
+    RandomGenerator rng(16);
+    std::vector<int> seen(6);
+    for (int i = 0; i < 60000; ++i) {
+        const std::uint32_t value = rng.below(6);
+        REQUIRE(value < 6);
+        ++seen[value];
+    }
+    for (int count : seen) {
+        REQUIRE(count > 9500);
+        REQUIRE(count < 10500);
+    }
+    REQUIRE(rng.below(1) == 0);
+}
+
+TEST_CASE("Games with the same seed replay identically", "[Game::setRandomSeed]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    std::string transcripts[2];
+    for (std::string &transcript : transcripts) {
+        Game game;
+        game.setRandomSeed(2018);
+        game.startWithImage(image);
+        RandomGenerator chooser(5);
+        transcript = game.getOutput();
+        for (int i = 0; i < 300 && !game.options.empty(); ++i) {
+            game.doOption(chooser.below(game.options.size()));
+            transcript += game.getOutput();
+        }
+    }
+    REQUIRE(transcripts[0] == transcripts[1]);
+}
+
+TEST_CASE("Headless combat runs to a result", "[Game::startCombat]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.setRandomSeed(17);
+    game.startWithImage(image);
+
+    std::vector<std::uint32_t> allies, enemies;
+    for (std::uint32_t objRef : image->getObjectList()) {
+        if (game.getObjectProperty(objRef, propClass) != ocCharacter) continue;
+        if (game.getObjectProperty(objRef, propFaction) == 0) {
+            if (allies.empty()) allies.push_back(objRef);
+        } else if (game.getObjectProperty(objRef, propAi) != 0) {
+            enemies.push_back(objRef);
+        }
+    }
+    REQUIRE(allies.size() == 1);
+    REQUIRE_FALSE(enemies.empty());
+
+    const unsigned roundLimit = 30;
+    game.setAutoCombat(true, roundLimit);
+    for (int fight = 0; fight < 20; ++fight) {
+        game.startCombat(allies, enemies);
+        REQUIRE(game.combatants.size() == allies.size() + enemies.size());
+        for (int turn = 0; game.isInCombat(); ++turn) {
+            REQUIRE(turn < 1000);
+            REQUIRE_FALSE(game.options.empty());
+            game.doOption(0);
+        }
+
+        const Game::CombatStats &stats = game.getCombatStats();
+        REQUIRE(stats.rounds >= 1);
+        REQUIRE(stats.rounds <= roundLimit);
+        if (game.combatStatus() == 1) {
+            REQUIRE(stats.damageByAllies > 0);
+        } else if (game.combatStatus() == -1) {
+            REQUIRE(stats.damageByEnemies > 0);
+        }
+        REQUIRE(game.party == allies);
+    }
+}
+
+TEST_CASE("Gear lists stay ordered by slot", "[Game::GearList]") {
+    Game::GearList gear;
+    REQUIRE(gear.empty());
+    REQUIRE_FALSE(gear.has(5));
+    REQUIRE(gear.get(5) == 0);
+
+    gear.set(5, 500);
+    gear.set(1, 100);
+    gear.set(3, 300);
+    gear.set(3, 301);
+    REQUIRE(gear.size() == 3);
+    REQUIRE(gear.has(3));
+    REQUIRE(gear.get(3) == 301);
+
+    std::vector<Game::GearList::Entry> expected = { {1, 100}, {3, 301}, {5, 500} };
+    REQUIRE(std::vector<Game::GearList::Entry>(gear.begin(), gear.end()) == expected);
+
+    gear.remove(1);
+    gear.remove(4);
+    REQUIRE(gear.size() == 2);
+    REQUIRE_FALSE(gear.has(1));
+    REQUIRE(gear.begin()->first == 3);
+    gear.clear();
+    REQUIRE(gear.empty());
+}
+
+TEST_CASE("Characters are pooled and keep their records", "[Game::getCharacter]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.setRandomSeed(3);
+    game.startWithImage(image);
+
+    std::vector<std::uint32_t> characters;
+    for (std::uint32_t objRef : image->getObjectList()) {
+        if (game.getObjectProperty(objRef, propClass) == ocCharacter) {
+            characters.push_back(objRef);
+        }
+    }
+    REQUIRE(characters.size() > 1);
+
+    // every character gets its own stat block, and creating more characters
+    // leaves the earlier records where they were
+    const unsigned blockSize = game.getSkillCount() * 3 + game.getDamageTypeCount();
+    std::vector<Game::Character*> records;
+    for (unsigned i = 0; i < characters.size(); ++i) {
+        Game::Character *c = game.getCharacter(characters[i]);
+        REQUIRE(c != nullptr);
+        REQUIRE(c->def == characters[i]);
+        for (Game::Character *other : records) {
+            REQUIRE((c->stats + blockSize <= other->stats || other->stats + blockSize <= c->stats));
+        }
+        c->resistAdj(0) = 1000 + i;
+        records.push_back(c);
+    }
+    for (unsigned i = 0; i < characters.size(); ++i) {
+        REQUIRE(game.getCharacter(characters[i]) == records[i]);
+        REQUIRE(records[i]->resistAdj(0) == static_cast<int>(1000 + i));
+    }
+
+    // resetting a character reuses its record and block
+    std::vector<std::uint32_t> allies, enemies;
+    for (std::uint32_t objRef : characters) {
+        if (game.getObjectProperty(objRef, propFaction) == 0) {
+            if (allies.empty()) allies.push_back(objRef);
+        } else {
+            enemies.push_back(objRef);
+        }
+    }
+    REQUIRE_FALSE(enemies.empty());
+    Game::Character *enemy = game.getCharacter(enemies[0]);
+    int *enemyStats = enemy->stats;
+    game.startCombat(allies, enemies);
+    REQUIRE(game.getCharacter(enemies[0]) == enemy);
+    REQUIRE(enemy->stats == enemyStats);
+    REQUIRE(enemy->resistAdj(0) == 0);
+
+    // a restored game rebuilds the pool with the same values
+    enemy->resistAdj(0) = 77;
+    std::stringstream saved;
+    game.saveState(saved);
+    Game restored;
+    restored.useImage(image);
+    restored.restoreState(saved);
+    for (std::uint32_t cRef : characters) {
+        const Game::Character *before = game.getCharacter(cRef);
+        Game::Character *after = restored.getCharacter(cRef);
+        REQUIRE(std::equal(after->stats, after->stats + game.getSkillCount() * 2, before->stats));
+        REQUIRE(after->resistAdj(0) == before->stats[game.getSkillCount() * 3]);
+    }
+}
+
+TEST_CASE("Cached stats follow every change", "[Game::getSkillMax]") {
+    auto plain = GameImage::loadFromFile("game.bin");
+    std::uint32_t who = 0, item = 0;
+    int skill = -1, variableSkill = -1;
+    for (std::uint32_t objRef : plain->getObjectList()) {
+        const std::uint32_t objClass = plain->getObjectProperty(objRef, propClass);
+        if (objClass == ocCharacter && plain->getObjectProperty(objRef, propFaction) == 0 && !who) {
+            who = objRef;
+        } else if (objClass == ocItem && plain->getObjectProperty(objRef, propSlot) && !item) {
+            item = objRef;
+        }
+    }
+    for (int i = 0; i < plain->getSkillCount(); ++i) {
+        const SkillDef &skillDef = *plain->getSkillDef(i);
+        if (skillDef.testFlags(sklVariable) && skillDef.testFlags(sklKOZero)) {
+            if (variableSkill < 0) variableSkill = i;
+        } else if (skill < 0) {
+            skill = i;
+        }
+    }
+    REQUIRE(who);
+    REQUIRE(item);
+    REQUIRE(skill >= 0);
+    REQUIRE(variableSkill >= 0);
+
+    // the demo's items don't change skills, so equip a copy of one that does
+    PatchedGame patched;
+    std::vector<std::pair<std::uint32_t, std::uint32_t> > bonuses = { {skill, 4}, {variableSkill, 2} };
+    std::sort(bonuses.begin(), bonuses.end());
+    item = patched.addObject({
+        {propName, plain->getObjectProperty(item, propName)},
+        {propClass, ocItem},
+        {propSlot, plain->getObjectProperty(item, propSlot)},
+        {propSkills, patched.addMap(bonuses)}
+    });
+    patched.push(item).push(2).op(opAddItems).op(opPop);
+    const std::uint32_t addItem = patched.addScene();
+    patched.push(who).push(skill).push(-3).op(opAdjSkill);
+    patched.push(who).push(variableSkill).push(5).op(opAdjSkill);
+    const std::uint32_t adjustMax = patched.addScene();
+    patched.push(who).push(variableSkill).push(-100000).op(opAdjSkillCur);
+    const std::uint32_t knockOut = patched.addScene();
+    patched.push(who).push(item).op(opSetEquip);
+    const std::uint32_t setEquip = patched.addScene();
+    auto image = patched.image();
+
+    Game game;
+    game.setRandomSeed(5);
+    game.startWithImage(image);
+    game.setUndoLimit(100, 1 << 20);
+    REQUIRE(game.statCacheCurrent(who));
+
+    const std::uint32_t slot = game.getObjectProperty(item, propSlot);
+    const std::uint32_t startingGear = game.getCharacter(who)->gear.get(slot);
+    auto step = [&game, who](const char *what, std::function<void()> change) {
+        INFO(what);
+        change();
+        REQUIRE(game.statCacheCurrent(who));
+    };
+    step("add items", [&]() { runScene(game, addItem); });
+    step("equipItem", [&]() { game.equipItem(who, game.inventory.find(item)); });
+    REQUIRE(game.getCharacter(who)->gear.get(slot) == item);
+    step("unequipItem", [&]() { game.unequipItem(who, slot); });
+    REQUIRE_FALSE(game.getCharacter(who)->gear.has(slot));
+    step("set-equip opcode", [&]() { runScene(game, setEquip); });
+    step("adjSkillMax", [&]() { runScene(game, adjustMax); });
+    step("adjSkillCur", [&]() { runScene(game, knockOut); });
+    REQUIRE(game.isKOed(who));
+
+    std::stringstream saved;
+    game.saveState(saved);
+
+    step("undo adjSkillCur", [&]() { REQUIRE(game.undo()); });
+    REQUIRE_FALSE(game.isKOed(who));
+    step("undo adjSkillMax", [&]() { REQUIRE(game.undo()); });
+    step("undo set-equip", [&]() { REQUIRE(game.undo()); });
+    step("undo unequipItem", [&]() { REQUIRE(game.undo()); });
+    REQUIRE(game.getCharacter(who)->gear.get(slot) == item);
+    step("undo equipItem", [&]() { REQUIRE(game.undo()); });
+    REQUIRE(game.getCharacter(who)->gear.get(slot) == startingGear);
+
+    step("restoreState", [&]() { game.restoreState(saved); });
+    REQUIRE(game.isKOed(who));
+    REQUIRE(game.getCharacter(who)->gear.get(slot) == item);
+}
+
+TEST_CASE("Restored games continue identically", "[Game::saveState]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.setRandomSeed(2019);
+    game.startWithImage(image);
+    RandomGenerator chooser(9);
+    for (int i = 0; i < 60 && !game.options.empty(); ++i) {
+        game.doOption(chooser.below(game.options.size()));
+    }
+
+    std::stringstream snapshot;
+    game.saveState(snapshot);
+    const RandomGenerator savedChooser = chooser;
+    const std::string savedOutput = game.getOutput();
+
+    // a restored game runs no setup, so it starts out with the same output
+    Game restored;
+    restored.useImage(image);
+    restored.restoreState(snapshot);
+    REQUIRE(restored.getOutput() == savedOutput);
+
+    std::string transcripts[2];
+    Game *games[2] = { &game, &restored };
+    for (int i = 0; i < 2; ++i) {
+        chooser = savedChooser;
+        for (int turn = 0; turn < 300 && !games[i]->options.empty(); ++turn) {
+            games[i]->doOption(chooser.below(games[i]->options.size()));
+            transcripts[i] += games[i]->getOutput();
+        }
+    }
+    REQUIRE(transcripts[0] == transcripts[1]);
+
+    std::stringstream first, second;
+    game.saveState(first);
+    restored.saveState(second);
+    REQUIRE(first.str() == second.str());
+}
+
+TEST_CASE("Rejecting unusable snapshots", "[Game::restoreState]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.setRandomSeed(4);
+    game.startWithImage(image);
+    std::stringstream snapshot;
+    game.saveState(snapshot);
+    const std::string data = snapshot.str();
+
+    // a failed restore leaves the game untouched
+    game.doOption(0);
+    std::stringstream before;
+    game.saveState(before);
+    std::stringstream truncated(data.substr(0, data.size() - 1));
+    REQUIRE_THROWS_AS(game.restoreState(truncated), PlayError);
+    std::stringstream garbage("not a snapshot");
+    REQUIRE_THROWS_AS(game.restoreState(garbage), PlayError);
+    std::stringstream after;
+    game.saveState(after);
+    REQUIRE(after.str() == before.str());
+
+    std::ifstream file("game.bin", std::ios::binary);
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ++bytes[headerBuildNumber];
+    Game rebuilt;
+    rebuilt.setDataAs(bytes.data(), bytes.size());
+    std::stringstream copy(data);
+    REQUIRE_THROWS_AS(rebuilt.restoreState(copy), PlayError);
+}
+
+TEST_CASE("Undoing turns puts back the earlier state", "[Game::undo]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.setRandomSeed(2020);
+    game.startWithImage(image);
+    game.setUndoLimit(100, 1 << 20);
+    REQUIRE_FALSE(game.undo());
+
+    RandomGenerator chooser(3);
+    std::vector<std::string> snapshots;
+    for (int i = 0; i < 150 && !game.options.empty(); ++i) {
+        std::stringstream snapshot;
+        game.saveState(snapshot);
+        snapshots.push_back(snapshot.str());
+        game.doOption(chooser.below(game.options.size()));
+    }
+    REQUIRE(game.undoDepth() == 100);
+
+    // undo as far as the history goes, checking every step
+    for (int i = 0; i < 100; ++i) {
+        REQUIRE(game.undo());
+        std::stringstream snapshot;
+        game.saveState(snapshot);
+        REQUIRE(snapshot.str() == snapshots[snapshots.size() - 1 - i]);
+    }
+    REQUIRE_FALSE(game.undo());
+    REQUIRE(game.undoMemoryUsed() == 0);
+
+    // the game carries on as before after an undo
+    Game replay;
+    replay.useImage(image);
+    std::stringstream start(snapshots[snapshots.size() - 100]);
+    replay.restoreState(start);
+    RandomGenerator chooserA(8), chooserB(8);
+    for (int i = 0; i < 50 && !game.options.empty(); ++i) {
+        game.doOption(chooserA.below(game.options.size()));
+        replay.doOption(chooserB.below(replay.options.size()));
+        REQUIRE(game.getOutput() == replay.getOutput());
+    }
+}
+
+TEST_CASE("Undo history stays within its memory limit", "[Game::setUndoLimit]") {
+    auto image = GameImage::loadFromFile("game.bin");
+    Game game;
+    game.setRandomSeed(7);
+    game.startWithImage(image);
+    const size_t limit = 8 * 1024;
+    game.setUndoLimit(1000, limit);
+
+    RandomGenerator chooser(1);
+    for (int i = 0; i < 500 && !game.options.empty(); ++i) {
+        game.doOption(chooser.below(game.options.size()));
+        REQUIRE(game.undoMemoryUsed() <= limit);
+    }
+    REQUIRE(game.undoDepth() > 1);
+    REQUIRE(game.undoDepth() < 500);
+
+    game.setUndoLimit(0, 0);
+    REQUIRE(game.undoDepth() == 0);
+    REQUIRE_FALSE(game.undo());
+}
+
+TEST_CASE("Undoing puts removed items back in place", "[Game::undo]") {
+    auto plain = GameImage::loadFromFile("game.bin");
+    std::vector<std::uint32_t> named;
+    for (std::uint32_t objRef : plain->getObjectList()) {
+        if (plain->getObjectProperty(objRef, propClass) == ocItem && plain->getNameOrder(objRef) >= 0) {
+            named.push_back(objRef);
+        }
+    }
+    REQUIRE(named.size() >= 2);
+    std::sort(named.begin(), named.end(), [&plain](std::uint32_t a, std::uint32_t b) {
+        return plain->getNameOrder(a) < plain->getNameOrder(b);
+    });
+    REQUIRE(plain->getNameOrder(named[0]) < plain->getNameOrder(named[1]));
+
+    // unindexed items share the last sort key and so are kept in the order
+    // they were added
+    PatchedGame patched;
+    const std::uint32_t unnamedA = patched.addObject({ {propClass, ocItem} });
+    const std::uint32_t unnamedB = patched.addObject({ {propClass, ocItem} });
+    const std::uint32_t comma = patched.addString(",");
+
+    const std::pair<std::uint32_t, std::uint32_t> pairs[] = {
+        std::make_pair(named[0], named[1]), std::make_pair(unnamedA, unnamedB)
+    };
+    for (const auto &items : pairs) {
+        const std::uint32_t first = items.first, second = items.second;
+        patched.push(first).push(3).op(opAddItems).op(opPop);
+        patched.push(second).push(2).op(opAddItems).op(opPop);
+        const std::uint32_t addBoth = patched.addScene();
+        patched.push(first).push(3).op(opRemoveItems).op(opPop);
+        patched.push(second).push(2).op(opRemoveItems).op(opPop);
+        patched.push(first).push(1).op(opAddItems).op(opPop);
+        const std::uint32_t shuffle = patched.addScene();
+        const std::uint32_t nothing = patched.addScene();
+        patched.push(first).op(opItemQty).op(opSayNumber).push(comma).op(opSay);
+        patched.push(second).op(opItemQty).op(opSayNumber).push(comma).op(opSay);
+        const std::uint32_t showQty = patched.addScene();
+
+        Game game;
+        game.startWithImage(patched.image());
+        game.setUndoLimit(100, 1 << 20);
+        runScene(game, addBoth);
+        runScene(game, shuffle);
+        runScene(game, nothing);
+        REQUIRE(game.inventory.size() == 1);
+
+        REQUIRE(game.undo());
+        REQUIRE(game.undo());
+        REQUIRE(game.inventory.size() == 2);
+        REQUIRE(game.inventory[0].itemIdent == first);
+        REQUIRE(game.inventory[0].qty == 3);
+        REQUIRE(game.inventory[1].itemIdent == second);
+        REQUIRE(game.inventory[1].qty == 2);
+        REQUIRE(game.inventory.find(first) == 0);
+        REQUIRE(game.inventory.find(second) == 1);
+        runScene(game, showQty);
+        REQUIRE(game.getOutput().find("3,2,") != std::string::npos);
+    }
+}
+
+TEST_CASE("Undoing puts back sex and species", "[Game::undo]") {
+    auto plain = GameImage::loadFromFile("game.bin");
+    std::uint32_t who = 0;
+    std::vector<std::uint32_t> sexes, species;
+    for (std::uint32_t objRef : plain->getObjectList()) {
+        const std::uint32_t objClass = plain->getObjectProperty(objRef, propClass);
+        if (objClass == ocCharacter && !who) {
+            who = objRef;
+        } else if (objClass == ocSex) {
+            sexes.push_back(objRef);
+        } else if (objClass == ocSpecies) {
+            species.push_back(objRef);
+        }
+    }
+    REQUIRE(who);
+    REQUIRE(sexes.size() >= 2);
+    REQUIRE(species.size() >= 1);
+
+    Game game;
+    game.startWithImage(plain);
+    const std::uint32_t oldSex = game.getCharacter(who)->sex;
+    const std::uint32_t oldSpecies = game.getCharacter(who)->species;
+    const std::uint32_t newSex = sexes[0] == oldSex ? sexes[1] : sexes[0];
+    std::uint32_t newSpecies = species[0];
+    for (std::uint32_t s : species) {
+        if (s != oldSpecies) newSpecies = s;
+    }
+
+    PatchedGame patched;
+    patched.push(who).push(newSex).op(opSetSex);
+    patched.push(who).push(newSpecies).op(opSetSpecies);
+    patched.push(who).push(oldSex).op(opSetSex);
+    patched.push(who).push(newSex).op(opSetSex);
+    const std::uint32_t change = patched.addScene();
+    const std::uint32_t nothing = patched.addScene();
+
+    game.startWithImage(patched.image());
+    game.setUndoLimit(100, 1 << 20);
+    runScene(game, change);
+    REQUIRE(game.getCharacter(who)->sex == newSex);
+    REQUIRE(game.getCharacter(who)->species == newSpecies);
+    runScene(game, nothing);
+
+    // the second undo comes after the turn was compacted
+    REQUIRE(game.undo());
+    REQUIRE(game.undo());
+    REQUIRE(game.getCharacter(who)->sex == oldSex);
+    REQUIRE(game.getCharacter(who)->species == oldSpecies);
+}
+
+TEST_CASE("Parsing server requests", "[parseJsonObject]") {
+    JsonObject request;
+    std::string error;
+    REQUIRE(parseJsonObject(" {\"cmd\": \"option\", \"session\": 12, \"id\": \"a\\n\\u00e9\", "
+                            "\"debug\": true, \"note\": null, \"x\": -1.5 } ", request, error));
+    REQUIRE(request.size() == 6);
+    REQUIRE(request["cmd"].text == "option");
+    REQUIRE(request["session"].type == JsonValue::Number);
+    REQUIRE(request["session"].number == 12);
+    REQUIRE(request["id"].text == "a\n\xC3\xA9");
+    REQUIRE(request["debug"].boolean);
+    REQUIRE(request["note"].type == JsonValue::Null);
+    REQUIRE(request["x"].number == -1.5);
+
+    REQUIRE(parseJsonObject("{}", request, error));
+    REQUIRE(request.empty());
+    REQUIRE_FALSE(parseJsonObject("{\"a\": [1]}", request, error));
+    REQUIRE_FALSE(parseJsonObject("{\"a\": 1", request, error));
+    REQUIRE_FALSE(parseJsonObject("{\"a\": 1} x", request, error));
+    REQUIRE_FALSE(parseJsonObject("{\"a\": \"\\q\"}", request, error));
+
+    REQUIRE(jsonString("say \"hi\"\n\\\x01") == "\"say \\\"hi\\\"\\n\\\\\\u0001\"");
+}
+
+TEST_CASE("Reading whole numbers from requests", "[getJsonInteger]") {
+    JsonObject request;
+    std::string error;
+    REQUIRE(parseJsonObject("{\"zero\": 0, \"index\": 2147483647, \"address\": 4294967295, "
+                            "\"big\": 4294967296, \"huge\": 1e30, \"infinite\": 1e400, "
+                            "\"fraction\": 1.7, \"negative\": -1, \"text\": \"3\"}", request, error));
+
+    std::uint64_t value = 99;
+    REQUIRE(getJsonInteger(request, "zero", INT_MAX, value, error));
+    REQUIRE(value == 0);
+    REQUIRE(getJsonInteger(request, "index", INT_MAX, value, error));
+    REQUIRE(value == INT_MAX);
+    REQUIRE(getJsonInteger(request, "address", UINT32_MAX, value, error));
+    REQUIRE(value == UINT32_MAX);
+
+    REQUIRE_FALSE(getJsonInteger(request, "address", INT_MAX, value, error));
+    REQUIRE(error == "bad address");
+    const char *rejected[] = { "big", "huge", "infinite", "fraction", "negative", "text" };
+    for (const char *name : rejected) {
+        INFO(name);
+        REQUIRE_FALSE(getJsonInteger(request, name, UINT32_MAX, value, error));
+        REQUIRE(error == std::string("bad ") + name);
+    }
+    REQUIRE_FALSE(getJsonInteger(request, "absent", UINT32_MAX, value, error));
+    REQUIRE(error == "missing absent");
+    REQUIRE(value == UINT32_MAX);
+}
+
+TEST_CASE("Latency histogram percentiles", "[LatencyHistogram]") {
+    LatencyHistogram histogram;
+    REQUIRE(histogram.percentile(0.5) == 0);
+
+    for (int i = 0; i < 90; ++i) {
+        histogram.record(3);        // bucket 2, 2 to 4 us
+    }
+    for (int i = 0; i < 10; ++i) {
+        histogram.record(1000);     // bucket 10, 512 to 1024 us
+    }
+    REQUIRE(histogram.count() == 100);
+    REQUIRE(histogram.bucket(2) == 90);
+    REQUIRE(histogram.bucket(10) == 10);
+    REQUIRE(histogram.max() == 1000);
+    REQUIRE(histogram.percentile(0.5) == 4);
+    REQUIRE(histogram.percentile(0.89) == 4);
+    REQUIRE(histogram.percentile(0.9) == 1000);
+    REQUIRE(histogram.percentile(1.0) == 1000);
+}
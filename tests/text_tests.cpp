@@ -1,6 +1,8 @@
 #define CATCH_CONFIG_MAIN
 #include "catch.hpp"
 
+#include <random>
+
 #include "../play.src/play.h"
 
 
@@ -100,3 +102,114 @@ TEST_CASE("Long text is wordwrapped correctly", "[wrapText]" ) {
     REQUIRE(lines[4] == "fugiat nulla pariatur. Excepteur sint occaecat cupidatat non proident, sunt in");
     REQUIRE(lines[5] == "culpa qui officia deserunt mollit anim id est laborum.");
 }
+
+TEST_CASE("Tidying whitespace", "[tidyString]") {
+    std::string text;
+    REQUIRE(tidyString(text) == "");
+    text = "a  b\t\tc";
+    REQUIRE(tidyString(text) == "a b c");
+    text = "line one   \n   line two\r\n\r\nline three";
+    REQUIRE(tidyString(text) == "line one\nline two\nline three");
+    text = "a \t \n b";
+    REQUIRE(tidyString(text) == "a\nb");
+    text = "\tkept";
+    REQUIRE(tidyString(text) == "\tkept");
+}
+
+// The original implementation, which erased characters one at a time; the
+// cur == 0 check covers the case where it read before the start of text.
+static std::string& referenceTidyString(std::string &text) {
+    size_t cur = 1;
+    while (cur < text.size()) {
+        if (text[cur] == '\t') text[cur] = ' ';
+        if (text[cur] == '\r') text[cur] = '\n';
+        if (cur == 0) {
+            ++cur;
+        } else if (isspace(text[cur]) && text[cur] == text[cur - 1]) {
+            text.erase(cur, 1);
+        } else if (text[cur - 1] == '\n' && isspace(text[cur])) {
+            text.erase(cur, 1);
+        } else if (text[cur] == '\n' && isspace(text[cur - 1])) {
+            text.erase(cur - 1, 1);
+            --cur;
+        } else {
+            ++cur;
+        }
+    }
+    return text;
+}
+
+TEST_CASE("Tidying matches the original implementation", "[tidyString]") {
+    const char alphabet[] = "ab. \t\n\r\v";
+    std::mt19937 rng(21);
+    std::uniform_int_distribution<int> lengthDist(0, 60);
+    std::uniform_int_distribution<int> charDist(0, sizeof(alphabet) - 2);
+    for (int i = 0; i < 20000; ++i) {
+        std::string text(lengthDist(rng), ' ');
+        for (char &c : text) {
+            c = alphabet[charDist(rng)];
+        }
+        std::string expected = text;
+        referenceTidyString(expected);
+        REQUIRE(tidyString(text) == expected);
+    }
+}
+
+TEST_CASE("Trimming a single character", "[trim]") {
+    REQUIRE(trim("a ") == "a");
+    REQUIRE(trim(" a") == "a");
+}
+
+// Keeps everything it's given, as a transcript or network session would.
+class CaptureConsumer : public OutputConsumer {
+public:
+    CaptureConsumer()
+    : turns(0)
+    { }
+    void beginOutput() override {
+        ++turns;
+        text.clear();
+    }
+    void writeOutput(const std::string &piece) override {
+        text += piece;
+    }
+
+    int turns;
+    std::string text;
+};
+
+TEST_CASE("Output sink matches tidying afterwards", "[OutputSink]") {
+    const char alphabet[] = "ab. \t\n\r\v";
+    std::mt19937 rng(22);
+    std::uniform_int_distribution<int> lengthDist(0, 80);
+    std::uniform_int_distribution<int> charDist(0, sizeof(alphabet) - 2);
+    std::uniform_int_distribution<int> pieceDist(1, 6);
+
+    OutputSink sink;
+    CaptureConsumer capture;
+    sink.addConsumer(&capture);
+    for (int i = 0; i < 20000; ++i) {
+        std::string text(lengthDist(rng), ' ');
+        for (char &c : text) {
+            c = alphabet[charDist(rng)];
+        }
+
+        sink.clear();
+        for (size_t pos = 0; pos < text.size(); ) {
+            const size_t length = std::min<size_t>(pieceDist(rng), text.size() - pos);
+            sink.append(text.substr(pos, length));
+            pos += length;
+        }
+        std::string expected = text;
+        expected = trim(tidyString(expected));
+        REQUIRE(sink.str() == expected);
+        REQUIRE(capture.text == expected);
+
+        OutputSink copy;
+        copy.assign(sink.rawText());
+        copy.append("z");
+        sink.append("z");
+        REQUIRE(copy.str() == sink.str());
+    }
+    REQUIRE(capture.turns == 20000);
+}